@@ -56,10 +56,15 @@ struct _GraphicsHandle {
     guint32 inv_projection_valid : 1;
     guint32 in_tmp_rotation : 1;
     guint32 in_tmp_translation : 1;
-    guint32 display_list_initialized : 1;
-    guint32 display_list_valid : 1;
-
-    Matrix *matrix_data;
+    guint32 display_lists_valid : 1;
+    guint32 mesh_valid : 1;
+    guint32 matrix_data_changed : 1;
+    guint32 follow_frames : 1;
+
+    MatrixView *matrix_data;
+    /* kept to follow the next view in place if there are frames to step
+     * to, see matrix_mesh_change_view() */
+    MatrixMesh *mesh;
     double alpha_channel;
 
     double max;
@@ -77,7 +82,9 @@ struct _GraphicsHandle {
 
     UtilRectangle render_area;
 
-    GLuint display_list;
+    /* one for each tile of the mesh, made again when it changes */
+    GLuint display_lists;
+    guint32 n_display_lists;
 };
 
 void graphics_get_far_planes(GraphicsHandle *handle, double *planes)
@@ -421,8 +428,8 @@ GraphicsHandle *graphics_init(void)
 
     handle->alpha_channel = 1.0f;
 
-    handle->display_list_valid = 0;
-    handle->display_list_initialized = 0;
+    handle->display_lists_valid = 0;
+    handle->mesh_valid = 0;
 
     return handle;
 }
@@ -437,8 +444,10 @@ void graphics_cleanup(GraphicsHandle *handle)
         g_free(handle->overlay_data);
     if (handle->overlay_tex_id)
         glDeleteTextures(1, &handle->overlay_tex_id);
-    if (handle->display_list_initialized)
-        glDeleteLists(handle->display_list, 1);
+    if (handle->n_display_lists)
+        glDeleteLists(handle->display_lists, handle->n_display_lists);
+    matrix_mesh_free(handle->mesh);
+    matrix_view_unref(handle->matrix_data);
     g_free(handle);
 }
 
@@ -471,75 +480,113 @@ void _graphics_render_block(double x, double y, double z, double dx, double dy)
     glVertex3f(x, y + dy, z);
 }
 
-void graphics_render_matrix(GraphicsHandle *handle)
+static void _graphics_compile_tile(GraphicsHandle *handle, guint32 tile)
 {
-    if (handle->matrix_data == NULL)
-        return;
+    MatrixMeshIndexed *indexed = matrix_mesh_get_indexed_tile(handle->mesh, tile);
+    double color[4];
+    guint64 k;
+    int j;
 
-    if (handle->display_list_initialized == 0) {
-        handle->display_list = glGenLists(1);
-        handle->display_list_initialized = 1;
-    }
-    if (handle->display_list_valid == 1) {
-        glCallList(handle->display_list);
+    glNewList(handle->display_lists + tile, GL_COMPILE);
+    if (!indexed) {
+        glEndList();
         return;
     }
 
-    MatrixMesh *mesh = matrix_mesh_new();
-    matrix_mesh_set_alpha_channel(mesh, handle->alpha_channel);
-    matrix_mesh_set_matrix(mesh, handle->matrix_data);
-    MatrixMeshIter fiter;
-    MatrixMeshFace *face;
-
-    int j;
-
-    glNewList(handle->display_list, GL_COMPILE_AND_EXECUTE);
-
-    glDisable(GL_TEXTURE_RECTANGLE_ARB);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_GEQUAL);
-
     glPolygonOffset(0.0, 0.0);
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glBegin(GL_QUADS);
 
-    for (matrix_mesh_iter_init(mesh, &fiter);
-         matrix_mesh_iter_is_valid(mesh, &fiter);
-         matrix_mesh_iter_next(mesh, &fiter)) {
-        face = &mesh->chunk_faces[fiter.chunk][fiter.offset];
-        glColor4f(face->color_rgba[0], face->color_rgba[1], face->color_rgba[2], face->color_rgba[3]);
+    for (k = 0; k < indexed->n_faces; ++k) {
+        matrix_mesh_indexed_get_color(indexed, k, color);
+        glColor4f(color[0], color[1], color[2], color[3]);
 
         for (j = 0; j < 4; ++j)
-            glVertex3f(face->vertices[j][0], face->vertices[j][1], face->vertices[j][2]);
+            glVertex3fv(indexed->vertices + 3 * (gsize)indexed->indices[4 * k + j]);
     }
 
-
     glEnd();
 
     glPolygonOffset(-8.0, 5.0);
-    glDisable(GL_LINE_STIPPLE);
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glLineWidth(0.5f);
-    glBegin(GL_QUADS);
+    glColor3f(0.4, 0.4, 0.4);
 
-    for (matrix_mesh_iter_init(mesh, &fiter);
-         matrix_mesh_iter_is_valid(mesh, &fiter);
-         matrix_mesh_iter_next(mesh, &fiter)) {
-        face = &mesh->chunk_faces[fiter.chunk][fiter.offset];
-        glColor3f(0.4, 0.4, 0.4);
+    /* the outlines only need the shared corners */
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, indexed->vertices);
+    glDrawElements(GL_QUADS, 4 * indexed->n_faces, GL_UNSIGNED_INT, indexed->indices);
+    glDisableClientState(GL_VERTEX_ARRAY);
 
-        for (j = 0; j < 4; ++j)
-            glVertex3f(face->vertices[j][0], face->vertices[j][1], face->vertices[j][2]);
+    glEndList();
+
+    matrix_mesh_indexed_free(indexed);
+}
+
+/* The mesh follows the matrix data in place if possible, and only the display
+ * lists of the tiles that changed are compiled again: stepping through frames
+ * in which a few entries change costs as much as these. Without frames to step
+ * to, the mesh is freed once the display lists are compiled. */
+static void _graphics_update_display_lists(GraphicsHandle *handle)
+{
+    guint32 n_tiles, tile;
+
+    if (handle->mesh == NULL) {
+        handle->mesh = matrix_mesh_new();
+        matrix_mesh_set_alpha_channel(handle->mesh, handle->alpha_channel);
+        matrix_mesh_set_track_changes(handle->mesh, handle->follow_frames);
+    }
+    if (!handle->mesh_valid)
+        matrix_mesh_set_view(handle->mesh, handle->matrix_data);
+    else if (handle->mesh->view != handle->matrix_data)
+        matrix_mesh_change_view(handle->mesh, handle->matrix_data);
+    handle->mesh_valid = 1;
+
+    n_tiles = matrix_mesh_get_n_tiles(handle->mesh);
+    if (n_tiles != handle->n_display_lists) {
+        if (handle->n_display_lists)
+            glDeleteLists(handle->display_lists, handle->n_display_lists);
+        handle->display_lists = n_tiles ? glGenLists(n_tiles) : 0;
+        handle->n_display_lists = handle->display_lists ? n_tiles : 0;
+        handle->display_lists_valid = 0;
     }
 
-    glEnd();
+    for (tile = 0; tile < handle->n_display_lists; ++tile) {
+        if (!handle->display_lists_valid || handle->mesh->tiles_changed[tile]) {
+            _graphics_compile_tile(handle, tile);
+            handle->mesh->tiles_changed[tile] = 0;
+        }
+    }
+    handle->display_lists_valid = 1;
+    handle->matrix_data_changed = 0;
 
-    glEndList();
-    handle->display_list_valid = 1;
+    if (!handle->follow_frames) {
+        matrix_mesh_free(handle->mesh);
+        handle->mesh = NULL;
+        handle->mesh_valid = 0;
+    }
+}
+
+void graphics_render_matrix(GraphicsHandle *handle)
+{
+    guint32 tile;
+
+    if (handle->matrix_data == NULL)
+        return;
+
+    if (!handle->display_lists_valid || handle->matrix_data_changed)
+        _graphics_update_display_lists(handle);
+
+    glDisable(GL_TEXTURE_RECTANGLE_ARB);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_GEQUAL);
 
-    matrix_mesh_free(mesh);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDisable(GL_LINE_STIPPLE);
+    glLineWidth(0.5f);
+
+    for (tile = 0; tile < handle->n_display_lists; ++tile)
+        glCallList(handle->display_lists + tile);
 }
 
 void graphics_world_to_screen(GraphicsHandle *handle,
@@ -672,7 +719,9 @@ void graphics_render_overlay_tiks(GraphicsHandle *handle, cairo_t *cr, UtilRecta
     if (sy > yr[1]) yr[1] = sy;\
     } while (0)
 
-        sprintf(buf, "%d", (int)((x+0.5f)*handle->matrix_data->n_columns));
+        /* indices of the source matrix */
+        sprintf(buf, "%" G_GUINT64_FORMAT, handle->matrix_data->region.columns.begin +
+                (guint64)((x+0.5f)*handle->matrix_data->n_columns) * handle->matrix_data->region.columns.step);
         graphics_world_to_screen(handle, x, wy, z_floor, &sx, &sy, NULL);
 
         if (!callback) {
@@ -706,7 +755,8 @@ void graphics_render_overlay_tiks(GraphicsHandle *handle, cairo_t *cr, UtilRecta
                      buf, userdata);
         }
 
-        sprintf(buf, "%d", (int)((0.5f-x)*handle->matrix_data->n_rows));
+        sprintf(buf, "%" G_GUINT64_FORMAT, handle->matrix_data->region.rows.begin +
+                (guint64)((0.5f-x)*handle->matrix_data->n_rows) * handle->matrix_data->region.rows.step);
         graphics_world_to_screen(handle, wx, x, z_floor, &sx, &sy, NULL);
 
         if (!callback) {
@@ -965,23 +1015,11 @@ void graphics_set_window_size(GraphicsHandle *handle, int width, int height)
     graphics_overlay_init(handle);
 }
 
-void graphics_update_matrix_data(GraphicsHandle *handle)
+static void _graphics_update_range(GraphicsHandle *handle)
 {
     /* determine max/min value and set range to scale */
-    Matrix *matrix = handle->matrix_data;
-    MatrixIter iter;
     double max, min;
-    matrix_iter_init(matrix, &iter);
-    if (matrix_iter_is_valid(matrix, &iter)) {
-        max = min = matrix->chunks[iter.chunk][iter.offset];
-    }
-    matrix_iter_next(matrix, &iter);
-    for ( ; matrix_iter_is_valid(matrix, &iter); matrix_iter_next(matrix, &iter)) {
-        if (max < matrix->chunks[iter.chunk][iter.offset])
-            max = matrix->chunks[iter.chunk][iter.offset];
-        if (min > matrix->chunks[iter.chunk][iter.offset])
-            min = matrix->chunks[iter.chunk][iter.offset];
-    }
+    matrix_mesh_get_range(handle->matrix_data, &min, &max);
 
     handle->max = max;
     handle->min = min;
@@ -989,15 +1027,39 @@ void graphics_update_matrix_data(GraphicsHandle *handle)
 
     g_print("max/min/z_scale: %f/%f/%f\n", max, min, handle->z_scale);
     graphics_recalc_scale_vector(handle);
+}
 
-    handle->display_list_valid = 0;
+/* The entries of the matrix data changed in place: make the mesh again. */
+void graphics_update_matrix_data(GraphicsHandle *handle)
+{
+    _graphics_update_range(handle);
+
+    handle->mesh_valid = 0;
+    handle->matrix_data_changed = 1;
 }
 
-void graphics_set_matrix_data(GraphicsHandle *handle, Matrix *matrix)
+/* The mesh is changed to the new view when it is drawn next, see
+ * graphics_render_matrix(). */
+void graphics_set_matrix_data(GraphicsHandle *handle, MatrixView *view)
 {
-    handle->matrix_data = matrix;
+    matrix_view_ref(view);
+    matrix_view_unref(handle->matrix_data);
+    handle->matrix_data = view;
+    handle->matrix_data_changed = 1;
+
+    _graphics_update_range(handle);
+}
+
+/* Keep the mesh to follow the next frames in place, see graphics_render_matrix(). */
+void graphics_set_follow_frames(GraphicsHandle *handle, gboolean follow_frames)
+{
+    g_return_if_fail(handle != NULL);
 
-    graphics_update_matrix_data(handle);
+    handle->follow_frames = follow_frames ? 1 : 0;
+    matrix_mesh_free(handle->mesh);
+    handle->mesh = NULL;
+    handle->mesh_valid = 0;
+    handle->display_lists_valid = 0;
 }
 
 void graphics_set_alpha_channel(GraphicsHandle *handle, double alpha_channel)
@@ -1005,6 +1067,8 @@ void graphics_set_alpha_channel(GraphicsHandle *handle, double alpha_channel)
     g_return_if_fail(handle != NULL);
 
     handle->alpha_channel = alpha_channel;
+    matrix_mesh_set_alpha_channel(handle->mesh, alpha_channel);
+    handle->display_lists_valid = 0;
 }
 
 void graphics_save_buffer_to_file(GraphicsHandle *handle, const gchar *filename)
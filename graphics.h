@@ -2,6 +2,7 @@
 
 #include <X11/X.h>
 #include "matrix.h"
+#include "matrix-view.h"
 #include "util-rectangle.h"
 
 typedef struct _GraphicsHandle GraphicsHandle;
@@ -39,8 +40,9 @@ void graphics_camera_arcball_rotate_start(GraphicsHandle *handle, double x, doub
 void graphics_camera_arcball_rotate_update(GraphicsHandle *handle, double x, double y, ArcBallRestriction rst);
 void graphics_camera_arcball_rotate_finish(GraphicsHandle *handle, double x, double y, ArcBallRestriction rst);
 
-void graphics_set_matrix_data(GraphicsHandle *handle, Matrix *matrix);
+void graphics_set_matrix_data(GraphicsHandle *handle, MatrixView *view);
 void graphics_update_matrix_data(GraphicsHandle *handle);
+void graphics_set_follow_frames(GraphicsHandle *handle, gboolean follow_frames);
 void graphics_set_alpha_channel(GraphicsHandle *handle, double alpha_channel);
 
 void graphics_save_buffer_to_file(GraphicsHandle *handle, const gchar *filename);
@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
@@ -13,10 +15,20 @@
 #include "graphics.h"
 #include "gl-widget.h"
 #include "matrix.h"
+#include "matrix-reader.h"
+#include "matrix-rmx.h"
+#include "matrix-binary.h"
+#include "matrix-market.h"
+#include "matrix-decompress.h"
+#include "matrix-frames.h"
 #include "matrix-mesh.h"
+#include "matrix-transform.h"
+#include "matrix-view.h"
 #include "mesh-export.h"
 #include "util-projection.h"
 #include "util-colors.h"
+#include "util-alloc.h"
+#include "util-parallel.h"
 
 struct {
     GtkWidget *glwidget;
@@ -27,15 +39,17 @@ struct {
     GtkWidget *check_alternate_signs;
     GtkWidget *check_shift_signs;
     GtkWidget *check_log_scale;
+    GtkWidget *entry_rows;
+    GtkWidget *entry_columns;
+    GtkWidget *spin_frame;
 
     GList *infiles;
 
-    Matrix *display_matrix;
-    struct {
-        GList *head;
-        GList *tail;
-        GList *current;
-    } matrix_list;
+    /* part of the matrices on display, the whole ones by default */
+    MatrixRegion display_region;
+    MatrixView *display_view;
+    MatrixFrames *frames;
+    guint current_frame;
 
     GraphicsHandle *graphics_handle;
 } appdata;
@@ -50,24 +64,41 @@ struct {
     double export_height;
     double colorbar_pos_x; /* >= 0 -> bounding_box->width + pos, <0: left of plot */
     double z_epsilon;
+    double clip_percentile;
+    double merge_tolerance;
+    gint jobs;
 
     gchar *output_filename;
-    gboolean permutate_entries;
-    gboolean alternate_signs;
-    gboolean shift_signs;
-    gboolean log_scale;
+    gchar *convert_filename;
+    gchar *raw_shape;
+    gchar *raw_dtype;
+    MatrixBinaryLayout raw_layout;
+    gchar *precision_name;
+    MatrixPrecision precision;
+    gchar *rows_slice;
+    gchar *columns_slice;
+    MatrixRegion region;
+    MatrixTransform transform;
+    gchar *transform_expression;
     gboolean optimize;
     gboolean export_standalone;
     gboolean export_colorbar;
     gboolean grayscale;
-    gboolean absolute_values;
-    gboolean show_signum;
+    gboolean huge_pages;
 } config;
 
 void main_config_default(void)
 {
     config.batchmode = FALSE;
     config.output_filename = NULL;
+    config.convert_filename = NULL;
+    config.raw_shape = NULL;
+    config.raw_dtype = NULL;
+    config.precision_name = NULL;
+    config.precision = MATRIX_PRECISION_F64;
+    config.rows_slice = NULL;
+    config.columns_slice = NULL;
+    matrix_region_init(&config.region);
 
     config.azimuth = 65.0;
     config.elevation = -60.0;
@@ -77,17 +108,22 @@ void main_config_default(void)
     config.export_height = -1.0;
     config.colorbar_pos_x = 1.0;
     config.z_epsilon = -1.0;
-
-    config.permutate_entries = FALSE;
-    config.alternate_signs = FALSE;
-    config.shift_signs = FALSE;
-    config.log_scale = FALSE;
+    config.clip_percentile = 0.0;
+    config.merge_tolerance = -1.0;
+    config.jobs = 0;
+    config.huge_pages = TRUE;
+
+    config.transform.log_scale = FALSE;
+    config.transform.permutate_entries = FALSE;
+    config.transform.alternate_signs = FALSE;
+    config.transform.shift_signs = FALSE;
+    config.transform.absolute_values = FALSE;
+    config.transform.show_signum = FALSE;
+    config.transform.expression = NULL;
     config.optimize = FALSE;
     config.export_standalone = FALSE;
     config.export_colorbar = TRUE;
     config.grayscale = FALSE;
-    config.absolute_values = FALSE;
-    config.show_signum = FALSE;
 }
 
 static void camera_value_changed(GtkSpinButton *button, gpointer userdata)
@@ -103,46 +139,100 @@ static void camera_value_changed(GtkSpinButton *button, gpointer userdata)
 
 void main_update_display_matrix(void)
 {
-    if (!appdata.matrix_list.current)
+    Matrix *m = matrix_frames_get(appdata.frames, appdata.current_frame);
+
+    if (!m)
         return;
-    matrix_copy(appdata.display_matrix, appdata.matrix_list.current->data);
-    if (config.log_scale)
-        matrix_log_scale(appdata.display_matrix);
-    if (config.permutate_entries)
-        matrix_permutate_matrix(appdata.display_matrix);
-    if (config.alternate_signs)
-        matrix_alternate_signs(appdata.display_matrix, config.shift_signs);
-    if (config.absolute_values)
-        matrix_set_absolute(appdata.display_matrix);
-    if (config.show_signum)
-        matrix_set_signum(appdata.display_matrix);
+    matrix_view_unref(appdata.display_view);
+    appdata.display_view = matrix_view_get(m, &appdata.display_region, &config.transform);
 }
 
 static void matrix_properties_toggled(GtkToggleButton *button, gpointer userdata)
 {
-    config.log_scale =  gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_log_scale));
-    config.permutate_entries = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_permutation));
-    config.alternate_signs = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_alternate_signs));
-    config.shift_signs = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_shift_signs));
+    config.transform.log_scale =  gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_log_scale));
+    config.transform.permutate_entries = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_permutation));
+    config.transform.alternate_signs = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_alternate_signs));
+    config.transform.shift_signs = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(appdata.check_shift_signs));
 
     main_update_display_matrix();
 
-    graphics_update_matrix_data(appdata.graphics_handle);
+    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_view);
 
     gtk_widget_queue_draw(appdata.glwidget);
 }
 
-void main_matrix_next(void)
+/* Show only part of the matrices, e.g. "0:500" or "100:200:2"; an empty entry
+ * shows all rows or columns. Nothing is copied. */
+static void matrix_region_activated(GtkEntry *entry, gpointer userdata)
 {
-    appdata.matrix_list.current = g_list_next(appdata.matrix_list.current);
-    if (appdata.matrix_list.current == NULL)
-        appdata.matrix_list.current = appdata.matrix_list.head;
+    MatrixRegion region = appdata.display_region;
+    MatrixSlice *slice = GTK_WIDGET(entry) == appdata.entry_rows ? &region.rows : &region.columns;
+    const gchar *text = gtk_entry_get_text(entry);
+    MatrixRegion all;
+    Matrix *m;
+
+    matrix_region_init(&all);
+    if (text[0] == '\0')
+        *slice = GTK_WIDGET(entry) == appdata.entry_rows ? all.rows : all.columns;
+    else if (!matrix_parse_slice(text, slice))
+        return;
+
+    m = matrix_frames_get(appdata.frames, appdata.current_frame);
+    if (m && (matrix_slice_count(&region.rows, m->n_rows) == 0 ||
+              matrix_slice_count(&region.columns, m->n_columns) == 0)) {
+        g_printerr("No entries in `%s'.\n", text);
+        return;
+    }
+
+    appdata.display_region = region;
 
     main_update_display_matrix();
-    graphics_update_matrix_data(appdata.graphics_handle);
+    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_view);
     gtk_widget_queue_draw(appdata.glwidget);
 }
 
+/* Show any matrix of the sequence right away; only the ones around it are
+ * read, see MatrixFrames. */
+void main_matrix_seek(guint index)
+{
+    if (index >= matrix_frames_get_count(appdata.frames))
+        return;
+    appdata.current_frame = index;
+
+    main_update_display_matrix();
+    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_view);
+    gtk_widget_queue_draw(appdata.glwidget);
+}
+
+static void frame_value_changed(GtkSpinButton *button, gpointer userdata)
+{
+    guint index = gtk_spin_button_get_value_as_int(button) - 1;
+
+    if (index != appdata.current_frame)
+        main_matrix_seek(index);
+}
+
+/* Step through the matrices with the frame button, wrapping around. */
+static void main_matrix_step(gint step)
+{
+    guint count = matrix_frames_get_count(appdata.frames);
+
+    if (count == 0)
+        return;
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(appdata.spin_frame),
+                              (appdata.current_frame + count + step) % count + 1);
+}
+
+void main_matrix_next(void)
+{
+    main_matrix_step(1);
+}
+
+void main_matrix_previous(void)
+{
+    main_matrix_step(-1);
+}
+
 void main_save_matrix_to_file(const gchar *filename)
 {
     ExportFileType type = mesh_export_get_type_from_filename(filename);
@@ -156,12 +246,8 @@ void main_save_matrix_to_file(const gchar *filename)
     expconfig.colorbar_pos_x = config.colorbar_pos_x;
     expconfig.alpha_channel = config.alpha_channel;
     expconfig.show_colorbar = config.export_colorbar;
-    expconfig.permutate_entries = config.permutate_entries;
-    expconfig.alternate_signs = config.alternate_signs;
-    expconfig.shift_signs = config.shift_signs;
-    expconfig.log_scale = config.log_scale;
-    expconfig.absolute_values = config.absolute_values;
-    expconfig.show_signum = config.show_signum;
+    expconfig.region = appdata.display_region;
+    expconfig.transform = config.transform;
 
     switch (type) {
         case ExportFileTypePNG:
@@ -170,11 +256,12 @@ void main_save_matrix_to_file(const gchar *filename)
         case ExportFileTypePDF:
         case ExportFileTypeSVG:
         case ExportFileTypeTikZ:
+        case ExportFileTypePLY:
             {
 #if 0
                 MatrixMesh *mesh = matrix_mesh_new();
                 matrix_mesh_set_alpha_channel(mesh, config.alpha_channel);
-                matrix_mesh_set_matrix(mesh, appdata.display_matrix);
+                matrix_mesh_set_view(mesh, appdata.display_view);
 
                 double projection[16];
                 util_get_rotation_matrix_from_angles(projection, config.azimuth, config.elevation, config.tilt);
@@ -184,7 +271,11 @@ void main_save_matrix_to_file(const gchar *filename)
 #else
                 double projection[16];
                 util_get_rotation_matrix_from_angles(projection, config.azimuth, config.elevation, config.tilt);
-                mesh_export_matrices_to_files(filename, type, appdata.matrix_list.head, projection, &expconfig);
+                mesh_export_matrices_to_files(filename, type, appdata.frames, projection, &expconfig);
+                /* the frame shown may have been dropped from the cache meanwhile */
+                main_update_display_matrix();
+                if (appdata.graphics_handle)
+                    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_view);
 #endif
             }
             break;
@@ -222,6 +313,11 @@ static void save_to_file_button_clicked(GtkButton *button, gpointer userdata)
     gtk_file_filter_add_pattern(filter, "*.pdf");
     gtk_file_chooser_add_filter(chooser, filter);
 
+    filter = gtk_file_filter_new();
+    gtk_file_filter_set_name(filter, "PLY-Models");
+    gtk_file_filter_add_pattern(filter, "*.ply");
+    gtk_file_chooser_add_filter(chooser, filter);
+
     gint res = gtk_dialog_run(GTK_DIALOG(dialog));
     gchar *filename;
 
@@ -240,7 +336,8 @@ void main_init_ui(void)
 {
     appdata.graphics_handle = graphics_init();
     graphics_set_alpha_channel(appdata.graphics_handle, config.alpha_channel);
-    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_matrix);
+    graphics_set_follow_frames(appdata.graphics_handle, matrix_frames_get_count(appdata.frames) > 1);
+    graphics_set_matrix_data(appdata.graphics_handle, appdata.display_view);
 
     graphics_set_camera(appdata.graphics_handle, config.azimuth, config.elevation, config.tilt);
 
@@ -284,29 +381,47 @@ void main_init_ui(void)
     gtk_box_pack_start(GTK_BOX(hbox), appdata.spin_tilt, FALSE, FALSE, 3);
 
     appdata.check_permutation = gtk_check_button_new_with_label("Reorder entries");
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_permutation), config.permutate_entries);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_permutation), config.transform.permutate_entries);
     g_signal_connect(G_OBJECT(appdata.check_permutation), "toggled",
             G_CALLBACK(matrix_properties_toggled), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), appdata.check_permutation, FALSE, FALSE, 3);
 
     appdata.check_alternate_signs = gtk_check_button_new_with_label("Alternate signs");
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_alternate_signs), config.alternate_signs);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_alternate_signs), config.transform.alternate_signs);
     g_signal_connect(G_OBJECT(appdata.check_alternate_signs), "toggled",
             G_CALLBACK(matrix_properties_toggled), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), appdata.check_alternate_signs, FALSE, FALSE, 3);
 
     appdata.check_shift_signs = gtk_check_button_new_with_label("Shift signs");
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_shift_signs), config.shift_signs);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_shift_signs), config.transform.shift_signs);
     g_signal_connect(G_OBJECT(appdata.check_shift_signs), "toggled",
             G_CALLBACK(matrix_properties_toggled), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), appdata.check_shift_signs, FALSE, FALSE, 3);
 
     appdata.check_log_scale = gtk_check_button_new_with_label("Log scale");
-    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_log_scale), config.log_scale);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(appdata.check_log_scale), config.transform.log_scale);
     g_signal_connect(G_OBJECT(appdata.check_log_scale), "toggled",
             G_CALLBACK(matrix_properties_toggled), NULL);
     gtk_box_pack_start(GTK_BOX(hbox), appdata.check_log_scale, FALSE, FALSE, 3);
 
+    label = gtk_label_new("Rows:");
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 3);
+    appdata.entry_rows = gtk_entry_new();
+    gtk_entry_set_width_chars(GTK_ENTRY(appdata.entry_rows), 10);
+    gtk_entry_set_placeholder_text(GTK_ENTRY(appdata.entry_rows), "all");
+    g_signal_connect(G_OBJECT(appdata.entry_rows), "activate",
+            G_CALLBACK(matrix_region_activated), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), appdata.entry_rows, FALSE, FALSE, 3);
+
+    label = gtk_label_new("Columns:");
+    gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 3);
+    appdata.entry_columns = gtk_entry_new();
+    gtk_entry_set_width_chars(GTK_ENTRY(appdata.entry_columns), 10);
+    gtk_entry_set_placeholder_text(GTK_ENTRY(appdata.entry_columns), "all");
+    g_signal_connect(G_OBJECT(appdata.entry_columns), "activate",
+            G_CALLBACK(matrix_region_activated), NULL);
+    gtk_box_pack_start(GTK_BOX(hbox), appdata.entry_columns, FALSE, FALSE, 3);
+
     button = gtk_button_new_with_label("Save image");
     g_signal_connect(G_OBJECT(button), "clicked",
             G_CALLBACK(save_to_file_button_clicked), NULL);
@@ -317,6 +432,21 @@ void main_init_ui(void)
             G_CALLBACK(main_matrix_next), NULL);
     gtk_box_pack_end(GTK_BOX(hbox), button, FALSE, FALSE, 3);
 
+    button = gtk_button_new_with_label("Previous");
+    g_signal_connect(G_OBJECT(button), "clicked",
+            G_CALLBACK(main_matrix_previous), NULL);
+    gtk_box_pack_end(GTK_BOX(hbox), button, FALSE, FALSE, 3);
+
+    appdata.spin_frame = gtk_spin_button_new_with_range(1.0, MAX(matrix_frames_get_count(appdata.frames), 1), 1.0);
+    gtk_spin_button_set_wrap(GTK_SPIN_BUTTON(appdata.spin_frame), TRUE);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(appdata.spin_frame), appdata.current_frame + 1);
+    g_signal_connect(G_OBJECT(appdata.spin_frame), "value-changed",
+            G_CALLBACK(frame_value_changed), NULL);
+    gtk_box_pack_end(GTK_BOX(hbox), appdata.spin_frame, FALSE, FALSE, 3);
+
+    label = gtk_label_new("Frame:");
+    gtk_box_pack_end(GTK_BOX(hbox), label, FALSE, FALSE, 3);
+
 
     gtk_box_pack_start(GTK_BOX(vbox), appdata.glwidget, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 2);
@@ -328,9 +458,11 @@ void main_init_ui(void)
 
 void main_cleanup(void)
 {
-    matrix_free(appdata.display_matrix);
-    g_list_free_full(appdata.matrix_list.head, (GDestroyNotify)matrix_free);
+    matrix_view_unref(appdata.display_view);
+    matrix_view_cache_clear();
+    matrix_frames_free(appdata.frames);
     g_list_free_full(appdata.infiles, g_free);
+    matrix_expression_free(config.transform.expression);
 
     graphics_cleanup(appdata.graphics_handle);
 }
@@ -341,13 +473,14 @@ static GOptionEntry _command_line_options[] = {
     { "azimuth", 'a', 0, G_OPTION_ARG_DOUBLE, &config.azimuth, "Azimuth", "Angle in degree",  },
     { "elevation", 'e', 0, G_OPTION_ARG_DOUBLE, &config.elevation, "Elevation", "Angle in degree" },
     { "tilt", 't', 0, G_OPTION_ARG_DOUBLE, &config.tilt, "Tilt", "Angle in degree" },
-    { "permutate-entries", 'P', 0, G_OPTION_ARG_NONE, &config.permutate_entries, "Permutate entries", NULL },
-    { "reorder-entries", 'R', 0, G_OPTION_ARG_NONE, &config.permutate_entries, "same as --permutate-entries", NULL },
-    { "alternate-signs", 'A', 0, G_OPTION_ARG_NONE, &config.alternate_signs, "Overlay matrix with alternating signs", NULL },
-    { "absolute-values", 0, 0, G_OPTION_ARG_NONE, &config.absolute_values, "Only show magnitude of entries", NULL },
-    { "show-signum", 0, 0, G_OPTION_ARG_NONE, &config.show_signum, "Only show sign of entries", NULL },
-    { "shift-signs", 'S', 0, G_OPTION_ARG_NONE, &config.shift_signs, "Shift signs (only with --alternate-signs)", NULL },
-    { "log-scale", 'L', 0, G_OPTION_ARG_NONE, &config.log_scale, "Use log-scale, i.e. sgn(value) * log(1+|value|)", NULL },
+    { "permutate-entries", 'P', 0, G_OPTION_ARG_NONE, &config.transform.permutate_entries, "Permutate entries", NULL },
+    { "reorder-entries", 'R', 0, G_OPTION_ARG_NONE, &config.transform.permutate_entries, "same as --permutate-entries", NULL },
+    { "alternate-signs", 'A', 0, G_OPTION_ARG_NONE, &config.transform.alternate_signs, "Overlay matrix with alternating signs", NULL },
+    { "absolute-values", 0, 0, G_OPTION_ARG_NONE, &config.transform.absolute_values, "Only show magnitude of entries", NULL },
+    { "show-signum", 0, 0, G_OPTION_ARG_NONE, &config.transform.show_signum, "Only show sign of entries", NULL },
+    { "shift-signs", 'S', 0, G_OPTION_ARG_NONE, &config.transform.shift_signs, "Shift signs (only with --alternate-signs)", NULL },
+    { "log-scale", 'L', 0, G_OPTION_ARG_NONE, &config.transform.log_scale, "Use log-scale, i.e. sgn(value) * log(1+|value|)", NULL },
+    { "transform", 0, 0, G_OPTION_ARG_STRING, &config.transform_expression, "Transform entries by an expression of x, i, j, rows and cols, e.g. \"log10(abs(x)+1e-12)\"", "EXPR" },
     { "output", 'o', 0, G_OPTION_ARG_FILENAME, &config.output_filename, "Output filename", "Filename" },
     { "optimize", 'O', 0, G_OPTION_ARG_NONE, &config.optimize, "Remove hidden faces from output", NULL },
     { "alpha", 'T', 0, G_OPTION_ARG_DOUBLE, &config.alpha_channel, "Alpha channel (between 0.0 and 1.0)", NULL },
@@ -359,6 +492,17 @@ static GOptionEntry _command_line_options[] = {
     { "no-colorbar", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &config.export_colorbar, "Do not print colorbar", NULL },
     { "grayscale", 0, 0, G_OPTION_ARG_NONE, &config.grayscale, "Use grayscale", NULL },
     { "z-epsilon", 'z', 0, G_OPTION_ARG_DOUBLE, &config.z_epsilon, "z threshold under which faces are not drawn", NULL },
+    { "clip-percentile", 0, 0, G_OPTION_ARG_DOUBLE, &config.clip_percentile, "Scale to the entries between the P-th and (100-P)-th percentile, clamping outliers", "P" },
+    { "merge-tolerance", 0, 0, G_OPTION_ARG_DOUBLE, &config.merge_tolerance, "Merge neighbouring faces of entries that differ by at most 2*T into one (0: equal entries only)", "T" },
+    { "convert", 0, 0, G_OPTION_ARG_FILENAME, &config.convert_filename, "Write input to a binary matrix file (.rmx) and exit", "Filename" },
+    { "shape", 0, 0, G_OPTION_ARG_STRING, &config.raw_shape, "Read raw binary input (little endian, row by row)", "ROWSxCOLUMNS[xMATRICES]" },
+    { "dtype", 0, 0, G_OPTION_ARG_STRING, &config.raw_dtype, "Data type of raw input (f32 or f64, default f64)", "TYPE" },
+    { "jobs", 'j', 0, G_OPTION_ARG_INT, &config.jobs, "Number of threads used to read, transform and mesh matrices (default: number of processors)", "N" },
+    { "precision", 0, 0, G_OPTION_ARG_STRING, &config.precision_name, "Storage precision of matrices (f64, f32, q16 or q8, default f64)", "TYPE" },
+    { "rows", 0, 0, G_OPTION_ARG_STRING, &config.rows_slice, "Only read these rows (zero based, END excluded)", "BEGIN:END[:STEP]" },
+    { "cols", 0, 0, G_OPTION_ARG_STRING, &config.columns_slice, "Only read these columns (zero based, END excluded)", "BEGIN:END[:STEP]" },
+    { "huge-pages", 0, 0, G_OPTION_ARG_NONE, &config.huge_pages, "Back large matrices with transparent huge pages (default)", NULL },
+    { "no-huge-pages", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &config.huge_pages, "Do not use huge pages", NULL },
     { NULL }
 };
 
@@ -372,6 +516,36 @@ gboolean main_parse_command_line(int *argc, char ***argv)
         return FALSE;
     }
     g_option_context_free(context);
+
+    util_alloc_set_huge_pages(config.huge_pages);
+    if (config.jobs <= 0)
+        config.jobs = g_get_num_processors();
+    util_parallel_set_threads(config.jobs);
+
+    if (config.precision_name && !matrix_parse_precision(config.precision_name, &config.precision))
+        return FALSE;
+
+    if (config.transform_expression &&
+            !(config.transform.expression = matrix_expression_new(config.transform_expression)))
+        return FALSE;
+
+    if (config.clip_percentile < 0.0 || config.clip_percentile >= 50.0) {
+        g_printerr("Clip percentile must be at least 0 and below 50.\n");
+        return FALSE;
+    }
+
+    if (config.rows_slice && !matrix_parse_slice(config.rows_slice, &config.region.rows))
+        return FALSE;
+    if (config.columns_slice && !matrix_parse_slice(config.columns_slice, &config.region.columns))
+        return FALSE;
+
+    if (config.raw_shape) {
+        memset(&config.raw_layout, 0, sizeof(MatrixBinaryLayout));
+        if (!matrix_binary_parse_shape(config.raw_shape, &config.raw_layout))
+            return FALSE;
+        if (config.raw_dtype && !matrix_binary_parse_dtype(config.raw_dtype, &config.raw_layout))
+            return FALSE;
+    }
 /*  Read more arguments? */
     /* Read glob style input files without interpretation. */
     glob_t infiles;
@@ -414,36 +588,140 @@ gboolean main_parse_command_line(int *argc, char ***argv)
     return TRUE;
 }
 
-GList *main_read_input_files(void)
+typedef struct {
+    gchar *filename;
+    guint jobs;
+    GList *matrices;
+    /* text files are only indexed, see MatrixFrames */
+    GMappedFile *file;
+    GArray *index;
+} MainInputFile;
+
+void main_read_input_file(MainInputFile *file)
 {
-    /* run through all input files (none or - -> STDIN_FILENO) and concatenate the lists
-     * read from the files. */
     int fd;
+    GList *matrices = NULL, *tmp, *next;
+    Matrix *m;
+    gchar magic[16];
+    gssize n;
+    MatrixCompression compression;
+    /* text input skips everything outside of the region while reading */
+    gboolean sliced = FALSE;
+
+    if (g_strcmp0(file->filename, "-") == 0) {
+        if (config.raw_shape) {
+            matrices = matrix_raw_read_from_file(STDIN_FILENO, &config.raw_layout);
+        }
+        else {
+            matrices = matrix_read_from_file_parallel(STDIN_FILENO, 1, &config.region);
+            sliced = TRUE;
+        }
+    }
+    else {
+        fd = open(file->filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Unable to open file `%s'. Skipping.\n", file->filename);
+            return;
+        }
+
+        if (config.raw_shape)
+            matrices = matrix_raw_read_from_file(fd, &config.raw_layout);
+        else if ((n = pread(fd, magic, sizeof(magic), 0)) <= 0) {
+            matrices = matrix_read_from_file_parallel(fd, file->jobs, &config.region);
+            sliced = TRUE;
+        }
+        else if (matrix_rmx_check_magic(magic, n))
+            matrices = matrix_rmx_read_from_file(fd);
+        else if (matrix_npy_check_magic(magic, n))
+            matrices = matrix_npy_read_from_file(fd);
+        else if (matrix_market_check_magic(magic, n))
+            matrices = matrix_market_read_from_file(fd);
+        else if ((compression = matrix_decompress_detect(magic, n)) != MATRIX_COMPRESSION_NONE) {
+            matrices = matrix_decompress_read_from_file(fd, compression, &config.region);
+            sliced = TRUE;
+        }
+        else if ((file->file = g_mapped_file_new_from_fd(fd, FALSE, NULL)) != NULL) {
+            file->index = matrix_reader_index_buffer(g_mapped_file_get_contents(file->file),
+                                                     g_mapped_file_get_length(file->file));
+        }
+        else {
+            matrices = matrix_read_from_file_parallel(fd, file->jobs, &config.region);
+            sliced = TRUE;
+        }
+        close(fd);
+    }
+
+    /* cut down and convert right away, before the next file is read */
+    for (tmp = matrices; tmp; tmp = next) {
+        next = g_list_next(tmp);
+        m = tmp->data;
+        if (!sliced)
+            matrix_slice(m, &config.region);
+        if (m->n_rows == 0 || m->n_columns == 0) {
+            matrix_free(m);
+            matrices = g_list_delete_link(matrices, tmp);
+            continue;
+        }
+        matrix_set_precision(m, config.precision);
+    }
+
+    file->matrices = matrices;
+}
+
+static void main_read_input_file_job(MainInputFile *file, gpointer userdata)
+{
+    main_read_input_file(file);
+}
+
+MatrixFrames *main_read_input_files(void)
+{
+    /* run through all input files (none or - -> STDIN_FILENO) and append them to the
+     * frames. With several jobs, either whole files are read in parallel (enough files)
+     * or each file is split among the jobs. */
     GList *tmp;
+    MatrixFrames *frames;
+    MainInputFile *files;
+    GThreadPool *pool;
+    guint n_files, i;
+    guint jobs = config.jobs > 0 ? config.jobs : 1;
+
+    frames = matrix_frames_new(&config.region, config.precision, jobs);
 
     if (appdata.infiles == NULL) {
         fprintf(stderr, "No input files given. Reading from stdin.\n");
-        return matrix_read_from_file(STDIN_FILENO);
+        appdata.infiles = g_list_prepend(NULL, g_strdup("-"));
     }
 
-    GList *matrices = NULL;
-    for (tmp = appdata.infiles; tmp; tmp = g_list_next(tmp)) {
-        if (g_strcmp0((gchar *)tmp->data, "-") == 0) {
-            matrices = g_list_concat(matrices, matrix_read_from_file(STDIN_FILENO));
+    n_files = g_list_length(appdata.infiles);
+    files = g_malloc0(n_files * sizeof(MainInputFile));
+
+    if (jobs == 1 || n_files < jobs || g_list_find_custom(appdata.infiles, "-", (GCompareFunc)g_strcmp0)) {
+        for (tmp = appdata.infiles, i = 0; tmp; tmp = g_list_next(tmp), ++i) {
+            files[i].filename = (gchar *)tmp->data;
+            files[i].jobs = jobs;
+            main_read_input_file(&files[i]);
         }
-        else {
-            fd = open((gchar *)tmp->data, O_RDONLY);
-            if (fd < 0) {
-                fprintf(stderr, "Unable to open file `%s'. Skipping.\n", (gchar *)tmp->data);
-            }
-            else {
-                matrices = g_list_concat(matrices, matrix_read_from_file(fd));
-                close(fd);
-            }
+    }
+    else {
+        pool = g_thread_pool_new((GFunc)main_read_input_file_job, NULL, jobs, TRUE, NULL);
+        for (tmp = appdata.infiles, i = 0; tmp; tmp = g_list_next(tmp), ++i) {
+            files[i].filename = (gchar *)tmp->data;
+            files[i].jobs = 1;
+            g_thread_pool_push(pool, &files[i], NULL);
         }
+        g_thread_pool_free(pool, FALSE, TRUE);
     }
 
-    return matrices;
+    /* keep the order of the files */
+    for (i = 0; i < n_files; ++i) {
+        if (files[i].file)
+            matrix_frames_append_file(frames, files[i].file, files[i].index);
+        else
+            matrix_frames_append_matrices(frames, files[i].matrices);
+    }
+    g_free(files);
+
+    return frames;
 }
 
 int main(int argc, char **argv)
@@ -459,11 +737,19 @@ int main(int argc, char **argv)
         util_colors_set_grayscale(1);
 
     matrix_mesh_set_z_epsilon(config.z_epsilon);
+    matrix_mesh_set_clip_percentile(config.clip_percentile);
+    matrix_mesh_set_merge_tolerance(config.merge_tolerance);
+
+    appdata.frames = main_read_input_files();
+    appdata.current_frame = 0;
+    appdata.display_view = NULL;
+    matrix_region_init(&appdata.display_region);
 
-    appdata.matrix_list.head = main_read_input_files();
-    appdata.matrix_list.current = appdata.matrix_list.head;
-    appdata.matrix_list.tail = g_list_last(appdata.matrix_list.head);
-    appdata.display_matrix = matrix_new();
+    if (config.convert_filename) {
+        if (!matrix_rmx_write_file(config.convert_filename, appdata.frames))
+            return 1;
+        goto done;
+    }
 
     main_update_display_matrix();
 
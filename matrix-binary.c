@@ -0,0 +1,384 @@
+#include "matrix-binary.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MATRIX_BINARY_BUFFER_SIZE (1 << 20)
+
+static inline gsize _matrix_binary_element_size(MatrixBinaryDType dtype)
+{
+    return dtype == MATRIX_BINARY_F32 ? sizeof(float) : sizeof(double);
+}
+
+static inline double _matrix_binary_value(const gchar *p, MatrixBinaryDType dtype, gboolean swap)
+{
+    guint64 bits64;
+    guint32 bits32;
+    double d;
+    float f;
+
+    if (dtype == MATRIX_BINARY_F64) {
+        memcpy(&bits64, p, sizeof(double));
+        if (swap)
+            bits64 = GUINT64_SWAP_LE_BE(bits64);
+        memcpy(&d, &bits64, sizeof(double));
+        return d;
+    }
+
+    memcpy(&bits32, p, sizeof(float));
+    if (swap)
+        bits32 = GUINT32_SWAP_LE_BE(bits32);
+    memcpy(&f, &bits32, sizeof(float));
+    return f;
+}
+
+/* Append count consecutive values, converting them to double in host byte order. */
+void matrix_binary_append_values(Matrix *matrix, const gchar *data, guint64 count,
+                                 MatrixBinaryDType dtype, gboolean big_endian)
+{
+    double buffer[MATRIX_CHUNK_SIZE];
+    gsize size = _matrix_binary_element_size(dtype);
+    gboolean swap = big_endian != (G_BYTE_ORDER == G_BIG_ENDIAN);
+    guint32 n, k;
+
+    while (count > 0) {
+        n = count > MATRIX_CHUNK_SIZE ? MATRIX_CHUNK_SIZE : count;
+        for (k = 0; k < n; ++k, data += size)
+            buffer[k] = _matrix_binary_value(data, dtype, swap);
+        matrix_append_row(matrix, buffer, n);
+        count -= n;
+    }
+}
+
+/* Gather a matrix stored column-wise (or interleaved with other matrices). */
+static void _matrix_binary_append_strided(Matrix *matrix, const gchar *data, MatrixBinaryLayout *layout,
+                                          guint64 row_stride, guint64 column_stride)
+{
+    gsize size = _matrix_binary_element_size(layout->dtype);
+    gboolean swap = layout->big_endian != (G_BYTE_ORDER == G_BIG_ENDIAN);
+    double *row = g_malloc(layout->n_columns * sizeof(double));
+    guint64 i, j;
+
+    for (i = 0; i < layout->n_rows; ++i) {
+        for (j = 0; j < layout->n_columns; ++j)
+            row[j] = _matrix_binary_value(data + (i * row_stride + j * column_stride) * size, layout->dtype, swap);
+        matrix_append_row(matrix, row, layout->n_columns);
+    }
+
+    g_free(row);
+}
+
+/* Split the array described by layout into matrices. Data in native byte order
+ * and C order is used in place if a mapping is given. */
+GList *matrix_binary_read(GMappedFile *mapping, const gchar *data, gsize length, MatrixBinaryLayout *layout)
+{
+    GList *list = NULL;
+    Matrix *matrix;
+    gsize size = _matrix_binary_element_size(layout->dtype);
+    guint64 count = layout->n_rows * layout->n_columns;
+    guint64 k;
+    const gchar *start;
+
+    if (!matrix_size_is_valid(layout->n_rows, layout->n_columns)) {
+        g_printerr("Matrix too large.\n");
+        return NULL;
+    }
+    if (count == 0)
+        return NULL;
+    if (layout->n_matrices > length / size / count) {
+        g_printerr("Input too short for %" G_GUINT64_FORMAT " matrices of size %" G_GUINT64_FORMAT
+                   "x%" G_GUINT64_FORMAT ".\n", layout->n_matrices, layout->n_rows, layout->n_columns);
+        return NULL;
+    }
+
+    for (k = 0; k < layout->n_matrices; ++k) {
+        matrix = matrix_new();
+        matrix->n_rows = layout->n_rows;
+        matrix->n_columns = layout->n_columns;
+
+        if (layout->fortran_order) {
+            /* entry (k, i, j) at k + n_matrices * (i + n_rows * j) */
+            _matrix_binary_append_strided(matrix, data + k * size, layout,
+                                          layout->n_matrices, layout->n_matrices * layout->n_rows);
+        }
+        else {
+            start = data + k * count * size;
+            if (mapping && layout->big_endian == (G_BYTE_ORDER == G_BIG_ENDIAN) &&
+                    ((gsize)start % size) == 0) {
+                matrix->precision = layout->dtype == MATRIX_BINARY_F64 ? MATRIX_PRECISION_F64 : MATRIX_PRECISION_F32;
+                matrix_map_data(matrix, mapping, start, count);
+            }
+            else
+                matrix_binary_append_values(matrix, start, count, layout->dtype, layout->big_endian);
+        }
+
+        list = g_list_prepend(list, matrix);
+    }
+
+    return g_list_reverse(list);
+}
+
+/* RxC or RxCxN */
+gboolean matrix_binary_parse_shape(const gchar *shape, MatrixBinaryLayout *layout)
+{
+    gchar **dims = g_strsplit(shape, "x", 0);
+    guint n_dims = g_strv_length(dims);
+    guint64 values[3] = { 0, 0, 0 };
+    gchar *end;
+    guint k;
+    gboolean success = n_dims == 2 || n_dims == 3;
+
+    for (k = 0; k < n_dims && success; ++k) {
+        values[k] = g_ascii_strtoull(dims[k], &end, 10);
+        if (end == dims[k] || *end != '\0' || values[k] == 0)
+            success = FALSE;
+    }
+    g_strfreev(dims);
+
+    if (!success) {
+        g_printerr("Invalid shape `%s', expected ROWSxCOLUMNS[xMATRICES].\n", shape);
+        return FALSE;
+    }
+
+    layout->n_rows = values[0];
+    layout->n_columns = values[1];
+    layout->n_matrices = values[2];
+
+    return TRUE;
+}
+
+gboolean matrix_binary_parse_dtype(const gchar *dtype, MatrixBinaryLayout *layout)
+{
+    if (g_strcmp0(dtype, "f64") == 0)
+        layout->dtype = MATRIX_BINARY_F64;
+    else if (g_strcmp0(dtype, "f32") == 0)
+        layout->dtype = MATRIX_BINARY_F32;
+    else {
+        g_printerr("Invalid data type `%s', expected f32 or f64.\n", dtype);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Map regular files, read everything else into memory. */
+static gboolean _matrix_binary_open(int fd, GMappedFile **mapping, gchar **buffer, const gchar **data, gsize *length)
+{
+    struct stat st;
+    gsize capacity = MATRIX_BINARY_BUFFER_SIZE;
+    gssize n;
+
+    *mapping = NULL;
+    *buffer = NULL;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (*mapping = g_mapped_file_new_from_fd(fd, FALSE, NULL)) != NULL) {
+        *data = g_mapped_file_get_contents(*mapping);
+        *length = g_mapped_file_get_length(*mapping);
+        return TRUE;
+    }
+
+    /* not limited to 4 GiB like a GByteArray */
+    *buffer = g_malloc(capacity);
+    *length = 0;
+    while ((n = read(fd, *buffer + *length, capacity - *length)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_printerr("Error reading input: %s\n", g_strerror(errno));
+            g_free(*buffer);
+            *buffer = NULL;
+            return FALSE;
+        }
+        *length += n;
+        if (*length == capacity) {
+            capacity *= 2;
+            *buffer = g_realloc(*buffer, capacity);
+        }
+    }
+    *data = *buffer;
+
+    return TRUE;
+}
+
+static void _matrix_binary_close(GMappedFile *mapping, gchar *buffer)
+{
+    if (mapping)
+        g_mapped_file_unref(mapping);
+    g_free(buffer);
+}
+
+/* Raw data: matrices stored one after the other, row by row. Without a number of
+ * matrices in the layout, as many as fit into the input are read. */
+GList *matrix_raw_read_from_file(int fd, MatrixBinaryLayout *layout)
+{
+    GMappedFile *mapping;
+    gchar *buffer;
+    const gchar *data;
+    gsize length;
+    GList *list;
+    MatrixBinaryLayout file_layout = *layout;
+    guint64 matrix_size;
+
+    if (!matrix_size_is_valid(layout->n_rows, layout->n_columns)) {
+        g_printerr("Matrix too large.\n");
+        return NULL;
+    }
+    matrix_size = layout->n_rows * layout->n_columns * _matrix_binary_element_size(layout->dtype);
+
+    if (!_matrix_binary_open(fd, &mapping, &buffer, &data, &length))
+        return NULL;
+
+    if (file_layout.n_matrices == 0)
+        file_layout.n_matrices = length / matrix_size;
+    if (length % matrix_size)
+        g_printerr("Ignoring %" G_GUINT64_FORMAT " trailing bytes.\n", (guint64)(length % matrix_size));
+
+    list = matrix_binary_read(mapping, data, length, &file_layout);
+
+    _matrix_binary_close(mapping, buffer);
+
+    return list;
+}
+
+gboolean matrix_npy_check_magic(const gchar *data, gsize length)
+{
+    return length >= MATRIX_NPY_MAGIC_LENGTH &&
+        memcmp(data, MATRIX_NPY_MAGIC, MATRIX_NPY_MAGIC_LENGTH) == 0;
+}
+
+/* Value of key in the header dictionary, e.g. {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), } */
+static const gchar *_matrix_npy_find_key(const gchar *header, const gchar *key)
+{
+    const gchar *p = strstr(header, key);
+
+    if (p == NULL)
+        return NULL;
+    p += strlen(key);
+    while (*p == ' ' || *p == ':')
+        ++p;
+
+    return p;
+}
+
+static gboolean _matrix_npy_parse_header(const gchar *header, MatrixBinaryLayout *layout)
+{
+    const gchar *p;
+    gchar *end;
+    guint64 dims[3];
+    guint n_dims = 0;
+
+    if ((p = _matrix_npy_find_key(header, "'descr'")) == NULL || (*p != '\'' && *p != '"'))
+        return FALSE;
+    ++p;
+    if (*p == '<')
+        layout->big_endian = FALSE;
+    else if (*p == '>')
+        layout->big_endian = TRUE;
+    else if (*p == '=')
+        layout->big_endian = G_BYTE_ORDER == G_BIG_ENDIAN;
+    else
+        return FALSE;
+    ++p;
+    if (strncmp(p, "f8", 2) == 0)
+        layout->dtype = MATRIX_BINARY_F64;
+    else if (strncmp(p, "f4", 2) == 0)
+        layout->dtype = MATRIX_BINARY_F32;
+    else
+        return FALSE;
+
+    if ((p = _matrix_npy_find_key(header, "'fortran_order'")) == NULL)
+        return FALSE;
+    layout->fortran_order = strncmp(p, "True", 4) == 0;
+
+    if ((p = _matrix_npy_find_key(header, "'shape'")) == NULL || *p != '(')
+        return FALSE;
+    for (++p; *p != ')'; ) {
+        if (*p == ' ' || *p == ',') {
+            ++p;
+            continue;
+        }
+        if (n_dims == 3)
+            return FALSE;
+        dims[n_dims++] = g_ascii_strtoull(p, &end, 10);
+        if (end == p)
+            return FALSE;
+        p = end;
+    }
+
+    if (n_dims == 2) {
+        layout->n_matrices = 1;
+        layout->n_rows = dims[0];
+        layout->n_columns = dims[1];
+    }
+    else if (n_dims == 3) {
+        layout->n_matrices = dims[0];
+        layout->n_rows = dims[1];
+        layout->n_columns = dims[2];
+    }
+    else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* NumPy arrays of dimension 2 (one matrix) or 3 (a stack of matrices along the
+ * first axis) of float32 or float64. */
+GList *matrix_npy_read_from_file(int fd)
+{
+    GMappedFile *mapping;
+    gchar *buffer;
+    const gchar *data;
+    gsize length, offset;
+    guint32 header_length;
+    guint16 short_length;
+    gchar *header;
+    MatrixBinaryLayout layout;
+    GList *list = NULL;
+
+    if (!_matrix_binary_open(fd, &mapping, &buffer, &data, &length))
+        return NULL;
+
+    if (length < 10 || !matrix_npy_check_magic(data, length)) {
+        g_printerr("Not a NumPy file.\n");
+        goto done;
+    }
+
+    /* version 1.0: 16 bit header length, 2.0 and 3.0: 32 bit */
+    if (data[6] == 1) {
+        memcpy(&short_length, data + 8, sizeof(guint16));
+        header_length = GUINT16_FROM_LE(short_length);
+        offset = 10;
+    }
+    else if (length >= 12) {
+        memcpy(&header_length, data + 8, sizeof(guint32));
+        header_length = GUINT32_FROM_LE(header_length);
+        offset = 12;
+    }
+    else {
+        g_printerr("Not a NumPy file.\n");
+        goto done;
+    }
+
+    if (header_length > length - offset) {
+        g_printerr("NumPy header truncated.\n");
+        goto done;
+    }
+
+    header = g_strndup(data + offset, header_length);
+    memset(&layout, 0, sizeof(MatrixBinaryLayout));
+    if (_matrix_npy_parse_header(header, &layout))
+        list = matrix_binary_read(mapping, data + offset + header_length, length - offset - header_length, &layout);
+    else
+        g_printerr("Unsupported NumPy array: %s\n", header);
+    g_free(header);
+
+done:
+    _matrix_binary_close(mapping, buffer);
+
+    return list;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+
+/* Binary arrays written by other programs: NumPy .npy files and raw data with a
+ * shape given on the command line. */
+
+#define MATRIX_NPY_MAGIC "\x93NUMPY"
+#define MATRIX_NPY_MAGIC_LENGTH 6
+
+typedef enum {
+    MATRIX_BINARY_F64,
+    MATRIX_BINARY_F32
+} MatrixBinaryDType;
+
+/* n_matrices matrices of n_rows x n_columns entries; with fortran_order the
+ * matrix index varies fastest, otherwise the column index (the layouts of
+ * NumPy arrays of shape (n_matrices, n_rows, n_columns)). */
+typedef struct {
+    MatrixBinaryDType dtype;
+    gboolean big_endian;
+    gboolean fortran_order;
+    guint64 n_matrices;
+    guint64 n_rows;
+    guint64 n_columns;
+} MatrixBinaryLayout;
+
+void matrix_binary_append_values(Matrix *matrix, const gchar *data, guint64 count,
+                                 MatrixBinaryDType dtype, gboolean big_endian);
+GList *matrix_binary_read(GMappedFile *mapping, const gchar *data, gsize length, MatrixBinaryLayout *layout);
+
+gboolean matrix_binary_parse_shape(const gchar *shape, MatrixBinaryLayout *layout);
+gboolean matrix_binary_parse_dtype(const gchar *dtype, MatrixBinaryLayout *layout);
+
+gboolean matrix_npy_check_magic(const gchar *data, gsize length);
+GList *matrix_npy_read_from_file(int fd);
+GList *matrix_raw_read_from_file(int fd, MatrixBinaryLayout *layout);
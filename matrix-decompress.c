@@ -0,0 +1,272 @@
+#include "matrix-decompress.h"
+#include "matrix-reader.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+
+#define MATRIX_DECOMPRESS_BUFFER_SIZE (1 << 20)
+#define MATRIX_DECOMPRESS_N_BUFFERS 4
+
+typedef struct {
+    gchar *data;
+    gsize length;
+    gboolean last;
+} MatrixDecompressBuffer;
+
+/* Buffers go round between the two queues: the decompression thread takes
+ * free buffers, fills them and passes them on to the reader, which returns
+ * them after parsing. */
+typedef struct {
+    int fd;
+    MatrixCompression compression;
+    GAsyncQueue *free_buffers;
+    GAsyncQueue *full_buffers;
+    gchar *input;
+} MatrixDecompressStream;
+
+MatrixCompression matrix_decompress_detect(const gchar *data, gsize length)
+{
+    if (length >= 2 && memcmp(data, "\x1f\x8b", 2) == 0)
+        return MATRIX_COMPRESSION_GZIP;
+    if (length >= 4 && memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0)
+        return MATRIX_COMPRESSION_ZSTD;
+    if (length >= 6 && memcmp(data, "\xfd" "7zXZ\x00", 6) == 0)
+        return MATRIX_COMPRESSION_XZ;
+
+    return MATRIX_COMPRESSION_NONE;
+}
+
+static gssize _matrix_decompress_read(MatrixDecompressStream *stream)
+{
+    gssize n;
+
+    while ((n = read(stream->fd, stream->input, MATRIX_DECOMPRESS_BUFFER_SIZE)) < 0 && errno == EINTR);
+    if (n < 0)
+        g_printerr("Error reading input: %s\n", g_strerror(errno));
+
+    return n;
+}
+
+/* Pass a filled buffer on (if any) and get an empty one. */
+static MatrixDecompressBuffer *_matrix_decompress_next_buffer(MatrixDecompressStream *stream, MatrixDecompressBuffer *buffer)
+{
+    if (buffer)
+        g_async_queue_push(stream->full_buffers, buffer);
+
+    buffer = g_async_queue_pop(stream->free_buffers);
+    buffer->length = 0;
+    buffer->last = FALSE;
+
+    return buffer;
+}
+
+#ifdef WITH_ZLIB
+static MatrixDecompressBuffer *_matrix_decompress_gzip(MatrixDecompressStream *stream, MatrixDecompressBuffer *out)
+{
+    z_stream z;
+    gssize n;
+    int ret = Z_OK;
+
+    memset(&z, 0, sizeof(z_stream));
+    /* 15 + 32: maximal window, gzip or zlib header */
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {
+        g_printerr("Could not initialize gzip decompression.\n");
+        return out;
+    }
+
+    while ((n = _matrix_decompress_read(stream)) > 0) {
+        z.next_in = (Bytef *)stream->input;
+        z.avail_in = n;
+        do {
+            z.next_out = (Bytef *)out->data + out->length;
+            z.avail_out = MATRIX_DECOMPRESS_BUFFER_SIZE - out->length;
+            ret = inflate(&z, Z_NO_FLUSH);
+            out->length = MATRIX_DECOMPRESS_BUFFER_SIZE - z.avail_out;
+            if (ret == Z_STREAM_END) {
+                /* concatenated members */
+                inflateReset(&z);
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                g_printerr("gzip: %s\n", z.msg ? z.msg : "invalid data");
+                goto done;
+            }
+            if (z.avail_out == 0)
+                out = _matrix_decompress_next_buffer(stream, out);
+        } while (z.avail_in > 0 || (z.avail_out == 0 && ret != Z_BUF_ERROR));
+    }
+
+done:
+    inflateEnd(&z);
+
+    return out;
+}
+#endif
+
+#ifdef WITH_ZSTD
+static MatrixDecompressBuffer *_matrix_decompress_zstd(MatrixDecompressStream *stream, MatrixDecompressBuffer *out)
+{
+    ZSTD_DStream *zs = ZSTD_createDStream();
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer output;
+    gssize n;
+    size_t ret;
+
+    if (zs == NULL || ZSTD_isError(ZSTD_initDStream(zs))) {
+        g_printerr("Could not initialize zstd decompression.\n");
+        ZSTD_freeDStream(zs);
+        return out;
+    }
+
+    while ((n = _matrix_decompress_read(stream)) > 0) {
+        in.src = stream->input;
+        in.size = n;
+        in.pos = 0;
+        do {
+            output.dst = out->data;
+            output.size = MATRIX_DECOMPRESS_BUFFER_SIZE;
+            output.pos = out->length;
+            ret = ZSTD_decompressStream(zs, &output, &in);
+            out->length = output.pos;
+            if (ZSTD_isError(ret)) {
+                g_printerr("zstd: %s\n", ZSTD_getErrorName(ret));
+                goto done;
+            }
+            if (output.pos == output.size)
+                out = _matrix_decompress_next_buffer(stream, out);
+        } while (in.pos < in.size || output.pos == output.size);
+    }
+
+done:
+    ZSTD_freeDStream(zs);
+
+    return out;
+}
+#endif
+
+#ifdef WITH_LZMA
+static MatrixDecompressBuffer *_matrix_decompress_xz(MatrixDecompressStream *stream, MatrixDecompressBuffer *out)
+{
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret;
+    gssize n;
+
+    if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        g_printerr("Could not initialize xz decompression.\n");
+        return out;
+    }
+
+    while (action == LZMA_RUN) {
+        if ((n = _matrix_decompress_read(stream)) <= 0)
+            action = LZMA_FINISH;
+        xz.next_in = (const uint8_t *)stream->input;
+        xz.avail_in = n > 0 ? n : 0;
+        do {
+            xz.next_out = (uint8_t *)out->data + out->length;
+            xz.avail_out = MATRIX_DECOMPRESS_BUFFER_SIZE - out->length;
+            ret = lzma_code(&xz, action);
+            out->length = MATRIX_DECOMPRESS_BUFFER_SIZE - xz.avail_out;
+            if (ret == LZMA_STREAM_END)
+                goto done;
+            if (ret != LZMA_OK) {
+                g_printerr("xz: invalid data (error %d)\n", ret);
+                goto done;
+            }
+            if (xz.avail_out == 0)
+                out = _matrix_decompress_next_buffer(stream, out);
+        } while (xz.avail_in > 0 || xz.avail_out == 0 || action == LZMA_FINISH);
+    }
+
+done:
+    lzma_end(&xz);
+
+    return out;
+}
+#endif
+
+static gpointer _matrix_decompress_thread(MatrixDecompressStream *stream)
+{
+    MatrixDecompressBuffer *out = _matrix_decompress_next_buffer(stream, NULL);
+
+    switch (stream->compression) {
+#ifdef WITH_ZLIB
+        case MATRIX_COMPRESSION_GZIP:
+            out = _matrix_decompress_gzip(stream, out);
+            break;
+#endif
+#ifdef WITH_ZSTD
+        case MATRIX_COMPRESSION_ZSTD:
+            out = _matrix_decompress_zstd(stream, out);
+            break;
+#endif
+#ifdef WITH_LZMA
+        case MATRIX_COMPRESSION_XZ:
+            out = _matrix_decompress_xz(stream, out);
+            break;
+#endif
+        default:
+            g_printerr("Compression format not supported by this build.\n");
+            break;
+    }
+
+    out->last = TRUE;
+    g_async_queue_push(stream->full_buffers, out);
+
+    return NULL;
+}
+
+GList *matrix_decompress_read_from_file(int fd, MatrixCompression compression, const MatrixRegion *region)
+{
+    MatrixDecompressStream stream;
+    MatrixDecompressBuffer *buffer;
+    MatrixReader *reader;
+    GThread *thread;
+    gboolean last;
+    guint i;
+
+    stream.fd = fd;
+    stream.compression = compression;
+    stream.free_buffers = g_async_queue_new();
+    stream.full_buffers = g_async_queue_new();
+    stream.input = g_malloc(MATRIX_DECOMPRESS_BUFFER_SIZE);
+
+    for (i = 0; i < MATRIX_DECOMPRESS_N_BUFFERS; ++i) {
+        buffer = g_malloc0(sizeof(MatrixDecompressBuffer));
+        buffer->data = g_malloc(MATRIX_DECOMPRESS_BUFFER_SIZE);
+        g_async_queue_push(stream.free_buffers, buffer);
+    }
+
+    thread = g_thread_new("decompress", (GThreadFunc)_matrix_decompress_thread, &stream);
+
+    reader = matrix_reader_new();
+    matrix_reader_set_region(reader, region);
+    do {
+        buffer = g_async_queue_pop(stream.full_buffers);
+        matrix_reader_feed(reader, buffer->data, buffer->length);
+        last = buffer->last;
+        g_async_queue_push(stream.free_buffers, buffer);
+    } while (!last);
+
+    g_thread_join(thread);
+
+    for (i = 0; i < MATRIX_DECOMPRESS_N_BUFFERS; ++i) {
+        buffer = g_async_queue_pop(stream.free_buffers);
+        g_free(buffer->data);
+        g_free(buffer);
+    }
+    g_async_queue_unref(stream.free_buffers);
+    g_async_queue_unref(stream.full_buffers);
+    g_free(stream.input);
+
+    return matrix_reader_finish(reader);
+}
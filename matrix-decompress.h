@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+
+/* Compressed text input. The data is decompressed on a separate thread and
+ * handed to the text reader in blocks. */
+
+typedef enum {
+    MATRIX_COMPRESSION_NONE = 0,
+    MATRIX_COMPRESSION_GZIP,
+    MATRIX_COMPRESSION_ZSTD,
+    MATRIX_COMPRESSION_XZ
+} MatrixCompression;
+
+MatrixCompression matrix_decompress_detect(const gchar *data, gsize length);
+GList *matrix_decompress_read_from_file(int fd, MatrixCompression compression, const MatrixRegion *region);
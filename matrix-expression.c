@@ -0,0 +1,708 @@
+#include "matrix-expression.h"
+#include <string.h>
+#include <math.h>
+
+typedef enum {
+    /* leaves, only in the syntax tree */
+    MATRIX_EXPRESSION_OP_VARIABLE,
+    MATRIX_EXPRESSION_OP_CONSTANT,
+
+    MATRIX_EXPRESSION_OP_NEG,
+    MATRIX_EXPRESSION_OP_NOT,
+    MATRIX_EXPRESSION_OP_ABS,
+    MATRIX_EXPRESSION_OP_SIGN,
+    MATRIX_EXPRESSION_OP_SQRT,
+    MATRIX_EXPRESSION_OP_CBRT,
+    MATRIX_EXPRESSION_OP_EXP,
+    MATRIX_EXPRESSION_OP_EXPM1,
+    MATRIX_EXPRESSION_OP_LOG,
+    MATRIX_EXPRESSION_OP_LOG1P,
+    MATRIX_EXPRESSION_OP_LOG2,
+    MATRIX_EXPRESSION_OP_LOG10,
+    MATRIX_EXPRESSION_OP_SIN,
+    MATRIX_EXPRESSION_OP_COS,
+    MATRIX_EXPRESSION_OP_TAN,
+    MATRIX_EXPRESSION_OP_ASIN,
+    MATRIX_EXPRESSION_OP_ACOS,
+    MATRIX_EXPRESSION_OP_ATAN,
+    MATRIX_EXPRESSION_OP_SINH,
+    MATRIX_EXPRESSION_OP_COSH,
+    MATRIX_EXPRESSION_OP_TANH,
+    MATRIX_EXPRESSION_OP_FLOOR,
+    MATRIX_EXPRESSION_OP_CEIL,
+    MATRIX_EXPRESSION_OP_ROUND,
+    MATRIX_EXPRESSION_OP_TRUNC,
+
+    MATRIX_EXPRESSION_OP_ADD,
+    MATRIX_EXPRESSION_OP_SUB,
+    MATRIX_EXPRESSION_OP_MUL,
+    MATRIX_EXPRESSION_OP_DIV,
+    MATRIX_EXPRESSION_OP_MOD,
+    MATRIX_EXPRESSION_OP_POW,
+    MATRIX_EXPRESSION_OP_MIN,
+    MATRIX_EXPRESSION_OP_MAX,
+    MATRIX_EXPRESSION_OP_ATAN2,
+    MATRIX_EXPRESSION_OP_HYPOT,
+    MATRIX_EXPRESSION_OP_LT,
+    MATRIX_EXPRESSION_OP_LE,
+    MATRIX_EXPRESSION_OP_GT,
+    MATRIX_EXPRESSION_OP_GE,
+    MATRIX_EXPRESSION_OP_EQ,
+    MATRIX_EXPRESSION_OP_NE,
+    MATRIX_EXPRESSION_OP_AND,
+    MATRIX_EXPRESSION_OP_OR,
+
+    MATRIX_EXPRESSION_OP_CLAMP,
+    MATRIX_EXPRESSION_OP_SELECT
+} MatrixExpressionOp;
+
+/* registers of the variables, followed by the constants and the temporaries */
+enum {
+    MATRIX_EXPRESSION_REG_X,
+    MATRIX_EXPRESSION_REG_I,
+    MATRIX_EXPRESSION_REG_J,
+    MATRIX_EXPRESSION_REG_ROWS,
+    MATRIX_EXPRESSION_REG_COLUMNS,
+    MATRIX_EXPRESSION_N_VARIABLES
+};
+
+/* temporaries are numbered from here until the constants are known */
+#define MATRIX_EXPRESSION_TEMPORARY 0x8000
+
+/* the registers of a block are on the stack during evaluation */
+#define MATRIX_EXPRESSION_MAX_REGISTERS 64
+
+/* so is the parser, which recurses for each unary operator and parenthesis */
+#define MATRIX_EXPRESSION_MAX_DEPTH 256
+
+typedef struct {
+    const gchar *name;
+    MatrixExpressionOp op;
+    guint n_args;
+} MatrixExpressionFunction;
+
+static const MatrixExpressionFunction matrix_expression_functions[] = {
+    { "abs", MATRIX_EXPRESSION_OP_ABS, 1 },
+    { "sign", MATRIX_EXPRESSION_OP_SIGN, 1 },
+    { "sqrt", MATRIX_EXPRESSION_OP_SQRT, 1 },
+    { "cbrt", MATRIX_EXPRESSION_OP_CBRT, 1 },
+    { "exp", MATRIX_EXPRESSION_OP_EXP, 1 },
+    { "expm1", MATRIX_EXPRESSION_OP_EXPM1, 1 },
+    { "log", MATRIX_EXPRESSION_OP_LOG, 1 },
+    { "log1p", MATRIX_EXPRESSION_OP_LOG1P, 1 },
+    { "log2", MATRIX_EXPRESSION_OP_LOG2, 1 },
+    { "log10", MATRIX_EXPRESSION_OP_LOG10, 1 },
+    { "sin", MATRIX_EXPRESSION_OP_SIN, 1 },
+    { "cos", MATRIX_EXPRESSION_OP_COS, 1 },
+    { "tan", MATRIX_EXPRESSION_OP_TAN, 1 },
+    { "asin", MATRIX_EXPRESSION_OP_ASIN, 1 },
+    { "acos", MATRIX_EXPRESSION_OP_ACOS, 1 },
+    { "atan", MATRIX_EXPRESSION_OP_ATAN, 1 },
+    { "sinh", MATRIX_EXPRESSION_OP_SINH, 1 },
+    { "cosh", MATRIX_EXPRESSION_OP_COSH, 1 },
+    { "tanh", MATRIX_EXPRESSION_OP_TANH, 1 },
+    { "floor", MATRIX_EXPRESSION_OP_FLOOR, 1 },
+    { "ceil", MATRIX_EXPRESSION_OP_CEIL, 1 },
+    { "round", MATRIX_EXPRESSION_OP_ROUND, 1 },
+    { "trunc", MATRIX_EXPRESSION_OP_TRUNC, 1 },
+    { "min", MATRIX_EXPRESSION_OP_MIN, 2 },
+    { "max", MATRIX_EXPRESSION_OP_MAX, 2 },
+    { "pow", MATRIX_EXPRESSION_OP_POW, 2 },
+    { "atan2", MATRIX_EXPRESSION_OP_ATAN2, 2 },
+    { "hypot", MATRIX_EXPRESSION_OP_HYPOT, 2 },
+    { "clamp", MATRIX_EXPRESSION_OP_CLAMP, 3 },
+    { NULL, 0, 0 }
+};
+
+typedef struct {
+    MatrixExpressionOp op;
+    /* constant, or register of a variable */
+    double value;
+    gint args[3];
+} MatrixExpressionNode;
+
+typedef struct {
+    guint16 op;
+    guint16 dst;
+    guint16 args[3];
+} MatrixExpressionInstruction;
+
+struct _MatrixExpression {
+    gchar *text;
+    MatrixExpressionInstruction *code;
+    guint n_code;
+    /* the constants are in the registers after the variables */
+    double *constants;
+    guint n_constants;
+    guint n_registers;
+    guint result;
+    gboolean keeps_zero;
+};
+
+typedef struct {
+    const gchar *text;
+    const gchar *pos;
+    GArray *nodes;
+    const gchar *error;
+    const gchar *error_pos;
+    guint depth;
+} MatrixExpressionParser;
+
+/* d = op(a, b, c) for n values; d may be equal to any of the arguments. */
+static void _matrix_expression_op(MatrixExpressionOp op, double *d, const double *a, const double *b,
+                                  const double *c, guint32 n)
+{
+    guint32 k;
+
+#define MATRIX_EXPRESSION_LOOP(expr) for (k = 0; k < n; ++k) d[k] = (expr); break
+
+    switch (op) {
+        case MATRIX_EXPRESSION_OP_NEG: MATRIX_EXPRESSION_LOOP(-a[k]);
+        case MATRIX_EXPRESSION_OP_NOT: MATRIX_EXPRESSION_LOOP(a[k] == 0.0 ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_ABS: MATRIX_EXPRESSION_LOOP(fabs(a[k]));
+        case MATRIX_EXPRESSION_OP_SIGN: MATRIX_EXPRESSION_LOOP(a[k] > 0.0 ? 1.0 : (a[k] < 0.0 ? -1.0 : 0.0));
+        case MATRIX_EXPRESSION_OP_SQRT: MATRIX_EXPRESSION_LOOP(sqrt(a[k]));
+        case MATRIX_EXPRESSION_OP_CBRT: MATRIX_EXPRESSION_LOOP(cbrt(a[k]));
+        case MATRIX_EXPRESSION_OP_EXP: MATRIX_EXPRESSION_LOOP(exp(a[k]));
+        case MATRIX_EXPRESSION_OP_EXPM1: MATRIX_EXPRESSION_LOOP(expm1(a[k]));
+        case MATRIX_EXPRESSION_OP_LOG: MATRIX_EXPRESSION_LOOP(log(a[k]));
+        case MATRIX_EXPRESSION_OP_LOG1P: MATRIX_EXPRESSION_LOOP(log1p(a[k]));
+        case MATRIX_EXPRESSION_OP_LOG2: MATRIX_EXPRESSION_LOOP(log2(a[k]));
+        case MATRIX_EXPRESSION_OP_LOG10: MATRIX_EXPRESSION_LOOP(log10(a[k]));
+        case MATRIX_EXPRESSION_OP_SIN: MATRIX_EXPRESSION_LOOP(sin(a[k]));
+        case MATRIX_EXPRESSION_OP_COS: MATRIX_EXPRESSION_LOOP(cos(a[k]));
+        case MATRIX_EXPRESSION_OP_TAN: MATRIX_EXPRESSION_LOOP(tan(a[k]));
+        case MATRIX_EXPRESSION_OP_ASIN: MATRIX_EXPRESSION_LOOP(asin(a[k]));
+        case MATRIX_EXPRESSION_OP_ACOS: MATRIX_EXPRESSION_LOOP(acos(a[k]));
+        case MATRIX_EXPRESSION_OP_ATAN: MATRIX_EXPRESSION_LOOP(atan(a[k]));
+        case MATRIX_EXPRESSION_OP_SINH: MATRIX_EXPRESSION_LOOP(sinh(a[k]));
+        case MATRIX_EXPRESSION_OP_COSH: MATRIX_EXPRESSION_LOOP(cosh(a[k]));
+        case MATRIX_EXPRESSION_OP_TANH: MATRIX_EXPRESSION_LOOP(tanh(a[k]));
+        case MATRIX_EXPRESSION_OP_FLOOR: MATRIX_EXPRESSION_LOOP(floor(a[k]));
+        case MATRIX_EXPRESSION_OP_CEIL: MATRIX_EXPRESSION_LOOP(ceil(a[k]));
+        case MATRIX_EXPRESSION_OP_ROUND: MATRIX_EXPRESSION_LOOP(round(a[k]));
+        case MATRIX_EXPRESSION_OP_TRUNC: MATRIX_EXPRESSION_LOOP(trunc(a[k]));
+
+        case MATRIX_EXPRESSION_OP_ADD: MATRIX_EXPRESSION_LOOP(a[k] + b[k]);
+        case MATRIX_EXPRESSION_OP_SUB: MATRIX_EXPRESSION_LOOP(a[k] - b[k]);
+        case MATRIX_EXPRESSION_OP_MUL: MATRIX_EXPRESSION_LOOP(a[k] * b[k]);
+        case MATRIX_EXPRESSION_OP_DIV: MATRIX_EXPRESSION_LOOP(a[k] / b[k]);
+        case MATRIX_EXPRESSION_OP_MOD: MATRIX_EXPRESSION_LOOP(fmod(a[k], b[k]));
+        case MATRIX_EXPRESSION_OP_POW: MATRIX_EXPRESSION_LOOP(pow(a[k], b[k]));
+        case MATRIX_EXPRESSION_OP_MIN: MATRIX_EXPRESSION_LOOP(b[k] < a[k] ? b[k] : a[k]);
+        case MATRIX_EXPRESSION_OP_MAX: MATRIX_EXPRESSION_LOOP(b[k] > a[k] ? b[k] : a[k]);
+        case MATRIX_EXPRESSION_OP_ATAN2: MATRIX_EXPRESSION_LOOP(atan2(a[k], b[k]));
+        case MATRIX_EXPRESSION_OP_HYPOT: MATRIX_EXPRESSION_LOOP(hypot(a[k], b[k]));
+        case MATRIX_EXPRESSION_OP_LT: MATRIX_EXPRESSION_LOOP(a[k] < b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_LE: MATRIX_EXPRESSION_LOOP(a[k] <= b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_GT: MATRIX_EXPRESSION_LOOP(a[k] > b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_GE: MATRIX_EXPRESSION_LOOP(a[k] >= b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_EQ: MATRIX_EXPRESSION_LOOP(a[k] == b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_NE: MATRIX_EXPRESSION_LOOP(a[k] != b[k] ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_AND: MATRIX_EXPRESSION_LOOP(a[k] != 0.0 && b[k] != 0.0 ? 1.0 : 0.0);
+        case MATRIX_EXPRESSION_OP_OR: MATRIX_EXPRESSION_LOOP(a[k] != 0.0 || b[k] != 0.0 ? 1.0 : 0.0);
+
+        /* NaN is kept, like with min and max */
+        case MATRIX_EXPRESSION_OP_CLAMP: MATRIX_EXPRESSION_LOOP(a[k] < b[k] ? b[k] : (a[k] > c[k] ? c[k] : a[k]));
+        case MATRIX_EXPRESSION_OP_SELECT: MATRIX_EXPRESSION_LOOP(a[k] != 0.0 ? b[k] : c[k]);
+
+        default:
+            break;
+    }
+
+#undef MATRIX_EXPRESSION_LOOP
+}
+
+static guint _matrix_expression_n_args(MatrixExpressionOp op)
+{
+    if (op <= MATRIX_EXPRESSION_OP_CONSTANT)
+        return 0;
+    if (op < MATRIX_EXPRESSION_OP_ADD)
+        return 1;
+    if (op < MATRIX_EXPRESSION_OP_CLAMP)
+        return 2;
+    return 3;
+}
+
+static gint _matrix_expression_leaf(MatrixExpressionParser *parser, MatrixExpressionOp op, double value)
+{
+    MatrixExpressionNode node = { op, value, { -1, -1, -1 } };
+
+    g_array_append_val(parser->nodes, node);
+
+    return parser->nodes->len - 1;
+}
+
+/* A new node, or the constant it evaluates to if all arguments are constant. */
+static gint _matrix_expression_node(MatrixExpressionParser *parser, MatrixExpressionOp op, gint a, gint b, gint c)
+{
+    MatrixExpressionNode node = { op, 0.0, { a, b, c } };
+    MatrixExpressionNode *nodes = (MatrixExpressionNode *)parser->nodes->data;
+    double values[3] = { 0.0, 0.0, 0.0 };
+    guint k, n_args = _matrix_expression_n_args(op);
+
+    if (a < 0 || (n_args > 1 && b < 0) || (n_args > 2 && c < 0))
+        return -1;
+
+    for (k = 0; k < n_args; ++k) {
+        if (nodes[node.args[k]].op != MATRIX_EXPRESSION_OP_CONSTANT)
+            break;
+        values[k] = nodes[node.args[k]].value;
+    }
+
+    if (k == n_args) {
+        _matrix_expression_op(op, &node.value, values, values + 1, values + 2, 1);
+        return _matrix_expression_leaf(parser, MATRIX_EXPRESSION_OP_CONSTANT, node.value);
+    }
+
+    g_array_append_val(parser->nodes, node);
+
+    return parser->nodes->len - 1;
+}
+
+static void _matrix_expression_skip_space(MatrixExpressionParser *parser)
+{
+    while (g_ascii_isspace(*parser->pos))
+        ++parser->pos;
+}
+
+/* Consume token if it comes next. */
+static gboolean _matrix_expression_accept(MatrixExpressionParser *parser, const gchar *token)
+{
+    _matrix_expression_skip_space(parser);
+    if (strncmp(parser->pos, token, strlen(token)) != 0)
+        return FALSE;
+
+    parser->pos += strlen(token);
+
+    return TRUE;
+}
+
+static gint _matrix_expression_fail(MatrixExpressionParser *parser, const gchar *error)
+{
+    _matrix_expression_skip_space(parser);
+    if (!parser->error) {
+        parser->error = error;
+        parser->error_pos = parser->pos;
+    }
+
+    return -1;
+}
+
+static gint _matrix_expression_parse_conditional(MatrixExpressionParser *parser);
+static gint _matrix_expression_parse_unary(MatrixExpressionParser *parser);
+
+/* name or name(arguments) */
+static gint _matrix_expression_parse_name(MatrixExpressionParser *parser)
+{
+    static const struct {
+        const gchar *name;
+        guint reg;
+    } variables[] = {
+        { "x", MATRIX_EXPRESSION_REG_X },
+        { "i", MATRIX_EXPRESSION_REG_I },
+        { "j", MATRIX_EXPRESSION_REG_J },
+        { "rows", MATRIX_EXPRESSION_REG_ROWS },
+        { "cols", MATRIX_EXPRESSION_REG_COLUMNS }
+    };
+    const gchar *start = parser->pos;
+    gint args[3] = { -1, -1, -1 };
+    gsize length;
+    guint k, n;
+
+    while (g_ascii_isalnum(*parser->pos) || *parser->pos == '_')
+        ++parser->pos;
+    length = parser->pos - start;
+
+    for (k = 0; k < G_N_ELEMENTS(variables); ++k) {
+        if (strlen(variables[k].name) == length && strncmp(start, variables[k].name, length) == 0)
+            return _matrix_expression_leaf(parser, MATRIX_EXPRESSION_OP_VARIABLE, variables[k].reg);
+    }
+    if (length == 2 && strncmp(start, "pi", 2) == 0)
+        return _matrix_expression_leaf(parser, MATRIX_EXPRESSION_OP_CONSTANT, G_PI);
+    if (length == 1 && *start == 'e')
+        return _matrix_expression_leaf(parser, MATRIX_EXPRESSION_OP_CONSTANT, G_E);
+
+    for (k = 0; matrix_expression_functions[k].name; ++k) {
+        if (strlen(matrix_expression_functions[k].name) == length &&
+                strncmp(start, matrix_expression_functions[k].name, length) == 0)
+            break;
+    }
+    if (!matrix_expression_functions[k].name) {
+        parser->pos = start;
+        return _matrix_expression_fail(parser, "unknown name");
+    }
+
+    if (!_matrix_expression_accept(parser, "("))
+        return _matrix_expression_fail(parser, "expected `('");
+    for (n = 0; n < matrix_expression_functions[k].n_args; ++n) {
+        if (n > 0 && !_matrix_expression_accept(parser, ","))
+            return _matrix_expression_fail(parser, "expected `,'");
+        if ((args[n] = _matrix_expression_parse_conditional(parser)) < 0)
+            return -1;
+    }
+    if (!_matrix_expression_accept(parser, ")"))
+        return _matrix_expression_fail(parser, "expected `)'");
+
+    return _matrix_expression_node(parser, matrix_expression_functions[k].op, args[0], args[1], args[2]);
+}
+
+static gint _matrix_expression_parse_primary(MatrixExpressionParser *parser)
+{
+    gchar *end;
+    double value;
+    gint node;
+
+    _matrix_expression_skip_space(parser);
+
+    if (g_ascii_isdigit(*parser->pos) || *parser->pos == '.') {
+        value = g_ascii_strtod(parser->pos, &end);
+        if (end == parser->pos)
+            return _matrix_expression_fail(parser, "invalid number");
+        parser->pos = end;
+        return _matrix_expression_leaf(parser, MATRIX_EXPRESSION_OP_CONSTANT, value);
+    }
+
+    if (g_ascii_isalpha(*parser->pos) || *parser->pos == '_')
+        return _matrix_expression_parse_name(parser);
+
+    if (_matrix_expression_accept(parser, "(")) {
+        node = _matrix_expression_parse_conditional(parser);
+        if (node >= 0 && !_matrix_expression_accept(parser, ")"))
+            return _matrix_expression_fail(parser, "expected `)'");
+        return node;
+    }
+
+    return _matrix_expression_fail(parser, *parser->pos ? "unexpected character" : "unexpected end");
+}
+
+/* a ^ b, right associative and above the unary operators on the left: -x^2 is -(x^2) */
+static gint _matrix_expression_parse_power(MatrixExpressionParser *parser)
+{
+    gint node = _matrix_expression_parse_primary(parser);
+
+    if (node >= 0 && _matrix_expression_accept(parser, "^"))
+        return _matrix_expression_node(parser, MATRIX_EXPRESSION_OP_POW, node,
+                                       _matrix_expression_parse_unary(parser), -1);
+
+    return node;
+}
+
+static gint _matrix_expression_parse_unary(MatrixExpressionParser *parser)
+{
+    gint node;
+
+    if (parser->depth == MATRIX_EXPRESSION_MAX_DEPTH)
+        return _matrix_expression_fail(parser, "too deeply nested");
+    ++parser->depth;
+
+    if (_matrix_expression_accept(parser, "-"))
+        node = _matrix_expression_node(parser, MATRIX_EXPRESSION_OP_NEG,
+                                       _matrix_expression_parse_unary(parser), -1, -1);
+    else if (_matrix_expression_accept(parser, "+"))
+        node = _matrix_expression_parse_unary(parser);
+    else if (_matrix_expression_accept(parser, "!"))
+        node = _matrix_expression_node(parser, MATRIX_EXPRESSION_OP_NOT,
+                                       _matrix_expression_parse_unary(parser), -1, -1);
+    else
+        node = _matrix_expression_parse_power(parser);
+
+    --parser->depth;
+
+    return node;
+}
+
+/* Left associative binary operators of one precedence level: the tokens (longer
+ * ones first where one is the prefix of another), their operations and the
+ * parser of the next level. */
+static gint _matrix_expression_parse_binary(MatrixExpressionParser *parser, const gchar *const *tokens,
+                                            const MatrixExpressionOp *ops,
+                                            gint (*next)(MatrixExpressionParser *))
+{
+    gint node = next(parser);
+    guint k;
+
+    while (node >= 0) {
+        for (k = 0; tokens[k]; ++k) {
+            if (_matrix_expression_accept(parser, tokens[k]))
+                break;
+        }
+        if (!tokens[k])
+            break;
+        node = _matrix_expression_node(parser, ops[k], node, next(parser), -1);
+    }
+
+    return node;
+}
+
+static gint _matrix_expression_parse_product(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "*", "/", "%", NULL };
+    static const MatrixExpressionOp ops[] = {
+        MATRIX_EXPRESSION_OP_MUL, MATRIX_EXPRESSION_OP_DIV, MATRIX_EXPRESSION_OP_MOD
+    };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_unary);
+}
+
+static gint _matrix_expression_parse_sum(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "+", "-", NULL };
+    static const MatrixExpressionOp ops[] = { MATRIX_EXPRESSION_OP_ADD, MATRIX_EXPRESSION_OP_SUB };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_product);
+}
+
+static gint _matrix_expression_parse_comparison(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "<=", ">=", "<", ">", NULL };
+    static const MatrixExpressionOp ops[] = {
+        MATRIX_EXPRESSION_OP_LE, MATRIX_EXPRESSION_OP_GE, MATRIX_EXPRESSION_OP_LT, MATRIX_EXPRESSION_OP_GT
+    };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_sum);
+}
+
+static gint _matrix_expression_parse_equality(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "==", "!=", NULL };
+    static const MatrixExpressionOp ops[] = { MATRIX_EXPRESSION_OP_EQ, MATRIX_EXPRESSION_OP_NE };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_comparison);
+}
+
+static gint _matrix_expression_parse_and(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "&&", NULL };
+    static const MatrixExpressionOp ops[] = { MATRIX_EXPRESSION_OP_AND };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_equality);
+}
+
+static gint _matrix_expression_parse_or(MatrixExpressionParser *parser)
+{
+    static const gchar *const tokens[] = { "||", NULL };
+    static const MatrixExpressionOp ops[] = { MATRIX_EXPRESSION_OP_OR };
+
+    return _matrix_expression_parse_binary(parser, tokens, ops, _matrix_expression_parse_and);
+}
+
+/* c ? a : b, both sides are evaluated */
+static gint _matrix_expression_parse_conditional(MatrixExpressionParser *parser)
+{
+    gint node, a;
+
+    if (parser->depth == MATRIX_EXPRESSION_MAX_DEPTH)
+        return _matrix_expression_fail(parser, "too deeply nested");
+    ++parser->depth;
+
+    node = _matrix_expression_parse_or(parser);
+    if (node >= 0 && _matrix_expression_accept(parser, "?")) {
+        if ((a = _matrix_expression_parse_conditional(parser)) < 0)
+            node = -1;
+        else if (!_matrix_expression_accept(parser, ":"))
+            node = _matrix_expression_fail(parser, "expected `:'");
+        else
+            node = _matrix_expression_node(parser, MATRIX_EXPRESSION_OP_SELECT, node, a,
+                                           _matrix_expression_parse_conditional(parser));
+    }
+
+    --parser->depth;
+
+    return node;
+}
+
+static guint _matrix_expression_constant(MatrixExpression *expression, double value)
+{
+    guint k;
+
+    for (k = 0; k < expression->n_constants; ++k) {
+        if (memcmp(expression->constants + k, &value, sizeof(double)) == 0)
+            return MATRIX_EXPRESSION_N_VARIABLES + k;
+    }
+
+    expression->constants = g_renew(double, expression->constants, expression->n_constants + 1);
+    expression->constants[expression->n_constants] = value;
+
+    return MATRIX_EXPRESSION_N_VARIABLES + expression->n_constants++;
+}
+
+/* Emit the instructions for node; values computed at depth go to temporary
+ * depth, so the arguments of an operation do not overwrite each other. Returns
+ * the register of the value. */
+static guint _matrix_expression_emit(MatrixExpression *expression, GArray *code,
+                                     const MatrixExpressionNode *nodes, gint index, guint depth)
+{
+    const MatrixExpressionNode *node = nodes + index;
+    MatrixExpressionInstruction instruction = { node->op, MATRIX_EXPRESSION_TEMPORARY + depth, { 0, 0, 0 } };
+    guint k;
+
+    if (node->op == MATRIX_EXPRESSION_OP_VARIABLE)
+        return (guint)node->value;
+    if (node->op == MATRIX_EXPRESSION_OP_CONSTANT)
+        return _matrix_expression_constant(expression, node->value);
+
+    for (k = 0; k < _matrix_expression_n_args(node->op); ++k)
+        instruction.args[k] = _matrix_expression_emit(expression, code, nodes, node->args[k], depth + k);
+    g_array_append_val(code, instruction);
+
+    return instruction.dst;
+}
+
+/* Whether all zeros stay zero: the expression does not depend on the position,
+ * and its value at x = 0 is zero. */
+static gboolean _matrix_expression_keeps_zero(const MatrixExpression *expression)
+{
+    MatrixExpressionSpan span = { 1, 1, 0, FALSE, 0, 1, NULL };
+    double value = 0.0;
+    guint k, a;
+
+    for (k = 0; k < expression->n_code; ++k) {
+        for (a = 0; a < _matrix_expression_n_args(expression->code[k].op); ++a) {
+            if (expression->code[k].args[a] != MATRIX_EXPRESSION_REG_X &&
+                    expression->code[k].args[a] < MATRIX_EXPRESSION_N_VARIABLES)
+                return FALSE;
+        }
+    }
+    if (expression->result != MATRIX_EXPRESSION_REG_X && expression->result < MATRIX_EXPRESSION_N_VARIABLES)
+        return FALSE;
+
+    matrix_expression_eval(expression, &value, &value, 1, &span);
+
+    return value == 0.0;
+}
+
+/* Compile text; prints an error and returns NULL if it is not a valid
+ * expression. */
+MatrixExpression *matrix_expression_new(const gchar *text)
+{
+    MatrixExpressionParser parser = { text, text, NULL, NULL, NULL };
+    MatrixExpression *expression;
+    MatrixExpressionInstruction *instruction;
+    GArray *code;
+    guint k, a, n_temporaries = 0;
+    gint root;
+
+    parser.nodes = g_array_new(FALSE, FALSE, sizeof(MatrixExpressionNode));
+    root = _matrix_expression_parse_conditional(&parser);
+    if (root >= 0 && (_matrix_expression_skip_space(&parser), *parser.pos != '\0'))
+        root = _matrix_expression_fail(&parser, "unexpected character");
+
+    if (root < 0) {
+        g_printerr("Invalid transform `%s': %s at position %u.\n", text, parser.error,
+                   (guint)(parser.error_pos - text) + 1);
+        g_array_free(parser.nodes, TRUE);
+        return NULL;
+    }
+
+    expression = g_malloc0(sizeof(MatrixExpression));
+    expression->text = g_strdup(text);
+
+    code = g_array_new(FALSE, FALSE, sizeof(MatrixExpressionInstruction));
+    expression->result = _matrix_expression_emit(expression, code, (MatrixExpressionNode *)parser.nodes->data,
+                                                  root, 0);
+    g_array_free(parser.nodes, TRUE);
+
+    /* the temporaries follow the constants */
+    for (k = 0; k < code->len; ++k) {
+        instruction = &g_array_index(code, MatrixExpressionInstruction, k);
+        n_temporaries = MAX(n_temporaries, instruction->dst - MATRIX_EXPRESSION_TEMPORARY + 1);
+        instruction->dst += expression->n_constants + MATRIX_EXPRESSION_N_VARIABLES - MATRIX_EXPRESSION_TEMPORARY;
+        for (a = 0; a < 3; ++a) {
+            if (instruction->args[a] >= MATRIX_EXPRESSION_TEMPORARY)
+                instruction->args[a] += expression->n_constants + MATRIX_EXPRESSION_N_VARIABLES -
+                    MATRIX_EXPRESSION_TEMPORARY;
+        }
+    }
+    if (expression->result >= MATRIX_EXPRESSION_TEMPORARY)
+        expression->result += expression->n_constants + MATRIX_EXPRESSION_N_VARIABLES - MATRIX_EXPRESSION_TEMPORARY;
+
+    expression->n_registers = MATRIX_EXPRESSION_N_VARIABLES + expression->n_constants + n_temporaries;
+    expression->n_code = code->len;
+    expression->code = (MatrixExpressionInstruction *)g_array_free(code, FALSE);
+
+    if (expression->n_registers > MATRIX_EXPRESSION_MAX_REGISTERS) {
+        g_printerr("Invalid transform `%s': too many constants or too deeply nested.\n", text);
+        matrix_expression_free(expression);
+        return NULL;
+    }
+
+    expression->keeps_zero = _matrix_expression_keeps_zero(expression);
+
+    return expression;
+}
+
+void matrix_expression_free(MatrixExpression *expression)
+{
+    if (!expression)
+        return;
+
+    g_free(expression->text);
+    g_free(expression->code);
+    g_free(expression->constants);
+    g_free(expression);
+}
+
+const gchar *matrix_expression_get_text(const MatrixExpression *expression)
+{
+    return expression ? expression->text : NULL;
+}
+
+/* Whether the zeros of a matrix stay zero, so that sparse matrices can keep
+ * their structure; see _matrix_expression_keeps_zero(). */
+gboolean matrix_expression_keeps_zero(const MatrixExpression *expression)
+{
+    return !expression || expression->keeps_zero;
+}
+
+/* Evaluate the expression for count values of src lying in span, into dst,
+ * which may be equal to src. The values are processed in blocks of
+ * MATRIX_EXPRESSION_BLOCK, one instruction at a time. */
+void matrix_expression_eval(const MatrixExpression *expression, double *dst, const double *src, guint32 count,
+                            const MatrixExpressionSpan *span)
+{
+    guint32 n_block = MIN(count, MATRIX_EXPRESSION_BLOCK);
+    double storage[MATRIX_EXPRESSION_MAX_REGISTERS * MATRIX_EXPRESSION_BLOCK];
+    double *reg[MATRIX_EXPRESSION_MAX_REGISTERS];
+    double *position, *fixed;
+    const MatrixExpressionInstruction *instruction;
+    guint32 start, n, k;
+    guint r;
+
+    for (r = 0; r < expression->n_registers; ++r)
+        reg[r] = storage + (gsize)r * n_block;
+
+    /* everything but x and the position along the line is the same for all blocks */
+    position = reg[span->is_column ? MATRIX_EXPRESSION_REG_I : MATRIX_EXPRESSION_REG_J];
+    fixed = reg[span->is_column ? MATRIX_EXPRESSION_REG_J : MATRIX_EXPRESSION_REG_I];
+    for (k = 0; k < n_block; ++k) {
+        fixed[k] = span->index;
+        reg[MATRIX_EXPRESSION_REG_ROWS][k] = span->n_rows;
+        reg[MATRIX_EXPRESSION_REG_COLUMNS][k] = span->n_columns;
+    }
+    for (r = 0; r < expression->n_constants; ++r) {
+        for (k = 0; k < n_block; ++k)
+            reg[MATRIX_EXPRESSION_N_VARIABLES + r][k] = expression->constants[r];
+    }
+
+    for (start = 0; start < count; start += n) {
+        n = MIN(count - start, MATRIX_EXPRESSION_BLOCK);
+
+        reg[MATRIX_EXPRESSION_REG_X] = (double *)src + start;
+        if (span->positions) {
+            for (k = 0; k < n; ++k)
+                position[k] = span->positions[start + k];
+        }
+        else {
+            for (k = 0; k < n; ++k)
+                position[k] = span->first + (double)(start + k) * span->step;
+        }
+
+        for (instruction = expression->code; instruction < expression->code + expression->n_code; ++instruction)
+            _matrix_expression_op(instruction->op, reg[instruction->dst], reg[instruction->args[0]],
+                                  reg[instruction->args[1]], reg[instruction->args[2]], n);
+
+        if (dst + start != reg[expression->result])
+            memmove(dst + start, reg[expression->result], n * sizeof(double));
+    }
+}
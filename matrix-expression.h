@@ -0,0 +1,43 @@
+#pragma once
+
+#include <glib.h>
+
+/* Custom transforms of the entries, e.g. "log10(abs(x) + 1e-12)" or
+ * "clamp(x, -1, 1)". An expression is compiled once into instructions on
+ * registers holding a block of values each, so every instruction runs as a
+ * tight loop over the block instead of interpreting the expression per entry.
+ *
+ * Variables are the entry x, its row i and column j (zero based) and the size
+ * rows and cols of the matrix; constants pi and e. Operators, from the lowest
+ * precedence: c ? a : b, ||, &&, == !=, < <= > >=, + -, * / %, unary - + !,
+ * ^ (right associative). Comparisons and logical operators give 1 or 0.
+ * Functions: abs sign sqrt cbrt exp expm1 log log1p log2 log10 sin cos tan
+ * asin acos atan sinh cosh tanh floor ceil round trunc, min max pow atan2
+ * hypot, clamp(x, lo, hi). The values of a block are kept on the stack, so
+ * expressions with more than about 60 constants and levels of nesting are
+ * rejected, as are more than 256 nested unary operators and conditionals
+ * (a parenthesis counts as two) while parsing. */
+
+#define MATRIX_EXPRESSION_BLOCK 256
+
+typedef struct _MatrixExpression MatrixExpression;
+
+/* Where the values of a line lie: the k-th value is in row index (or column
+ * index, if is_column) at position first + k * step along the line, or at
+ * positions[k] if positions is not NULL. */
+typedef struct {
+    guint32 n_rows;
+    guint32 n_columns;
+    guint32 index;
+    gboolean is_column;
+    guint32 first;
+    guint32 step;
+    const guint32 *positions;
+} MatrixExpressionSpan;
+
+MatrixExpression *matrix_expression_new(const gchar *text);
+void matrix_expression_free(MatrixExpression *expression);
+const gchar *matrix_expression_get_text(const MatrixExpression *expression);
+gboolean matrix_expression_keeps_zero(const MatrixExpression *expression);
+void matrix_expression_eval(const MatrixExpression *expression, double *dst, const double *src, guint32 count,
+                            const MatrixExpressionSpan *span);
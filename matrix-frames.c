@@ -0,0 +1,557 @@
+#include "matrix-frames.h"
+#include "matrix-view.h"
+#include <string.h>
+
+/* A block of packed entries. Bit k of the mask (the first (n_words + 63) / 64
+ * words of data) is set for each word of the block that is not zero; only
+ * these words follow. */
+typedef struct {
+    guint hash;
+    guint32 length;
+    guint32 n_words;
+    guint32 n_nonzero;
+    guint64 data[];
+} MatrixFramesBlock;
+
+/* A matrix kept packed: the blocks of its entries, or of their XOR with the
+ * entries of base. */
+typedef struct {
+    guint32 n_rows;
+    guint32 n_columns;
+    MatrixPrecision precision;
+    double scale;
+    double offset;
+    gboolean has_stats;
+    MatrixStats stats;
+
+    guint base;
+    guint n_blocks;
+    MatrixFramesBlock **blocks;
+} MatrixFramesPacked;
+
+#define MATRIX_FRAMES_NONE G_MAXUINT
+
+typedef struct {
+    /* where matrices that are not kept as they are come from */
+    GMappedFile *file;
+    MatrixReaderFrame position;
+    MatrixFramesPacked *packed;
+
+    Matrix *matrix;
+    gboolean loading;
+    /* the matrix is read from, see _matrix_frames_unpack() */
+    guint users;
+    guint64 last_use;
+} MatrixFramesEntry;
+
+struct _MatrixFrames {
+    GArray *entries;
+    GPtrArray *files;
+
+    MatrixRegion region;
+    MatrixPrecision precision;
+    guint n_jobs;
+
+    /* packed blocks by contents; while appending, the last matrix that is packed
+     * (kept in memory for the next delta) and one that will be packed as soon as
+     * there is another one */
+    GHashTable *blocks;
+    MatrixFramesBlock *scratch;
+    guint reference;
+    guint unpacked;
+    guint n_deltas;
+
+    /* read matrices of files, apart from the current and the previous one, the
+     * least recently used ones are dropped first */
+    guint cache_size;
+    guint n_cached;
+    guint64 clock;
+    guint current;
+    guint previous;
+
+    GThreadPool *prefetch;
+    GMutex lock;
+    GCond loaded;
+};
+
+static inline MatrixFramesEntry *_matrix_frames_entry(MatrixFrames *frames, guint index)
+{
+    return &g_array_index(frames->entries, MatrixFramesEntry, index);
+}
+
+/* Can the matrix be dropped and read again? */
+static inline gboolean _matrix_frames_is_cached(MatrixFramesEntry *entry)
+{
+    return entry->file != NULL || entry->packed != NULL;
+}
+
+static guint _matrix_frames_block_hash(gconstpointer key)
+{
+    return ((const MatrixFramesBlock *)key)->hash;
+}
+
+static gboolean _matrix_frames_block_equal(gconstpointer a, gconstpointer b)
+{
+    const MatrixFramesBlock *x = a, *y = b;
+
+    return x->hash == y->hash && x->length == y->length && x->n_nonzero == y->n_nonzero &&
+        memcmp(x->data, y->data, ((x->n_words + 63) / 64 + x->n_nonzero) * sizeof(guint64)) == 0;
+}
+
+/* The block of length bytes at data, as XOR with reference unless that is
+ * NULL; equal blocks are stored once. */
+static MatrixFramesBlock *_matrix_frames_block_pack(MatrixFrames *frames, const guint8 *data,
+                                                    const guint8 *reference, guint32 length)
+{
+    MatrixFramesBlock *block = frames->scratch, *stored;
+    guint32 n_words = (length + 7) / 8, n_mask = (n_words + 63) / 64, k, n;
+    guint64 *mask = block->data, *words = block->data + n_mask;
+    guint64 w, r, hash = G_GUINT64_CONSTANT(14695981039346656037);
+    gsize size;
+
+    memset(mask, 0, n_mask * sizeof(guint64));
+    block->n_nonzero = 0;
+    for (k = 0; k < n_words; ++k) {
+        n = MIN(8, length - 8 * k);
+        w = r = 0;
+        if (G_LIKELY(n == 8)) {
+            memcpy(&w, data + 8 * k, 8);
+            if (reference)
+                memcpy(&r, reference + 8 * k, 8);
+        }
+        else {
+            memcpy(&w, data + 8 * k, n);
+            if (reference)
+                memcpy(&r, reference + 8 * k, n);
+        }
+        if ((w ^= r) != 0) {
+            mask[k / 64] |= G_GUINT64_CONSTANT(1) << (k % 64);
+            words[block->n_nonzero++] = w;
+        }
+    }
+
+    /* FNV-1a on words */
+    for (k = 0; k < n_mask + block->n_nonzero; ++k)
+        hash = (hash ^ block->data[k]) * G_GUINT64_CONSTANT(1099511628211);
+
+    block->hash = (guint)(hash ^ (hash >> 32));
+    block->length = length;
+    block->n_words = n_words;
+
+    if ((stored = g_hash_table_lookup(frames->blocks, block)))
+        return stored;
+
+    size = sizeof(MatrixFramesBlock) + (n_mask + block->n_nonzero) * sizeof(guint64);
+    stored = g_malloc(size);
+    memcpy(stored, block, size);
+    g_hash_table_add(frames->blocks, stored);
+
+    return stored;
+}
+
+/* XOR the words of block into dst. */
+static void _matrix_frames_block_apply(const MatrixFramesBlock *block, guint8 *dst)
+{
+    guint32 n_mask = (block->n_words + 63) / 64, i, k, n;
+    const guint64 *words = block->data + n_mask;
+    guint64 bits, w;
+
+    for (i = 0; i < n_mask; ++i) {
+        for (bits = block->data[i]; bits; bits &= bits - 1) {
+            k = 64 * i + __builtin_ctzll(bits);
+            n = MIN(8, block->length - 8 * k);
+            if (G_LIKELY(n == 8)) {
+                memcpy(&w, dst + 8 * k, 8);
+                w ^= *words++;
+                memcpy(dst + 8 * k, &w, 8);
+            }
+            else {
+                w = 0;
+                memcpy(&w, dst + 8 * k, n);
+                w ^= *words++;
+                memcpy(dst + 8 * k, &w, n);
+            }
+        }
+    }
+}
+
+/* Can the entries of b be stored as XOR with those of a? */
+static gboolean _matrix_frames_is_compatible(Matrix *a, Matrix *b)
+{
+    return a->n_rows == b->n_rows && a->n_columns == b->n_columns && a->precision == b->precision;
+}
+
+static gboolean _matrix_frames_is_packable(Matrix *m)
+{
+    return m->storage == MATRIX_STORAGE_DENSE && m->mapping == NULL && m->n_entries > 0;
+}
+
+/* Pack the matrix at index, as delta to the reference if possible. The matrix
+ * itself stays in memory until the next one is packed. */
+static void _matrix_frames_pack(MatrixFrames *frames, guint index)
+{
+    MatrixFramesEntry *entry = _matrix_frames_entry(frames, index), *reference;
+    MatrixFramesPacked *packed = g_malloc0(sizeof(MatrixFramesPacked));
+    Matrix *m = entry->matrix, *base = NULL;
+    gsize size = m->n_entries * matrix_precision_size(m->precision), offset;
+    guint k;
+
+    reference = frames->reference != MATRIX_FRAMES_NONE ? _matrix_frames_entry(frames, frames->reference) : NULL;
+    if (reference && _matrix_frames_is_compatible(reference->matrix, m) &&
+            frames->n_deltas + 1 < MATRIX_FRAMES_KEYFRAME_INTERVAL) {
+        base = reference->matrix;
+        ++frames->n_deltas;
+    }
+    else {
+        frames->n_deltas = 0;
+    }
+
+    packed->n_rows = m->n_rows;
+    packed->n_columns = m->n_columns;
+    packed->precision = m->precision;
+    packed->scale = m->scale;
+    packed->offset = m->offset;
+    packed->has_stats = m->has_stats;
+    packed->stats = m->stats;
+    packed->base = base ? frames->reference : MATRIX_FRAMES_NONE;
+    packed->n_blocks = (size + MATRIX_FRAMES_BLOCK_SIZE - 1) / MATRIX_FRAMES_BLOCK_SIZE;
+    packed->blocks = g_malloc(packed->n_blocks * sizeof(MatrixFramesBlock *));
+
+    for (k = 0, offset = 0; k < packed->n_blocks; ++k, offset += MATRIX_FRAMES_BLOCK_SIZE)
+        packed->blocks[k] = _matrix_frames_block_pack(frames, (const guint8 *)m->data + offset,
+                                                      base ? (const guint8 *)base->data + offset : NULL,
+                                                      MIN(size - offset, MATRIX_FRAMES_BLOCK_SIZE));
+
+    if (reference) {
+        matrix_free(reference->matrix);
+        reference->matrix = NULL;
+        --frames->n_cached;
+    }
+
+    entry->packed = packed;
+    ++frames->n_cached;
+    frames->reference = index;
+}
+
+/* Entries of the packed matrix at index: the nearest matrix in memory on the
+ * way back to its keyframe, then the deltas after it. */
+static Matrix *_matrix_frames_unpack(MatrixFrames *frames, guint index)
+{
+    MatrixFramesEntry *entry, *start = NULL;
+    MatrixFramesPacked *packed = _matrix_frames_entry(frames, index)->packed;
+    guint chain[MATRIX_FRAMES_KEYFRAME_INTERVAL];
+    guint n_chain = 0, j, k;
+    Matrix *m = matrix_new();
+    guint8 *data;
+
+    g_mutex_lock(&frames->lock);
+    for (j = index; ; j = entry->packed->base) {
+        entry = _matrix_frames_entry(frames, j);
+        if (j != index && entry->matrix) {
+            start = entry;
+            ++start->users;
+            break;
+        }
+        chain[n_chain++] = j;
+        if (entry->packed->base == MATRIX_FRAMES_NONE)
+            break;
+    }
+    g_mutex_unlock(&frames->lock);
+
+    matrix_init_dense(m, packed->n_rows, packed->n_columns, packed->precision, 0.0, 0.0);
+    m->scale = packed->scale;
+    m->offset = packed->offset;
+    m->has_stats = packed->has_stats;
+    m->stats = packed->stats;
+    data = m->data;
+
+    if (start) {
+        memcpy(data, start->matrix->data, m->n_entries * matrix_precision_size(m->precision));
+        g_mutex_lock(&frames->lock);
+        --start->users;
+        g_mutex_unlock(&frames->lock);
+    }
+    else {
+        memset(data, 0, m->n_entries * matrix_precision_size(m->precision));
+    }
+
+    while (n_chain > 0) {
+        packed = _matrix_frames_entry(frames, chain[--n_chain])->packed;
+        for (k = 0; k < packed->n_blocks; ++k)
+            _matrix_frames_block_apply(packed->blocks[k], data + (gsize)k * MATRIX_FRAMES_BLOCK_SIZE);
+    }
+
+    return m;
+}
+
+static Matrix *_matrix_frames_load(MatrixFrames *frames, guint index)
+{
+    MatrixFramesEntry *entry = _matrix_frames_entry(frames, index);
+    Matrix *m;
+
+    if (entry->packed)
+        return _matrix_frames_unpack(frames, index);
+
+    m = matrix_read_frame(g_mapped_file_get_contents(entry->file), &entry->position,
+                          frames->n_jobs, &frames->region);
+    if (m)
+        matrix_set_precision(m, frames->precision);
+
+    return m;
+}
+
+static void _matrix_frames_prefetch(gpointer data, MatrixFrames *frames)
+{
+    MatrixFramesEntry *entry;
+    guint index = GPOINTER_TO_UINT(data) - 1;
+    Matrix *m;
+
+    g_mutex_lock(&frames->lock);
+    entry = _matrix_frames_entry(frames, index);
+    if (entry->matrix || entry->loading) {
+        g_mutex_unlock(&frames->lock);
+        return;
+    }
+    entry->loading = TRUE;
+    g_mutex_unlock(&frames->lock);
+
+    m = _matrix_frames_load(frames, index);
+
+    g_mutex_lock(&frames->lock);
+    entry->matrix = m;
+    entry->loading = FALSE;
+    if (m)
+        ++frames->n_cached;
+    g_cond_broadcast(&frames->loaded);
+    g_mutex_unlock(&frames->lock);
+}
+
+MatrixFrames *matrix_frames_new(const MatrixRegion *region, MatrixPrecision precision, guint n_jobs)
+{
+    MatrixFrames *frames = g_malloc0(sizeof(MatrixFrames));
+
+    frames->entries = g_array_new(FALSE, TRUE, sizeof(MatrixFramesEntry));
+    frames->files = g_ptr_array_new_with_free_func((GDestroyNotify)g_mapped_file_unref);
+    if (region)
+        frames->region = *region;
+    else
+        matrix_region_init(&frames->region);
+    frames->precision = precision;
+    frames->n_jobs = MAX(n_jobs, 1);
+    frames->cache_size = MATRIX_FRAMES_CACHE_SIZE;
+
+    frames->blocks = g_hash_table_new_full(_matrix_frames_block_hash, _matrix_frames_block_equal, g_free, NULL);
+    frames->scratch = g_malloc(sizeof(MatrixFramesBlock) +
+                               (MATRIX_FRAMES_BLOCK_SIZE / 8 + MATRIX_FRAMES_BLOCK_SIZE / 512) * sizeof(guint64));
+    frames->reference = MATRIX_FRAMES_NONE;
+    frames->unpacked = MATRIX_FRAMES_NONE;
+
+    g_mutex_init(&frames->lock);
+    g_cond_init(&frames->loaded);
+    frames->prefetch = g_thread_pool_new((GFunc)_matrix_frames_prefetch, frames, 1, FALSE, NULL);
+
+    return frames;
+}
+
+void matrix_frames_free(MatrixFrames *frames)
+{
+    MatrixFramesEntry *entry;
+    guint k;
+
+    if (!frames)
+        return;
+
+    /* drop what is queued, wait for the frame being read */
+    g_thread_pool_free(frames->prefetch, TRUE, TRUE);
+
+    for (k = 0; k < frames->entries->len; ++k) {
+        entry = _matrix_frames_entry(frames, k);
+        if (entry->matrix) {
+            matrix_view_cache_remove(entry->matrix);
+            matrix_free(entry->matrix);
+        }
+        if (entry->packed) {
+            g_free(entry->packed->blocks);
+            g_free(entry->packed);
+        }
+    }
+
+    g_array_free(frames->entries, TRUE);
+    g_ptr_array_free(frames->files, TRUE);
+    g_hash_table_destroy(frames->blocks);
+    g_free(frames->scratch);
+    g_mutex_clear(&frames->lock);
+    g_cond_clear(&frames->loaded);
+    g_free(frames);
+}
+
+/* Append matrices that are already read; frames takes them over. Dense ones
+ * are packed as soon as there are two of them. Frames can be appended only
+ * before the first one is asked for. */
+void matrix_frames_append_matrices(MatrixFrames *frames, GList *matrices)
+{
+    MatrixFramesEntry entry;
+    GList *tmp;
+    guint index;
+
+    g_return_if_fail(frames != NULL);
+
+    memset(&entry, 0, sizeof(MatrixFramesEntry));
+    for (tmp = matrices; tmp; tmp = g_list_next(tmp)) {
+        entry.matrix = tmp->data;
+        index = frames->entries->len;
+        g_array_append_val(frames->entries, entry);
+
+        if (!_matrix_frames_is_packable(entry.matrix))
+            continue;
+        if (frames->unpacked != MATRIX_FRAMES_NONE) {
+            _matrix_frames_pack(frames, frames->unpacked);
+            frames->unpacked = MATRIX_FRAMES_NONE;
+        }
+        if (frames->reference != MATRIX_FRAMES_NONE)
+            _matrix_frames_pack(frames, index);
+        else
+            frames->unpacked = index;
+    }
+
+    g_list_free(matrices);
+}
+
+/* Append the matrices of text mapped in file, as found by
+ * matrix_reader_index_buffer(); those without entries in the region are left
+ * out. frames takes over the reference to file and index. */
+void matrix_frames_append_file(MatrixFrames *frames, GMappedFile *file, GArray *index)
+{
+    MatrixFramesEntry entry;
+    MatrixReaderFrame *position;
+    guint k;
+
+    g_return_if_fail(frames != NULL);
+
+    memset(&entry, 0, sizeof(MatrixFramesEntry));
+    entry.file = file;
+    for (k = 0; k < index->len; ++k) {
+        position = &g_array_index(index, MatrixReaderFrame, k);
+        if (matrix_slice_count(&frames->region.rows, position->n_rows) == 0 ||
+                matrix_slice_count(&frames->region.columns, position->n_columns) == 0)
+            continue;
+        entry.position = *position;
+        g_array_append_val(frames->entries, entry);
+    }
+
+    g_ptr_array_add(frames->files, file);
+    g_array_free(index, TRUE);
+}
+
+/* Number of read matrices to keep, at least the current and the previous one;
+ * takes effect with the next call to matrix_frames_get(). */
+void matrix_frames_set_cache_size(MatrixFrames *frames, guint cache_size)
+{
+    g_return_if_fail(frames != NULL);
+
+    frames->cache_size = MAX(cache_size, 2);
+}
+
+guint matrix_frames_get_count(MatrixFrames *frames)
+{
+    return frames ? frames->entries->len : 0;
+}
+
+/* Drop the least recently used matrices beyond the cache size; returns them
+ * to be freed outside of the lock. */
+static GSList *_matrix_frames_evict(MatrixFrames *frames)
+{
+    MatrixFramesEntry *entry, *oldest;
+    GSList *evicted = NULL;
+    guint k;
+
+    while (frames->n_cached > frames->cache_size) {
+        oldest = NULL;
+        for (k = 0; k < frames->entries->len; ++k) {
+            entry = _matrix_frames_entry(frames, k);
+            if (!_matrix_frames_is_cached(entry) || !entry->matrix || entry->users ||
+                    k == frames->current || k == frames->previous)
+                continue;
+            if (!oldest || entry->last_use < oldest->last_use)
+                oldest = entry;
+        }
+        if (!oldest)
+            break;
+
+        evicted = g_slist_prepend(evicted, oldest->matrix);
+        oldest->matrix = NULL;
+        --frames->n_cached;
+    }
+
+    return evicted;
+}
+
+static void _matrix_frames_queue(MatrixFrames *frames, guint index)
+{
+    MatrixFramesEntry *entry = _matrix_frames_entry(frames, index);
+
+    if (!_matrix_frames_is_cached(entry))
+        return;
+    entry->last_use = ++frames->clock;
+    g_thread_pool_push(frames->prefetch, GUINT_TO_POINTER(index + 1), NULL);
+}
+
+/* The matrix at index; it stays valid until the two after it have been asked
+ * for, or as long as frames if it is kept as it is. */
+Matrix *matrix_frames_get(MatrixFrames *frames, guint index)
+{
+    MatrixFramesEntry *entry;
+    Matrix *m;
+    GSList *evicted, *tmp;
+    guint count, k;
+
+    g_return_val_if_fail(frames != NULL, NULL);
+
+    count = frames->entries->len;
+    if (index >= count)
+        return NULL;
+
+    g_mutex_lock(&frames->lock);
+
+    entry = _matrix_frames_entry(frames, index);
+    while (entry->loading)
+        g_cond_wait(&frames->loaded, &frames->lock);
+
+    if (!entry->matrix) {
+        entry->loading = TRUE;
+        g_mutex_unlock(&frames->lock);
+        m = _matrix_frames_load(frames, index);
+        g_mutex_lock(&frames->lock);
+        entry->matrix = m;
+        entry->loading = FALSE;
+        if (m)
+            ++frames->n_cached;
+        g_cond_broadcast(&frames->loaded);
+    }
+
+    m = entry->matrix;
+    entry->last_use = ++frames->clock;
+    if (index != frames->current) {
+        frames->previous = frames->current;
+        frames->current = index;
+    }
+
+    evicted = _matrix_frames_evict(frames);
+
+    /* the neighbours on both sides, wrapping around like stepping through the
+     * frames does */
+    for (k = 1; k <= MATRIX_FRAMES_PREFETCH && k < count; ++k) {
+        _matrix_frames_queue(frames, (index + k) % count);
+        _matrix_frames_queue(frames, (index + count - k) % count);
+    }
+
+    g_mutex_unlock(&frames->lock);
+
+    for (tmp = evicted; tmp; tmp = g_slist_next(tmp)) {
+        matrix_view_cache_remove(tmp->data);
+        matrix_free(tmp->data);
+    }
+    g_slist_free(evicted);
+
+    return m;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+#include "matrix-reader.h"
+
+/* A sequence of matrices, e.g. the frames of a simulation, that does not have
+ * to be in memory at once. Text files are only indexed when they are added
+ * (see matrix_reader_index_buffer()) and each matrix is read when it is asked
+ * for. The most recently used ones are kept, and the neighbours of the last one
+ * asked for are read in the background.
+ *
+ * Dense matrices of other inputs are packed: every MATRIX_FRAMES_KEYFRAME_INTERVAL
+ * matrices one is stored as it is, the others as XOR with the one before, which
+ * is mostly zero if only a few entries change. The entries are split into
+ * blocks of MATRIX_FRAMES_BLOCK_SIZE bytes, zero words are left out and equal
+ * blocks are stored once. Packed matrices are unpacked like text is read,
+ * from the one before if it is still kept, so stepping through the sequence
+ * (in the window or when exporting) unpacks one difference per matrix.
+ * Sparse and mapped matrices are kept as they are. */
+
+#define MATRIX_FRAMES_CACHE_SIZE 16
+#define MATRIX_FRAMES_PREFETCH 2
+#define MATRIX_FRAMES_KEYFRAME_INTERVAL 16
+#define MATRIX_FRAMES_BLOCK_SIZE (1 << 16)
+
+typedef struct _MatrixFrames MatrixFrames;
+
+MatrixFrames *matrix_frames_new(const MatrixRegion *region, MatrixPrecision precision, guint n_jobs);
+void matrix_frames_free(MatrixFrames *frames);
+void matrix_frames_append_matrices(MatrixFrames *frames, GList *matrices);
+void matrix_frames_append_file(MatrixFrames *frames, GMappedFile *file, GArray *index);
+void matrix_frames_set_cache_size(MatrixFrames *frames, guint cache_size);
+
+guint matrix_frames_get_count(MatrixFrames *frames);
+Matrix *matrix_frames_get(MatrixFrames *frames, guint index);
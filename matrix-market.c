@@ -0,0 +1,353 @@
+#include "matrix-market.h"
+#include "matrix-reader.h"
+#include <string.h>
+
+typedef enum {
+    MATRIX_MARKET_GENERAL,
+    MATRIX_MARKET_SYMMETRIC,
+    MATRIX_MARKET_SKEW_SYMMETRIC
+} MatrixMarketSymmetry;
+
+typedef struct {
+    const gchar *pos;
+    const gchar *end;
+    guint64 line;
+
+    gboolean coordinate;
+    gboolean pattern;
+    gboolean complex;
+    MatrixMarketSymmetry symmetry;
+} MatrixMarketParser;
+
+gboolean matrix_market_check_magic(const gchar *data, gsize length)
+{
+    return length >= MATRIX_MARKET_MAGIC_LENGTH &&
+        memcmp(data, MATRIX_MARKET_MAGIC, MATRIX_MARKET_MAGIC_LENGTH) == 0;
+}
+
+/* Skip blanks and tabs; with newlines, also skip line breaks, empty lines and comments. */
+static void _matrix_market_skip(MatrixMarketParser *parser, gboolean newlines)
+{
+    while (parser->pos < parser->end) {
+        if (*parser->pos == ' ' || *parser->pos == '\t' || *parser->pos == '\r') {
+            ++parser->pos;
+        }
+        else if (newlines && *parser->pos == '\n') {
+            ++parser->pos;
+            ++parser->line;
+        }
+        else if (newlines && *parser->pos == '%') {
+            while (parser->pos < parser->end && *parser->pos != '\n')
+                ++parser->pos;
+        }
+        else {
+            break;
+        }
+    }
+}
+
+static void _matrix_market_skip_line(MatrixMarketParser *parser)
+{
+    while (parser->pos < parser->end && *parser->pos != '\n')
+        ++parser->pos;
+}
+
+static gboolean _matrix_market_parse_index(MatrixMarketParser *parser, guint64 *value)
+{
+    const gchar *start;
+
+    _matrix_market_skip(parser, FALSE);
+    for (start = parser->pos, *value = 0;
+         parser->pos < parser->end && g_ascii_isdigit(*parser->pos) && *value < G_MAXUINT64 / 10 - 9;
+         ++parser->pos)
+        *value = *value * 10 + (*parser->pos - '0');
+
+    return parser->pos > start;
+}
+
+/* Value of the next entry; pattern matrices have ones, complex ones their real part. */
+static gboolean _matrix_market_parse_value(MatrixMarketParser *parser, double *value)
+{
+    gsize n;
+    double imaginary;
+
+    if (parser->pattern) {
+        *value = 1.0;
+        return TRUE;
+    }
+
+    _matrix_market_skip(parser, FALSE);
+    if ((n = matrix_reader_parse_double(parser->pos, parser->end, value)) == 0)
+        return FALSE;
+    parser->pos += n;
+
+    if (parser->complex) {
+        _matrix_market_skip(parser, FALSE);
+        if ((n = matrix_reader_parse_double(parser->pos, parser->end, &imaginary)) == 0)
+            return FALSE;
+        parser->pos += n;
+    }
+
+    return TRUE;
+}
+
+static gboolean _matrix_market_parse_banner(MatrixMarketParser *parser)
+{
+    const gchar *nl = memchr(parser->pos, '\n', parser->end - parser->pos);
+    gchar *banner = g_ascii_strdown(parser->pos, (nl ? nl : parser->end) - parser->pos);
+    gchar **words = g_strsplit_set(banner, " \t\r", 0);
+    gchar *fields[5];
+    guint n, k;
+    gboolean success = FALSE;
+
+    for (n = 0, k = 0; words[k] && n < 5; ++k) {
+        if (words[k][0])
+            fields[n++] = words[k];
+    }
+
+    if (n < 5 || strcmp(fields[1], "matrix") != 0)
+        goto done;
+
+    if (strcmp(fields[2], "coordinate") == 0)
+        parser->coordinate = TRUE;
+    else if (strcmp(fields[2], "array") == 0)
+        parser->coordinate = FALSE;
+    else
+        goto done;
+
+    parser->pattern = strcmp(fields[3], "pattern") == 0;
+    parser->complex = strcmp(fields[3], "complex") == 0;
+    if (!parser->pattern && !parser->complex &&
+            strcmp(fields[3], "real") != 0 && strcmp(fields[3], "double") != 0 &&
+            strcmp(fields[3], "integer") != 0)
+        goto done;
+    if (parser->pattern && !parser->coordinate)
+        goto done;
+
+    if (strcmp(fields[4], "general") == 0)
+        parser->symmetry = MATRIX_MARKET_GENERAL;
+    else if (strcmp(fields[4], "symmetric") == 0 || strcmp(fields[4], "hermitian") == 0)
+        parser->symmetry = MATRIX_MARKET_SYMMETRIC;
+    else if (strcmp(fields[4], "skew-symmetric") == 0)
+        parser->symmetry = MATRIX_MARKET_SKEW_SYMMETRIC;
+    else
+        goto done;
+
+    success = TRUE;
+
+done:
+    if (!success)
+        g_printerr("Unsupported Matrix Market file: %s\n", banner);
+    g_strfreev(words);
+    g_free(banner);
+
+    _matrix_market_skip_line(parser);
+
+    return success;
+}
+
+/* Sort triplets into rows and, within the rows, by column (two stable counting
+ * sorts), then add up duplicate entries. */
+static Matrix *_matrix_market_build_csr(guint32 n_rows, guint32 n_columns, guint64 count,
+                                        guint32 *rows, guint32 *columns, double *values)
+{
+    Matrix *m;
+    guint64 *column_offsets = g_malloc0(((gsize)n_columns + 1) * sizeof(guint64));
+    guint64 *order = g_new(guint64, count);
+    guint64 k, pos, start, end;
+    guint32 i, j;
+
+    for (k = 0; k < count; ++k)
+        ++column_offsets[columns[k] + 1];
+    for (j = 0; j < n_columns; ++j)
+        column_offsets[j + 1] += column_offsets[j];
+    for (k = 0; k < count; ++k)
+        order[column_offsets[columns[k]]++] = k;
+    g_free(column_offsets);
+
+    m = matrix_new_csr(n_rows, n_columns, count);
+    for (k = 0; k < count; ++k)
+        ++m->row_offsets[rows[k] + 1];
+    for (i = 0; i < n_rows; ++i)
+        m->row_offsets[i + 1] += m->row_offsets[i];
+    for (k = 0; k < count; ++k) {
+        pos = m->row_offsets[rows[order[k]]]++;
+        m->column_indices[pos] = columns[order[k]];
+        m->values[pos] = values[order[k]];
+    }
+    g_free(order);
+
+    /* row_offsets now hold the ends of the rows; move them back while adding up
+     * duplicate entries */
+    end = m->row_offsets[0];
+    m->row_offsets[0] = 0;
+    for (i = 0, pos = 0, start = 0; i < n_rows; ++i) {
+        for (k = start; k < end; ++k) {
+            if (pos > m->row_offsets[i] && m->column_indices[pos - 1] == m->column_indices[k]) {
+                m->values[pos - 1] += m->values[k];
+            }
+            else {
+                m->column_indices[pos] = m->column_indices[k];
+                m->values[pos] = m->values[k];
+                ++pos;
+            }
+        }
+        start = end;
+        end = m->row_offsets[i + 1];
+        m->row_offsets[i + 1] = pos;
+    }
+
+    if (pos < count) {
+        m->nnz = pos;
+        m->column_indices = g_realloc(m->column_indices, pos * sizeof(guint32));
+        m->values = g_realloc(m->values, pos * sizeof(double));
+    }
+
+    return m;
+}
+
+static Matrix *_matrix_market_read_coordinate(MatrixMarketParser *parser, guint64 n_rows, guint64 n_columns)
+{
+    guint64 nnz, capacity, shortest, count = 0, k, i, j;
+    guint32 *rows, *columns;
+    double *values;
+    double value;
+    Matrix *m;
+
+    if (!_matrix_market_parse_index(parser, &nnz)) {
+        g_printerr("Matrix Market: missing number of entries at line %" G_GUINT64_FORMAT "\n", parser->line);
+        return NULL;
+    }
+    _matrix_market_skip_line(parser);
+
+    /* the shortest entry is "1 1" (pattern), "1 1 1" or "1 1 1 1" (complex),
+     * each but the last followed by a line break */
+    shortest = parser->pattern ? 4 : (parser->complex ? 8 : 6);
+    if (nnz > ((guint64)(parser->end - parser->pos) + 1) / shortest || nnz > n_rows * n_columns) {
+        g_printerr("Matrix Market: invalid number of entries %" G_GUINT64_FORMAT "\n", nnz);
+        return NULL;
+    }
+
+    capacity = parser->symmetry == MATRIX_MARKET_GENERAL ? nnz : 2 * nnz;
+    rows = g_try_new(guint32, capacity);
+    columns = g_try_new(guint32, capacity);
+    values = g_try_new(double, capacity);
+    if (capacity > 0 && (rows == NULL || columns == NULL || values == NULL)) {
+        g_printerr("Matrix Market: not enough memory for %" G_GUINT64_FORMAT " entries\n", nnz);
+        g_free(rows);
+        g_free(columns);
+        g_free(values);
+        return NULL;
+    }
+
+    for (k = 0; k < nnz; ++k) {
+        _matrix_market_skip(parser, TRUE);
+        if (parser->pos == parser->end) {
+            g_printerr("Matrix Market: only %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " entries\n", k, nnz);
+            break;
+        }
+        if (!_matrix_market_parse_index(parser, &i) || !_matrix_market_parse_index(parser, &j) ||
+                !_matrix_market_parse_value(parser, &value) ||
+                i == 0 || j == 0 || i > n_rows || j > n_columns) {
+            g_printerr("invalid entry at line %" G_GUINT64_FORMAT "\n", parser->line);
+            _matrix_market_skip_line(parser);
+            continue;
+        }
+        _matrix_market_skip_line(parser);
+
+        rows[count] = i - 1;
+        columns[count] = j - 1;
+        values[count++] = value;
+
+        /* only the lower triangle is stored */
+        if (parser->symmetry != MATRIX_MARKET_GENERAL && i != j && j <= n_rows && i <= n_columns) {
+            rows[count] = j - 1;
+            columns[count] = i - 1;
+            values[count++] = parser->symmetry == MATRIX_MARKET_SKEW_SYMMETRIC ? -value : value;
+        }
+    }
+
+    m = _matrix_market_build_csr(n_rows, n_columns, count, rows, columns, values);
+
+    g_free(rows);
+    g_free(columns);
+    g_free(values);
+
+    return m;
+}
+
+/* Dense data, stored column by column, written directly into the matrix. */
+static Matrix *_matrix_market_read_array(MatrixMarketParser *parser, guint64 n_rows, guint64 n_columns)
+{
+    Matrix *m = matrix_new();
+    double *data;
+    guint64 i, j;
+    double value;
+
+    matrix_init_dense(m, n_rows, n_columns, MATRIX_PRECISION_F64, 0.0, 0.0);
+    data = m->data;
+    memset(data, 0, n_rows * n_columns * sizeof(double));
+
+    _matrix_market_skip_line(parser);
+
+    for (j = 0; j < n_columns; ++j) {
+        i = parser->symmetry == MATRIX_MARKET_GENERAL ? 0 :
+            (parser->symmetry == MATRIX_MARKET_SYMMETRIC ? j : j + 1);
+        for ( ; i < n_rows; ++i) {
+            _matrix_market_skip(parser, TRUE);
+            if (!_matrix_market_parse_value(parser, &value)) {
+                g_printerr("invalid entry at line %" G_GUINT64_FORMAT "\n", parser->line);
+                goto done;
+            }
+            data[i * n_columns + j] = value;
+            if (parser->symmetry != MATRIX_MARKET_GENERAL && i != j && i < n_columns && j < n_rows)
+                data[j * n_columns + i] = parser->symmetry == MATRIX_MARKET_SKEW_SYMMETRIC ? -value : value;
+        }
+    }
+
+done:
+    return m;
+}
+
+GList *matrix_market_read_from_file(int fd)
+{
+    GMappedFile *mapping;
+    GError *error = NULL;
+    MatrixMarketParser parser;
+    guint64 n_rows, n_columns;
+    Matrix *m = NULL;
+
+    if ((mapping = g_mapped_file_new_from_fd(fd, FALSE, &error)) == NULL) {
+        g_printerr("Could not map input: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    memset(&parser, 0, sizeof(MatrixMarketParser));
+    parser.pos = g_mapped_file_get_contents(mapping);
+    parser.end = parser.pos + g_mapped_file_get_length(mapping);
+    parser.line = 1;
+
+    if (!matrix_market_check_magic(parser.pos, parser.end - parser.pos) ||
+            !_matrix_market_parse_banner(&parser))
+        goto done;
+
+    _matrix_market_skip(&parser, TRUE);
+    if (!_matrix_market_parse_index(&parser, &n_rows) || !_matrix_market_parse_index(&parser, &n_columns) ||
+            n_rows == 0 || n_columns == 0 || n_rows > G_MAXUINT32 || n_columns > G_MAXUINT32) {
+        g_printerr("Matrix Market: invalid size at line %" G_GUINT64_FORMAT "\n", parser.line);
+        goto done;
+    }
+
+    if (parser.coordinate)
+        m = _matrix_market_read_coordinate(&parser, n_rows, n_columns);
+    else if (matrix_size_is_valid(n_rows, n_columns))
+        m = _matrix_market_read_array(&parser, n_rows, n_columns);
+    else
+        g_printerr("Matrix Market: dense matrix too large\n");
+
+done:
+    g_mapped_file_unref(mapping);
+
+    return m ? g_list_prepend(NULL, m) : NULL;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+
+/* Matrix Market exchange format (.mtx). Coordinate files are read into sparse
+ * (CSR) matrices, array files into dense ones. */
+
+#define MATRIX_MARKET_MAGIC "%%MatrixMarket"
+#define MATRIX_MARKET_MAGIC_LENGTH 14
+
+gboolean matrix_market_check_magic(const gchar *data, gsize length);
+GList *matrix_market_read_from_file(int fd);
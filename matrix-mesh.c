@@ -2,14 +2,51 @@
 #include <string.h>
 #include <math.h>
 #include "util-colors.h"
+#include "util-parallel.h"
 
 double z_epsilon = -1.0f;
+double clip_percentile = 0.0;
+double merge_tolerance = -1.0;
 
 void matrix_mesh_set_z_epsilon(double eps)
 {
     z_epsilon = eps;
 }
 
+/* Scale heights and colors to the entries between the given percentile and 100
+ * minus it, clamping the rest; 0 (the default) keeps the whole range. */
+void matrix_mesh_set_clip_percentile(double percentile)
+{
+    clip_percentile = percentile;
+}
+
+/* Merge neighbouring faces of dense matrices into rectangles if their entries
+ * differ by at most twice the tolerance, so that no entry is drawn off by more
+ * than it; 0 merges equal entries only, a negative tolerance (the default)
+ * keeps one face per entry. */
+void matrix_mesh_set_merge_tolerance(double tolerance)
+{
+    merge_tolerance = tolerance;
+}
+
+/* Range of the entries of view the meshes are scaled to. */
+void matrix_mesh_get_range(MatrixView *view, double *min, double *max)
+{
+    matrix_view_get_percentile_range(view, clip_percentile, min, max);
+}
+
+/* Height of an entry, clamped to the range of the mesh. */
+static inline double _matrix_mesh_height(MatrixMesh *mesh, double value, double scale)
+{
+    return CLAMP(value, mesh->unscaled_range[0], mesh->unscaled_range[1]) * scale;
+}
+
+/* A hue in [0, 1] in steps of the gradient. */
+static inline guint16 _matrix_mesh_hue(double hue)
+{
+    return hue > 0.0 ? (guint16)(MIN(hue, 1.0) * MATRIX_MESH_HUE_STEPS + 0.5) : 0;
+}
+
 MatrixMesh *matrix_mesh_new(void)
 {
     MatrixMesh *mesh = g_malloc0(sizeof(MatrixMesh));
@@ -24,14 +61,21 @@ void matrix_mesh_clear(MatrixMesh *mesh)
         return;
     guint32 i;
     for (i = 0; i < mesh->n_chunks; ++i)
-        g_free(mesh->chunk_faces[i]);
-    g_free(mesh->chunk_faces);
+        g_free(mesh->chunks[i]);
+    g_free(mesh->chunks);
+    g_free(mesh->chunk_lengths);
+    g_free(mesh->tile_chunks);
+    g_free(mesh->tiles_changed);
+    g_free(mesh->tile_hashes);
+    matrix_view_unref(mesh->view);
 
     double alpha_channel = mesh->alpha_channel;
+    gboolean track_changes = mesh->track_changes;
 
     memset(mesh, 0, sizeof(MatrixMesh));
 
     mesh->alpha_channel = alpha_channel;
+    mesh->track_changes = track_changes;
 }
 
 void matrix_mesh_free(MatrixMesh *mesh)
@@ -42,59 +86,86 @@ void matrix_mesh_free(MatrixMesh *mesh)
 
 void matrix_mesh_set_matrix(MatrixMesh *mesh, Matrix *matrix)
 {
-    mesh->matrix = matrix;
+    MatrixView *view = matrix ? matrix_view_new(matrix, NULL, NULL) : NULL;
 
-    matrix_mesh_update(mesh);
+    matrix_mesh_set_view(mesh, view);
+    matrix_view_unref(view);
 }
 
-gboolean matrix_mesh_plane_face(MatrixMeshFace *face, double x, double y, double z, double d1, double d2, double alpha_channel)
+void matrix_mesh_set_view(MatrixMesh *mesh, MatrixView *view)
 {
-    util_colors_gradient_rgb(face->color_hue, face->color_rgba);
-    face->color_rgba[3] = alpha_channel;
+    matrix_view_ref(view);
+    matrix_view_unref(mesh->view);
+    mesh->view = view;
 
-    switch (face->plane) {
-        case MatrixMeshFacePlaneXY:
-            if (fabs(z) <= z_epsilon)
-                return FALSE;
-            face->vertices[0][0] = face->vertices[3][0] = x;
-            face->vertices[1][0] = face->vertices[2][0] = x + d1;
+    matrix_mesh_update(mesh);
+}
 
-            face->vertices[0][1] = face->vertices[1][1] = y;
-            face->vertices[2][1] = face->vertices[3][1] = y + d2;
+/* A corner of a face: where grid lines meet, and its height. */
+typedef struct {
+    guint32 row;
+    guint32 column;
+    float z;
+} MatrixMeshCorner;
 
-            face->vertices[0][2] = face->vertices[1][2] =
-            face->vertices[2][2] = face->vertices[3][2] = z;
-            break;
-        case MatrixMeshFacePlaneXZ:
-            if (fabs(z+d2) <= z_epsilon && fabs(z) <= z_epsilon)
-                return FALSE;
-            face->vertices[0][0] = face->vertices[3][0] = x;
-            face->vertices[1][0] = face->vertices[2][0] = x + d1;
+static inline void _matrix_mesh_corner(MatrixMeshCorner *corner, guint32 row, guint32 column, float z)
+{
+    corner->row = row;
+    corner->column = column;
+    corner->z = z;
+}
 
-            face->vertices[0][1] = face->vertices[1][1] =
-            face->vertices[2][1] = face->vertices[3][1] = y;
+/* The four corners of face k of chunk, going around it. */
+static void _matrix_mesh_get_corners(MatrixMeshChunk *chunk, guint32 k, MatrixMeshCorner *corners)
+{
+    guint32 top = chunk->row[k], bottom = top + chunk->n_rows[k];
+    guint32 left = chunk->column[k], right = left + chunk->n_columns[k];
+    float z0 = chunk->z0[k], z1 = chunk->z1[k];
 
-            face->vertices[0][2] = face->vertices[1][2] = z;
-            face->vertices[2][2] = face->vertices[3][2] = z + d2;
+    switch (chunk->plane[k]) {
+        case MatrixMeshFacePlaneXY:
+            _matrix_mesh_corner(&corners[0], bottom, left, z0);
+            _matrix_mesh_corner(&corners[1], bottom, right, z0);
+            _matrix_mesh_corner(&corners[2], top, right, z0);
+            _matrix_mesh_corner(&corners[3], top, left, z0);
+            break;
+        case MatrixMeshFacePlaneXZ:
+            _matrix_mesh_corner(&corners[0], top, left, z0);
+            _matrix_mesh_corner(&corners[1], top, right, z0);
+            _matrix_mesh_corner(&corners[2], top, right, z1);
+            _matrix_mesh_corner(&corners[3], top, left, z1);
             break;
         case MatrixMeshFacePlaneYZ:
-            if (fabs(z+d2) <= z_epsilon && fabs(z) <= z_epsilon)
-                return FALSE;
-            face->vertices[0][0] = face->vertices[1][0] =
-            face->vertices[2][0] = face->vertices[3][0] = x;
-
-            face->vertices[1][1] = face->vertices[2][1] = y;
-            face->vertices[0][1] = face->vertices[3][1] = y + d1;
-
-            face->vertices[0][2] = face->vertices[1][2] = z;
-            face->vertices[2][2] = face->vertices[3][2] = z + d2;
+            _matrix_mesh_corner(&corners[0], top, left, z0);
+            _matrix_mesh_corner(&corners[1], bottom, left, z0);
+            _matrix_mesh_corner(&corners[2], bottom, left, z1);
+            _matrix_mesh_corner(&corners[3], top, left, z1);
             break;
         default:
-            return FALSE;
-            fprintf(stderr, "plane orientation not handled\n");
+            memset(corners, 0, 4 * sizeof(MatrixMeshCorner));
     }
+}
 
-    return TRUE;
+/* The face at iter in world coordinates, with its color. */
+void matrix_mesh_get_face(MatrixMesh *mesh, MatrixMeshIter *iter, MatrixMeshFace *face)
+{
+    MatrixMeshChunk *chunk = mesh->chunks[iter->chunk];
+    MatrixMeshCorner corners[4];
+    double dx = 1.0f/mesh->n_columns;
+    double dy = 1.0f/mesh->n_rows;
+    guint32 j;
+
+    face->plane = chunk->plane[iter->offset];
+    face->color_hue = (double)chunk->hue[iter->offset] / MATRIX_MESH_HUE_STEPS;
+    util_colors_gradient_rgb(face->color_hue, face->color_rgba);
+    face->color_rgba[3] = mesh->alpha_channel;
+
+    _matrix_mesh_get_corners(chunk, iter->offset, corners);
+    for (j = 0; j < 4; ++j) {
+        face->vertices[j][0] = corners[j].column * dx - 0.5f;
+        face->vertices[j][1] = 0.5f - corners[j].row * dy;
+        face->vertices[j][2] = corners[j].z;
+    }
 }
 
 void matrix_mesh_set_alpha_channel(MatrixMesh *mesh, double alpha_channel)
@@ -102,183 +173,786 @@ void matrix_mesh_set_alpha_channel(MatrixMesh *mesh, double alpha_channel)
     if (!mesh)
         return;
     mesh->alpha_channel = alpha_channel;
-
-    MatrixMeshIter fiter;
-
-    for (matrix_mesh_iter_init(mesh, &fiter);
-         matrix_mesh_iter_is_valid(mesh, &fiter);
-         matrix_mesh_iter_next(mesh, &fiter)) {
-        mesh->chunk_faces[fiter.chunk][fiter.offset].color_rgba[3] = alpha_channel;
-    }
 }
 
-void matrix_mesh_update(MatrixMesh *mesh)
+/* Keep hashes of the tiles of dense matrices from the next update on, which
+ * matrix_mesh_change_view() needs to find the tiles that change; only worth it
+ * for a mesh that follows a sequence of frames. */
+void matrix_mesh_set_track_changes(MatrixMesh *mesh, gboolean track_changes)
 {
     if (!mesh)
         return;
-    Matrix *m = mesh->matrix;
-    matrix_mesh_clear(mesh);
-    mesh->matrix = m;
+    mesh->track_changes = track_changes;
+}
 
-    MatrixIter miter;
-    MatrixMeshIter fiter;
+/* A chunk with room for capacity faces, in one allocation. */
+static MatrixMeshChunk *_matrix_mesh_chunk_new(guint32 capacity)
+{
+    MatrixMeshChunk *chunk = g_malloc(sizeof(MatrixMeshChunk) + (gsize)capacity *
+                                      (6 * sizeof(guint32) + sizeof(guint16) + sizeof(guint8)));
+
+    chunk->capacity = capacity;
+    chunk->row = (guint32 *)(chunk + 1);
+    chunk->column = chunk->row + capacity;
+    chunk->n_rows = chunk->column + capacity;
+    chunk->n_columns = chunk->n_rows + capacity;
+    chunk->z0 = (float *)(chunk->n_columns + capacity);
+    chunk->z1 = chunk->z0 + capacity;
+    chunk->hue = (guint16 *)(chunk->z1 + capacity);
+    chunk->plane = (guint8 *)(chunk->hue + capacity);
+
+    return chunk;
+}
 
-    MatrixMeshFace *face;
+/* Cut the last chunk of mesh to its faces, e.g. the last one of a tile. */
+static void _matrix_mesh_fit_last_chunk(MatrixMesh *mesh)
+{
+    MatrixMeshChunk *chunk, *fit;
+    guint32 n;
 
-    if (!m)
+    if (mesh->n_chunks == 0 || (n = mesh->chunk_lengths[mesh->n_chunks - 1]) == 0 ||
+            n == mesh->chunks[mesh->n_chunks - 1]->capacity)
         return;
 
-    double range[2];
+    chunk = mesh->chunks[mesh->n_chunks - 1];
+    fit = _matrix_mesh_chunk_new(n);
+    memcpy(fit->row, chunk->row, n * sizeof(guint32));
+    memcpy(fit->column, chunk->column, n * sizeof(guint32));
+    memcpy(fit->n_rows, chunk->n_rows, n * sizeof(guint32));
+    memcpy(fit->n_columns, chunk->n_columns, n * sizeof(guint32));
+    memcpy(fit->z0, chunk->z0, n * sizeof(float));
+    memcpy(fit->z1, chunk->z1, n * sizeof(float));
+    memcpy(fit->hue, chunk->hue, n * sizeof(guint16));
+    memcpy(fit->plane, chunk->plane, n * sizeof(guint8));
+    g_free(chunk);
+
+    mesh->chunks[mesh->n_chunks - 1] = fit;
+    mesh->last.chunk = mesh->n_chunks;
+    mesh->last.offset = 0;
+}
+
+/* Faces close to the zero level (see matrix_mesh_set_z_epsilon()) are left out. */
+static void _matrix_mesh_add_face(MatrixMesh *mesh, MatrixMeshFacePlane plane, double hue,
+                                  guint32 row, guint32 column, guint32 n_rows, guint32 n_columns,
+                                  double z0, double z1)
+{
+    if (fabs(z0) <= z_epsilon && fabs(z1) <= z_epsilon)
+        return;
+
+    matrix_mesh_append_face(mesh, plane, row, column, n_rows, n_columns, z0, z1, hue);
+}
+
+/* Side wall between two neighbouring bars of heights zl and zc (zl is ignored for the
+ * first bar). Only render visible areas, switch colors if signs of neighbours differ
+ * otherwise take color of larger absolute value. */
+static void _matrix_mesh_add_wall(MatrixMesh *mesh, MatrixMeshFacePlane plane, double zmin,
+                                  guint32 row, guint32 column, guint32 length, double zl, double zc, gboolean first)
+{
+    guint32 n_rows = plane == MatrixMeshFacePlaneYZ ? length : 0;
+    guint32 n_columns = plane == MatrixMeshFacePlaneXZ ? length : 0;
+
+    if (first || zc * zl < 0) {
+        _matrix_mesh_add_face(mesh, plane, zc - zmin, row, column, n_rows, n_columns, 0, zc);
+        if (!first)
+            _matrix_mesh_add_face(mesh, plane, zl - zmin, row, column, n_rows, n_columns, 0, zl);
+    }
+    else {
+        _matrix_mesh_add_face(mesh, plane, (fabs(zc) > fabs(zl) ? zc : zl) - zmin, row, column,
+                              n_rows, n_columns, zl, zc);
+    }
+}
+
+/* Faces are made in bands of rows (or columns) on several threads, each into
+ * the chunks of its own part of the mesh. */
+typedef struct {
+    MatrixMesh *mesh;
+    MatrixMesh *parts;
     double scale;
+    /* sparse matrices: the transposed matrix */
+    guint64 *column_offsets;
+    guint32 *row_indices;
+    double *values;
+    /* dense matrices: the hashes to fill in (see MatrixMesh), and the tiles
+     * made again (all if NULL), each into the part of the same index */
+    guint64 *hashes;
+    guint8 *changed;
+} MatrixMeshBands;
+
+/* Parts for n bands or tiles of mesh. */
+static MatrixMesh *_matrix_mesh_new_parts(MatrixMesh *mesh, guint64 n)
+{
+    MatrixMesh *parts = g_malloc0(n * sizeof(MatrixMesh));
+    guint64 k;
+
+    for (k = 0; k < n; ++k) {
+        parts[k].view = mesh->view;
+        parts[k].zrange[0] = mesh->zrange[0];
+        parts[k].zrange[1] = mesh->zrange[1];
+        parts[k].unscaled_range[0] = mesh->unscaled_range[0];
+        parts[k].unscaled_range[1] = mesh->unscaled_range[1];
+        parts[k].alpha_channel = mesh->alpha_channel;
+        parts[k].scale = mesh->scale;
+        parts[k].n_rows = mesh->n_rows;
+        parts[k].n_columns = mesh->n_columns;
+    }
+
+    return parts;
+}
 
-    matrix_iter_init(m, &miter);
-    if (matrix_iter_is_valid(m, &miter)) {
-        range[0] = range[1] = m->chunks[miter.chunk][miter.offset];
+/* Continue after the last face in the last chunk, or in a new one if it is full. */
+static void _matrix_mesh_set_last(MatrixMesh *mesh)
+{
+    if (mesh->n_chunks > 0 && mesh->chunk_lengths[mesh->n_chunks - 1] < mesh->chunks[mesh->n_chunks - 1]->capacity) {
+        mesh->last.chunk = mesh->n_chunks - 1;
+        mesh->last.offset = mesh->chunk_lengths[mesh->n_chunks - 1];
     }
-    matrix_iter_next(m, &miter);
-    for ( ; matrix_iter_is_valid(m, &miter); matrix_iter_next(m, &miter)) {
-        if (range[0] > m->chunks[miter.chunk][miter.offset])
-            range[0] = m->chunks[miter.chunk][miter.offset];
-        if (range[1] < m->chunks[miter.chunk][miter.offset])
-            range[1] = m->chunks[miter.chunk][miter.offset];
+    else {
+        mesh->last.chunk = mesh->n_chunks;
+        mesh->last.offset = 0;
     }
-    scale = range[0] != range[1] ? 1.0f/(range[1]-range[0]) : 1.0f;
+}
 
-    mesh->unscaled_range[0] = range[0];
-    mesh->unscaled_range[1] = range[1];
+/* Move the chunks of part to the end of mesh. The last chunk of each part is
+ * usually not full, the iterators skip to the next chunk after its faces. */
+static void _matrix_mesh_splice(MatrixMesh *mesh, MatrixMesh *part)
+{
+    guint32 k, n_chunks = mesh->last.chunk + (mesh->last.offset > 0 ? 1 : 0);
 
-    range[0] *= scale;
-    range[1] *= scale;
+    /* a chunk emptied by matrix_mesh_remove_last_face() */
+    for (k = n_chunks; k < mesh->n_chunks; ++k)
+        g_free(mesh->chunks[k]);
 
-    mesh->zrange[0] = range[0];
-    mesh->zrange[1] = range[1];
+    mesh->chunks = g_realloc(mesh->chunks, (n_chunks + part->n_chunks) * sizeof(MatrixMeshChunk *));
+    mesh->chunk_lengths = g_realloc(mesh->chunk_lengths, (n_chunks + part->n_chunks) * sizeof(guint32));
 
-    double dx = 1.0f/m->n_columns;
-    double dy = 1.0f/m->n_rows;
-    double x,y,z;
+    for (k = 0; k < part->n_chunks; ++k) {
+        if (part->chunk_lengths[k] == 0) {
+            g_free(part->chunks[k]);
+            continue;
+        }
+        mesh->chunks[n_chunks] = part->chunks[k];
+        mesh->chunk_lengths[n_chunks++] = part->chunk_lengths[k];
+    }
 
-    /* FIXME: clean up this messy code (especially the face generation) */
+    mesh->n_chunks = n_chunks;
+    mesh->nfaces += part->nfaces;
+    _matrix_mesh_set_last(mesh);
 
-    /* top faces */
-    for (matrix_iter_init(m, &miter);
-         matrix_iter_is_valid(m, &miter);
-         matrix_iter_next(m, &miter)) {
-        z = m->chunks[miter.chunk][miter.offset] * scale;
-        x = miter.column * dx - 0.5f;
-        y = 0.5f - miter.row * dy - dy;
+    g_free(part->chunks);
+    g_free(part->chunk_lengths);
+}
 
-        face = matrix_mesh_append_face(mesh, &fiter);
+/* Call func for bands of [0, n), each adding faces to bands->parts[band], and
+ * append the parts in order: the faces are the same, in the same order, for
+ * any number of threads. */
+static void _matrix_mesh_update_bands(MatrixMeshBands *bands, guint64 n, guint64 work_per_item,
+                                      UtilParallelFunc func)
+{
+    MatrixMesh *mesh = bands->mesh;
+    guint n_bands = util_parallel_get_bands(n, work_per_item);
+    guint k;
 
-        face->plane = MatrixMeshFacePlaneXY;
-        face->color_hue = z - range[0];
+    bands->parts = _matrix_mesh_new_parts(mesh, n_bands);
 
-        if (!matrix_mesh_plane_face(face, x, y, z, dx, dy, mesh->alpha_channel))
-            matrix_mesh_remove_last_face(mesh);
+    util_parallel_for(n, n_bands, func, bands);
+
+    for (k = 0; k < n_bands; ++k)
+        _matrix_mesh_splice(mesh, bands->parts + k);
+
+    g_free(bands->parts);
+    bands->parts = NULL;
+}
+
+/* Sparse matrices: bars only for stored entries, walls only next to them. */
+static void _matrix_mesh_csr_top_band(guint64 begin, guint64 end, guint band, MatrixMeshBands *bands)
+{
+    MatrixMesh *mesh = bands->parts + band;
+    Matrix *m = matrix_view_get_matrix(mesh->view);
+    double zmin = mesh->zrange[0];
+    double z;
+    guint32 i;
+    guint64 k;
+
+    for (i = begin; i < end; ++i) {
+        for (k = m->row_offsets[i]; k < m->row_offsets[i + 1]; ++k) {
+            z = _matrix_mesh_height(mesh, m->values[k], bands->scale);
+            _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXY, z - zmin, i, m->column_indices[k], 1, 1, z, z);
+        }
     }
+}
 
-    /* only render visible areas, switch colors if signs of neighbours differ otherwise
-     * take color of larger absolute value */
+/* faces in yz-plane: left of each entry and right of it if the next one is a zero */
+static void _matrix_mesh_csr_row_band(guint64 begin, guint64 end, guint band, MatrixMeshBands *bands)
+{
+    MatrixMesh *mesh = bands->parts + band;
+    Matrix *m = matrix_view_get_matrix(mesh->view);
+    double zmin = mesh->zrange[0];
+    double z, zl;
+    guint32 i, j, next;
+    guint64 k, last;
+
+    for (i = begin; i < end; ++i) {
+        last = m->row_offsets[i + 1];
+        for (k = m->row_offsets[i]; k < last; ++k) {
+            j = m->column_indices[k];
+            z = _matrix_mesh_height(mesh, m->values[k], bands->scale);
+            zl = k > m->row_offsets[i] && m->column_indices[k - 1] + 1 == j ?
+                _matrix_mesh_height(mesh, m->values[k - 1], bands->scale) : 0.0;
+            _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneYZ, zmin, i, j, 1, zl, z, j == 0);
+
+            next = j + 1;
+            if (next == m->n_columns)
+                _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneYZ, z - zmin, i, next, 1, 0, 0, z);
+            else if (k + 1 == last || m->column_indices[k + 1] != next)
+                _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneYZ, zmin, i, next, 1, z, 0.0, FALSE);
+        }
+    }
+}
 
-    /* faces in yz-plane */
+/* faces in xz-plane: same walk over the columns of the transposed matrix */
+static void _matrix_mesh_csr_column_band(guint64 begin, guint64 end, guint band, MatrixMeshBands *bands)
+{
+    MatrixMesh *mesh = bands->parts + band;
+    Matrix *m = matrix_view_get_matrix(mesh->view);
+    double zmin = mesh->zrange[0];
+    double z, zl;
+    guint32 i, j, next;
+    guint64 k, last;
+
+    for (j = begin; j < end; ++j) {
+        last = bands->column_offsets[j + 1];
+        for (k = bands->column_offsets[j]; k < last; ++k) {
+            i = bands->row_indices[k];
+            z = _matrix_mesh_height(mesh, bands->values[k], bands->scale);
+            zl = k > bands->column_offsets[j] && bands->row_indices[k - 1] + 1 == i ?
+                _matrix_mesh_height(mesh, bands->values[k - 1], bands->scale) : 0.0;
+            _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneXZ, zmin, i, j, 1, zl, z, i == 0);
+
+            next = i + 1;
+            if (next == m->n_rows)
+                _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXZ, z - zmin, next, j, 0, 1, 0, z);
+            else if (k + 1 == last || bands->row_indices[k + 1] != next)
+                _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneXZ, zmin, next, j, 1, z, 0.0, FALSE);
+        }
+    }
+}
+
+static void _matrix_mesh_update_csr(MatrixMesh *mesh, double scale)
+{
+    Matrix *m = matrix_view_get_matrix(mesh->view);
+    MatrixMeshBands bands = { mesh, NULL, scale, NULL, NULL, NULL, NULL, NULL };
+    guint64 per_row = m->n_rows > 0 ? m->nnz / m->n_rows + 1 : 1;
+    guint64 per_column = m->n_columns > 0 ? m->nnz / m->n_columns + 1 : 1;
     guint32 i, j;
-    double zl, zc;
+    guint64 k;
+
+    _matrix_mesh_update_bands(&bands, m->n_rows, per_row, (UtilParallelFunc)_matrix_mesh_csr_top_band);
+    _matrix_mesh_update_bands(&bands, m->n_rows, per_row, (UtilParallelFunc)_matrix_mesh_csr_row_band);
 
+    bands.column_offsets = g_malloc0(((gsize)m->n_columns + 1) * sizeof(guint64));
+    bands.row_indices = g_malloc(m->nnz * sizeof(guint32));
+    bands.values = g_malloc(m->nnz * sizeof(double));
+
+    for (k = 0; k < m->nnz; ++k)
+        ++bands.column_offsets[m->column_indices[k] + 1];
+    for (j = 0; j < m->n_columns; ++j)
+        bands.column_offsets[j + 1] += bands.column_offsets[j];
     for (i = 0; i < m->n_rows; ++i) {
-        y = 0.5f - i * dy - dy;
-        for (j = 0; j < m->n_columns; ++j) {
-            if (!matrix_get_iter(m, &miter, i, j))
-                break;
-            x = j * dx - 0.5f;
-
-            zc = m->chunks[miter.chunk][miter.offset] * scale;
-            /* first or sign change */
-            if (j == 0 || zc * zl < 0) {
-                face = matrix_mesh_append_face(mesh, &fiter);
-                face->plane = MatrixMeshFacePlaneYZ;
-                face->color_hue = zc - range[0];
-
-                if (!matrix_mesh_plane_face(face, x, y, 0, dy, zc, mesh->alpha_channel))
-                    matrix_mesh_remove_last_face(mesh);
-
-                if (j > 0) {
-                    face = matrix_mesh_append_face(mesh, &fiter);
-                    face->plane = MatrixMeshFacePlaneYZ;
-                    face->color_hue = zl - range[0];
-
-                    if (!matrix_mesh_plane_face(face, x, y, 0, dy, zl, mesh->alpha_channel))
-                        matrix_mesh_remove_last_face(mesh);
-                }
-            }
-            else {
-                face = matrix_mesh_append_face(mesh, &fiter);
-                face->plane = MatrixMeshFacePlaneYZ;
-                if (fabs(zc) > fabs(zl))
-                    face->color_hue = zc - range[0];
-                else
-                    face->color_hue = zl - range[0];
-
-                if (!matrix_mesh_plane_face(face, x, y, zl, dy, zc - zl, mesh->alpha_channel))
-                    matrix_mesh_remove_last_face(mesh);
-            }
+        for (k = m->row_offsets[i]; k < m->row_offsets[i + 1]; ++k) {
+            bands.row_indices[bands.column_offsets[m->column_indices[k]]] = i;
+            bands.values[bands.column_offsets[m->column_indices[k]]++] = m->values[k];
+        }
+    }
+    for (j = m->n_columns; j > 0; --j)
+        bands.column_offsets[j] = bands.column_offsets[j - 1];
+    bands.column_offsets[0] = 0;
+
+    _matrix_mesh_update_bands(&bands, m->n_columns, per_column, (UtilParallelFunc)_matrix_mesh_csr_column_band);
+
+    g_free(bands.column_offsets);
+    g_free(bands.row_indices);
+    g_free(bands.values);
+}
 
-            zl = zc;
+/* Faces of the entries in rows [i0, i0 + n_rows) and columns [j0, j0 + n_columns),
+ * from their heights in band (row r of the band at band + (r + 1) * stride, the
+ * row above the band at band, each starting at column first): top faces, then
+ * the walls to the left and on top of each bar, and the closing walls on the
+ * right and the bottom of the matrix. */
+static void _matrix_mesh_add_tile(MatrixMesh *mesh, const double *band, guint32 stride, guint32 first,
+                                  guint32 i0, guint32 n_rows, guint32 j0, guint32 n_columns)
+{
+    double zmin = mesh->zrange[0];
+    const double *above, *row;
+    guint32 i, j, k, r;
+
+    for (r = 0; r < n_rows; ++r) {
+        i = i0 + r;
+        above = band + (guint64)r * stride;
+        row = above + stride;
+
+        for (j = j0, k = j0 - first; j < j0 + n_columns; ++j, ++k)
+            _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXY, row[k] - zmin, i, j, 1, 1, row[k], row[k]);
+
+        for (j = j0, k = j0 - first; j < j0 + n_columns; ++j, ++k)
+            _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneYZ, zmin, i, j, 1,
+                                  j > 0 ? row[k - 1] : 0.0, row[k], j == 0);
+        if (j == mesh->n_columns)
+            _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneYZ, row[k - 1] - zmin, i, j, 1, 0, 0, row[k - 1]);
+
+        for (j = j0, k = j0 - first; j < j0 + n_columns; ++j, ++k) {
+            _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneXZ, zmin, i, j, 1,
+                                  i > 0 ? above[k] : 0.0, row[k], i == 0);
+            if (i + 1 == mesh->n_rows)
+                _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXZ, row[k] - zmin, i + 1, j, 0, 1, 0, row[k]);
         }
+    }
+}
 
-        face = matrix_mesh_append_face(mesh, &fiter);
-        face->plane = MatrixMeshFacePlaneYZ;
-        face->color_hue = zl - range[0];
+/* Hash of n entries, continued from hash; equal entries with different bits
+ * (like -0.0 and 0.0) count as changed. */
+static inline guint64 _matrix_mesh_hash(guint64 hash, const double *values, guint32 n)
+{
+    guint64 bits;
+    guint32 j;
+
+    for (j = 0; j < n; ++j) {
+        memcpy(&bits, values + j, sizeof(guint64));
+        hash = (hash + bits) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
 
-        if (!matrix_mesh_plane_face(face, 0.5f, y, 0, dy, zl, mesh->alpha_channel))
-            matrix_mesh_remove_last_face(mesh);
+/* Add row r of the n_rows rows of tiles starting at row i0 to the hashes of
+ * these tiles. */
+static void _matrix_mesh_hash_row(MatrixMesh *mesh, guint64 *hashes, guint32 i0, guint32 r, guint32 n_rows,
+                                  const double *row)
+{
+    guint32 tile = i0 / MATRIX_MESH_TILE_SIZE * mesh->n_tile_columns;
+    guint32 j0, n;
+
+    for (j0 = 0; j0 < mesh->n_columns; j0 += MATRIX_MESH_TILE_SIZE, ++tile) {
+        n = MIN(mesh->n_columns - j0, MATRIX_MESH_TILE_SIZE);
+        hashes[3 * tile] = _matrix_mesh_hash(hashes[3 * tile], row + j0, n);
+        hashes[3 * tile + 1] = _matrix_mesh_hash(hashes[3 * tile + 1], row + j0 + n - 1, 1);
+        if (r + 1 == n_rows)
+            hashes[3 * tile + 2] = _matrix_mesh_hash(0, row + j0, n);
     }
+}
 
-    for (j = 0; j < m->n_columns; ++j) {
-        x = j * dx - 0.5f;
-        for (i = 0; i < m->n_rows; ++i) {
-            if (!matrix_get_iter(m, &miter, i, j))
-                break;
-            y = 0.5f - i * dy;
+/* Dense matrices, in tiles of MATRIX_MESH_TILE_SIZE x MATRIX_MESH_TILE_SIZE
+ * entries: the rows of a band of tiles are read once and turned into heights, and
+ * all faces of a tile are made while its heights are in the cache. Walking down
+ * the columns for the walls in between the rows would touch a new cache line
+ * (and page) for every entry. Each thread takes consecutive bands of tiles
+ * (from begin to end), reading the row above its first one again, and makes
+ * each tile into a part of its own. Rows of tiles without any tile to make are
+ * skipped, and the hashes filled in if asked for. */
+static void _matrix_mesh_dense_band(guint64 begin, guint64 end, guint band, MatrixMeshBands *bands)
+{
+    MatrixMesh *mesh = bands->mesh;
+    MatrixView *m = mesh->view;
+    guint32 n_columns = m->n_columns;
+    double *heights = g_malloc((MATRIX_MESH_TILE_SIZE + 1) * (gsize)n_columns * sizeof(double));
+    double *scratch = g_malloc(n_columns * sizeof(double));
+    double *out = g_malloc(n_columns * sizeof(double));
+    double *line;
+    const double *row;
+    guint32 i0, j0, r, j, n_rows, tile;
+    gboolean have_above = FALSE;
+
+    for (i0 = begin * MATRIX_MESH_TILE_SIZE; i0 < MIN(end * MATRIX_MESH_TILE_SIZE, m->n_rows); i0 += n_rows) {
+        n_rows = MIN(m->n_rows - i0, MATRIX_MESH_TILE_SIZE);
+        tile = i0 / MATRIX_MESH_TILE_SIZE * mesh->n_tile_columns;
+
+        if (bands->changed && !memchr(bands->changed + tile, 1, mesh->n_tile_columns)) {
+            have_above = FALSE;
+            continue;
+        }
 
-            zc = m->chunks[miter.chunk][miter.offset] * scale;
-            if (i == 0 || zc * zl < 0) {
-                face = matrix_mesh_append_face(mesh, &fiter);
-                face->plane = MatrixMeshFacePlaneXZ;
-                face->color_hue = zc - range[0];
+        /* the last row of the previous band is above this one */
+        if (have_above) {
+            memcpy(heights, heights + (gsize)MATRIX_MESH_TILE_SIZE * n_columns, n_columns * sizeof(double));
+        }
+        else if (i0 > 0) {
+            row = matrix_view_row(m, i0 - 1, out, scratch);
+            for (j = 0; j < n_columns; ++j)
+                heights[j] = _matrix_mesh_height(mesh, row[j], bands->scale);
+        }
+        have_above = TRUE;
+
+        for (r = 0; r < n_rows; ++r) {
+            row = matrix_view_row(m, i0 + r, out, scratch);
+            if (bands->hashes)
+                _matrix_mesh_hash_row(mesh, bands->hashes, i0, r, n_rows, row);
+            line = heights + (guint64)(r + 1) * n_columns;
+            for (j = 0; j < n_columns; ++j)
+                line[j] = _matrix_mesh_height(mesh, row[j], bands->scale);
+        }
 
-                if (!matrix_mesh_plane_face(face, x, y, 0, dx, zc, mesh->alpha_channel))
-                    matrix_mesh_remove_last_face(mesh);
+        for (j0 = 0; j0 < n_columns; j0 += MATRIX_MESH_TILE_SIZE, ++tile) {
+            if (bands->changed && !bands->changed[tile])
+                continue;
+            _matrix_mesh_add_tile(bands->parts + tile, heights, n_columns, 0, i0, n_rows, j0,
+                                  MIN(n_columns - j0, MATRIX_MESH_TILE_SIZE));
+            _matrix_mesh_fit_last_chunk(bands->parts + tile);
+        }
+    }
 
-                if (i > 0) {
-                    face = matrix_mesh_append_face(mesh, &fiter);
-                    face->plane = MatrixMeshFacePlaneXZ;
-                    face->color_hue = zl - range[0];
+    g_free(heights);
+    g_free(scratch);
+    g_free(out);
+}
 
-                    if (!matrix_mesh_plane_face(face, x, y, 0, dx, zl, mesh->alpha_channel))
-                        matrix_mesh_remove_last_face(mesh);
+static void _matrix_mesh_update_dense(MatrixMesh *mesh, double scale)
+{
+    MatrixMeshBands bands = { mesh, NULL, scale, NULL, NULL, NULL, NULL, NULL };
+    guint32 n_tiles, tile;
+
+    mesh->n_tile_rows = (mesh->n_rows + MATRIX_MESH_TILE_SIZE - 1) / MATRIX_MESH_TILE_SIZE;
+    mesh->n_tile_columns = (mesh->n_columns + MATRIX_MESH_TILE_SIZE - 1) / MATRIX_MESH_TILE_SIZE;
+    n_tiles = mesh->n_tile_rows * mesh->n_tile_columns;
+    if (mesh->track_changes)
+        mesh->tile_hashes = g_malloc0(3 * (gsize)n_tiles * sizeof(guint64));
+    bands.hashes = mesh->tile_hashes;
+
+    bands.parts = _matrix_mesh_new_parts(mesh, n_tiles);
+    util_parallel_for(mesh->n_tile_rows,
+                      util_parallel_get_bands(mesh->n_tile_rows, (guint64)MATRIX_MESH_TILE_SIZE * mesh->n_columns),
+                      (UtilParallelFunc)_matrix_mesh_dense_band, &bands);
+
+    mesh->tile_chunks = g_malloc(((gsize)n_tiles + 1) * sizeof(guint32));
+    for (tile = 0; tile < n_tiles; ++tile) {
+        mesh->tile_chunks[tile] = mesh->n_chunks;
+        _matrix_mesh_splice(mesh, bands.parts + tile);
+    }
+    mesh->tile_chunks[n_tiles] = mesh->n_chunks;
+
+    g_free(bands.parts);
+}
+
+/* Does z fit into the heights [lo, hi] of a merged face? */
+static inline gboolean _matrix_mesh_merge_fits(double z, double lo, double hi, double tolerance)
+{
+    return MAX(hi, z) - MIN(lo, z) <= 2.0 * tolerance;
+}
+
+/* Dense matrices with merging: top faces grow greedily from each entry that is
+ * not covered yet, first along the row, then by whole rows, as long as all
+ * heights fit; the face is drawn in the middle of their range, which all
+ * entries under it take as their height. Walls between these heights are
+ * joined along each grid line while neighbouring pieces are equal, and vanish
+ * inside of merged faces. */
+static void _matrix_mesh_update_merged(MatrixMesh *mesh, double scale, double tolerance)
+{
+    MatrixView *m = mesh->view;
+    guint32 n_rows = m->n_rows, n_columns = m->n_columns;
+    double zmin = mesh->zrange[0];
+    double *heights = g_malloc((gsize)n_rows * n_columns * sizeof(double));
+    guint8 *covered = g_malloc0((gsize)n_rows * n_columns);
+    double *scratch = g_malloc(n_columns * sizeof(double));
+    double *out = g_malloc(n_columns * sizeof(double));
+    /* the open run of walls on each vertical grid line */
+    guint32 *run_start = g_malloc(((gsize)n_columns + 1) * sizeof(guint32));
+    double *run_zl = g_malloc(((gsize)n_columns + 1) * sizeof(double));
+    double *run_zc = g_malloc(((gsize)n_columns + 1) * sizeof(double));
+    const double *row, *above;
+    double *h, lo, hi, row_lo, row_hi, zl, zc, z;
+    guint32 i, j, k, w, n, start;
+    gboolean fits;
+
+    for (i = 0; i < n_rows; ++i) {
+        row = matrix_view_row(m, i, out, scratch);
+        h = heights + (gsize)i * n_columns;
+        for (j = 0; j < n_columns; ++j)
+            h[j] = _matrix_mesh_height(mesh, row[j], scale);
+    }
+
+    /* top faces */
+    for (i = 0; i < n_rows; ++i) {
+        for (j = 0; j < n_columns; ++j) {
+            if (covered[(gsize)i * n_columns + j])
+                continue;
+            h = heights + (gsize)i * n_columns;
+            lo = hi = h[j];
+            for (w = 1; j + w < n_columns && !covered[(gsize)i * n_columns + j + w] &&
+                    _matrix_mesh_merge_fits(h[j + w], lo, hi, tolerance); ++w) {
+                lo = MIN(lo, h[j + w]);
+                hi = MAX(hi, h[j + w]);
+            }
+            for (n = 1; i + n < n_rows; ++n) {
+                h = heights + (gsize)(i + n) * n_columns;
+                row_lo = lo;
+                row_hi = hi;
+                for (k = j, fits = TRUE; k < j + w && fits; ++k) {
+                    fits = !covered[(gsize)(i + n) * n_columns + k] &&
+                        _matrix_mesh_merge_fits(h[k], row_lo, row_hi, tolerance);
+                    row_lo = MIN(row_lo, h[k]);
+                    row_hi = MAX(row_hi, h[k]);
                 }
+                if (!fits)
+                    break;
+                lo = row_lo;
+                hi = row_hi;
             }
-            else {
-                face = matrix_mesh_append_face(mesh, &fiter);
-                face->plane = MatrixMeshFacePlaneXZ;
-                if (fabs(zc) > fabs(zl))
-                    face->color_hue = zc - range[0];
-                else
-                    face->color_hue = zl - range[0];
-
-                if (!matrix_mesh_plane_face(face, x, y, zl, dx, zc - zl, mesh->alpha_channel))
-                    matrix_mesh_remove_last_face(mesh);
+
+            z = lo == hi ? lo : (lo + hi) / 2.0;
+            for (k = i; k < i + n; ++k) {
+                memset(covered + (gsize)k * n_columns + j, 1, w);
+                h = heights + (gsize)k * n_columns;
+                for (start = j; start < j + w; ++start)
+                    h[start] = z;
             }
+            _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXY, z - zmin, i, j, n, w, z, z);
+        }
+    }
 
-            zl = zc;
+    /* faces in yz-plane: one open run per grid line, ended by a different piece */
+    for (i = 0; i <= n_rows; ++i) {
+        h = heights + (gsize)i * n_columns;
+        for (j = 0; j <= n_columns; ++j) {
+            if (i < n_rows) {
+                zl = j > 0 ? h[j - 1] : 0.0;
+                zc = j < n_columns ? h[j] : 0.0;
+                if (i > 0 && zl == run_zl[j] && zc == run_zc[j])
+                    continue;
+            }
+            if (i > 0) {
+                n = i - run_start[j];
+                if (j == 0)
+                    _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneYZ, zmin, run_start[j], j, n,
+                                          0.0, run_zc[j], TRUE);
+                else if (j == n_columns)
+                    _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneYZ, run_zl[j] - zmin, run_start[j], j,
+                                          n, 0, 0, run_zl[j]);
+                else if (run_zl[j] != run_zc[j])
+                    _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneYZ, zmin, run_start[j], j, n,
+                                          run_zl[j], run_zc[j], FALSE);
+            }
+            if (i < n_rows) {
+                run_start[j] = i;
+                run_zl[j] = zl;
+                run_zc[j] = zc;
+            }
+        }
+    }
+
+    /* faces in xz-plane: runs along each horizontal grid line */
+    for (i = 0; i <= n_rows; ++i) {
+        h = heights + (gsize)MIN(i, n_rows - 1) * n_columns;
+        above = i > 0 ? heights + (gsize)(i - 1) * n_columns : NULL;
+        for (start = 0; start < n_columns; start = j) {
+            zl = above ? above[start] : 0.0;
+            zc = i < n_rows ? h[start] : 0.0;
+            for (j = start + 1; j < n_columns && (above ? above[j] : 0.0) == zl &&
+                    (i < n_rows ? h[j] : 0.0) == zc; ++j);
+            n = j - start;
+            if (i == n_rows)
+                _matrix_mesh_add_face(mesh, MatrixMeshFacePlaneXZ, zl - zmin, i, start, 0, n, 0, zl);
+            else if (i == 0 || zl != zc)
+                _matrix_mesh_add_wall(mesh, MatrixMeshFacePlaneXZ, zmin, i, start, n, zl, zc, i == 0);
         }
+    }
+
+    g_free(heights);
+    g_free(covered);
+    g_free(scratch);
+    g_free(out);
+    g_free(run_start);
+    g_free(run_zl);
+    g_free(run_zc);
+}
+
+void matrix_mesh_update(MatrixMesh *mesh)
+{
+    if (!mesh)
+        return;
+    MatrixView *m = mesh->view;
+    mesh->view = NULL;
+    matrix_mesh_clear(mesh);
+    mesh->view = m;
 
-        face = matrix_mesh_append_face(mesh, &fiter);
-        face->plane = MatrixMeshFacePlaneXZ;
-        face->color_hue = zl - range[0];
+    if (!m)
+        return;
 
-        if (!matrix_mesh_plane_face(face, x, -0.5f, 0, dx, zl, mesh->alpha_channel))
-            matrix_mesh_remove_last_face(mesh);
+    double range[2];
+    double scale;
+
+    matrix_mesh_get_range(m, &range[0], &range[1]);
+    scale = range[0] != range[1] ? 1.0f/(range[1]-range[0]) : 1.0f;
+
+    mesh->unscaled_range[0] = range[0];
+    mesh->unscaled_range[1] = range[1];
+
+    range[0] *= scale;
+    range[1] *= scale;
+
+    mesh->zrange[0] = range[0];
+    mesh->zrange[1] = range[1];
+    mesh->scale = scale;
+
+    mesh->n_rows = m->n_rows;
+    mesh->n_columns = m->n_columns;
+
+    if (matrix_view_is_sparse(m))
+        _matrix_mesh_update_csr(mesh, scale);
+    else if (merge_tolerance >= 0.0)
+        _matrix_mesh_update_merged(mesh, scale, merge_tolerance * scale);
+    else
+        _matrix_mesh_update_dense(mesh, scale);
+
+    if (!mesh->tile_chunks) {
+        mesh->n_tile_rows = 1;
+        mesh->n_tile_columns = 1;
+        mesh->tile_chunks = g_malloc(2 * sizeof(guint32));
+        mesh->tile_chunks[0] = 0;
+        mesh->tile_chunks[1] = mesh->n_chunks;
+    }
+    mesh->tiles_changed = g_malloc(matrix_mesh_get_n_tiles(mesh));
+    memset(mesh->tiles_changed, 1, matrix_mesh_get_n_tiles(mesh));
+}
+
+guint32 matrix_mesh_get_n_tiles(MatrixMesh *mesh)
+{
+    return mesh->n_tile_rows * mesh->n_tile_columns;
+}
+
+/* Hashes of the rows of tiles [begin, end) into bands->hashes. */
+static void _matrix_mesh_hash_band(guint64 begin, guint64 end, guint band, MatrixMeshBands *bands)
+{
+    MatrixMesh *mesh = bands->mesh;
+    double *scratch = g_malloc(mesh->n_columns * sizeof(double));
+    double *out = g_malloc(mesh->n_columns * sizeof(double));
+    guint32 i0, r, n_rows;
+
+    for (i0 = begin * MATRIX_MESH_TILE_SIZE; i0 < MIN(end * MATRIX_MESH_TILE_SIZE, mesh->n_rows); i0 += n_rows) {
+        n_rows = MIN(mesh->n_rows - i0, MATRIX_MESH_TILE_SIZE);
+        for (r = 0; r < n_rows; ++r)
+            _matrix_mesh_hash_row(mesh, bands->hashes, i0, r, n_rows,
+                                  matrix_view_row(mesh->view, i0 + r, out, scratch));
     }
+
+    g_free(scratch);
+    g_free(out);
+}
+
+/* Put the chunks of part in place of those of tile. */
+static void _matrix_mesh_replace_tile(MatrixMesh *mesh, guint32 tile, MatrixMesh *part)
+{
+    guint32 first = mesh->tile_chunks[tile], end = mesh->tile_chunks[tile + 1];
+    guint32 n_chunks = 0, k;
+
+    for (k = first; k < end; ++k) {
+        mesh->nfaces -= mesh->chunk_lengths[k];
+        g_free(mesh->chunks[k]);
+    }
+    for (k = 0; k < part->n_chunks; ++k) {
+        if (part->chunk_lengths[k] > 0)
+            ++n_chunks;
+    }
+
+    if (n_chunks != end - first) {
+        if (n_chunks > end - first) {
+            mesh->chunks = g_realloc(mesh->chunks,
+                                     (mesh->n_chunks + n_chunks - (end - first)) * sizeof(MatrixMeshChunk *));
+            mesh->chunk_lengths = g_realloc(mesh->chunk_lengths,
+                                            (mesh->n_chunks + n_chunks - (end - first)) * sizeof(guint32));
+        }
+        memmove(mesh->chunks + first + n_chunks, mesh->chunks + end,
+                (mesh->n_chunks - end) * sizeof(MatrixMeshChunk *));
+        memmove(mesh->chunk_lengths + first + n_chunks, mesh->chunk_lengths + end,
+                (mesh->n_chunks - end) * sizeof(guint32));
+        mesh->n_chunks = mesh->n_chunks - (end - first) + n_chunks;
+        for (k = tile + 1; k <= matrix_mesh_get_n_tiles(mesh); ++k)
+            mesh->tile_chunks[k] = mesh->tile_chunks[k] - (end - first) + n_chunks;
+    }
+
+    for (k = 0; k < part->n_chunks; ++k) {
+        if (part->chunk_lengths[k] == 0) {
+            g_free(part->chunks[k]);
+            continue;
+        }
+        mesh->chunks[first] = part->chunks[k];
+        mesh->chunk_lengths[first++] = part->chunk_lengths[k];
+    }
+    mesh->nfaces += part->nfaces;
+
+    g_free(part->chunks);
+    g_free(part->chunk_lengths);
+}
+
+/* Show view, usually the next frame of a sequence, on a mesh that shows a
+ * matrix of the same size: the hashes of its tiles are compared to the ones
+ * of the tiles the mesh was made of (see matrix_mesh_set_track_changes()),
+ * and only the tiles with changed entries (or walls next to them) are made
+ * again. Meshes without hashes, other sizes and new ranges are made again as
+ * a whole, like in matrix_mesh_set_view(): scaling the faces made for the old
+ * range would drift from the heights and hues made for the new one. */
+void matrix_mesh_change_view(MatrixMesh *mesh, MatrixView *view)
+{
+    MatrixMeshBands bands = { mesh, NULL, 0.0, NULL, NULL, NULL, NULL, NULL };
+    guint64 *hashes, *old;
+    guint32 n_tiles, tile;
+    double range[2];
+
+    if (!view || !mesh->tile_hashes || matrix_view_is_sparse(view) ||
+            view->n_rows != mesh->n_rows || view->n_columns != mesh->n_columns) {
+        matrix_mesh_set_view(mesh, view);
+        return;
+    }
+
+    matrix_mesh_get_range(view, &range[0], &range[1]);
+    if (range[0] != mesh->unscaled_range[0] || range[1] != mesh->unscaled_range[1]) {
+        matrix_mesh_set_view(mesh, view);
+        return;
+    }
+
+    matrix_view_ref(view);
+    matrix_view_unref(mesh->view);
+    mesh->view = view;
+
+    n_tiles = matrix_mesh_get_n_tiles(mesh);
+    old = mesh->tile_hashes;
+    hashes = g_malloc0(3 * (gsize)n_tiles * sizeof(guint64));
+    bands.hashes = hashes;
+    util_parallel_for(mesh->n_tile_rows,
+                      util_parallel_get_bands(mesh->n_tile_rows, (guint64)MATRIX_MESH_TILE_SIZE * mesh->n_columns),
+                      (UtilParallelFunc)_matrix_mesh_hash_band, &bands);
+
+    bands.changed = g_malloc0(n_tiles);
+    for (tile = 0; tile < n_tiles; ++tile) {
+        if (hashes[3 * tile] != old[3 * tile])
+            bands.changed[tile] = 1;
+        /* the walls on the left and on top of the next tiles */
+        if (hashes[3 * tile + 1] != old[3 * tile + 1] && (tile + 1) % mesh->n_tile_columns != 0)
+            bands.changed[tile + 1] = 1;
+        if (hashes[3 * tile + 2] != old[3 * tile + 2] && tile + mesh->n_tile_columns < n_tiles)
+            bands.changed[tile + mesh->n_tile_columns] = 1;
+    }
+    g_free(old);
+    mesh->tile_hashes = hashes;
+
+    if (memchr(bands.changed, 1, n_tiles)) {
+        bands.hashes = NULL;
+        bands.scale = mesh->scale;
+        bands.parts = _matrix_mesh_new_parts(mesh, n_tiles);
+        util_parallel_for(mesh->n_tile_rows,
+                          util_parallel_get_bands(mesh->n_tile_rows,
+                                                  (guint64)MATRIX_MESH_TILE_SIZE * mesh->n_columns),
+                          (UtilParallelFunc)_matrix_mesh_dense_band, &bands);
+        for (tile = 0; tile < n_tiles; ++tile) {
+            if (!bands.changed[tile])
+                continue;
+            _matrix_mesh_replace_tile(mesh, tile, bands.parts + tile);
+            mesh->tiles_changed[tile] = 1;
+        }
+        _matrix_mesh_set_last(mesh);
+        g_free(bands.parts);
+    }
+
+    g_free(bands.changed);
 }
 
 void matrix_mesh_iter_init(MatrixMesh *mesh, MatrixMeshIter *iter)
@@ -289,7 +963,7 @@ void matrix_mesh_iter_init(MatrixMesh *mesh, MatrixMeshIter *iter)
 gboolean matrix_mesh_iter_next(MatrixMesh *mesh, MatrixMeshIter *iter)
 {
     ++iter->offset;
-    if (iter->offset == MATRIX_MESH_FACE_CHUNK_SIZE) {
+    if (iter->chunk < mesh->n_chunks && iter->offset >= mesh->chunk_lengths[iter->chunk]) {
         ++iter->chunk;
         iter->offset = 0;
     }
@@ -299,36 +973,44 @@ gboolean matrix_mesh_iter_next(MatrixMesh *mesh, MatrixMeshIter *iter)
 
 gboolean matrix_mesh_iter_is_valid(MatrixMesh *mesh, MatrixMeshIter *iter)
 {
-    if (iter->chunk >= mesh->n_chunks || mesh->n_chunks == 0)
+    if (iter->chunk >= mesh->n_chunks)
         return FALSE;
-    if (iter->chunk * MATRIX_MESH_FACE_CHUNK_SIZE + iter->offset >= mesh->nfaces)
+    if (iter->offset >= mesh->chunk_lengths[iter->chunk])
         return FALSE;
 
     return TRUE;
 }
 
-MatrixMeshFace *matrix_mesh_append_face(MatrixMesh *mesh, MatrixMeshIter *iter)
+void matrix_mesh_append_face(MatrixMesh *mesh, MatrixMeshFacePlane plane, guint32 row, guint32 column,
+                             guint32 n_rows, guint32 n_columns, double z0, double z1, double hue)
 {
     if (mesh->last.chunk == mesh->n_chunks) {
         ++mesh->n_chunks;
-        mesh->chunk_faces = g_realloc(mesh->chunk_faces, mesh->n_chunks * sizeof(MatrixMeshFace *));
-        mesh->chunk_faces[mesh->last.chunk] = g_malloc(MATRIX_MESH_FACE_CHUNK_SIZE * sizeof(MatrixMeshFace));
+        mesh->chunks = g_realloc(mesh->chunks, mesh->n_chunks * sizeof(MatrixMeshChunk *));
+        mesh->chunk_lengths = g_realloc(mesh->chunk_lengths, mesh->n_chunks * sizeof(guint32));
+        mesh->chunks[mesh->last.chunk] = _matrix_mesh_chunk_new(MATRIX_MESH_FACE_CHUNK_SIZE);
+        mesh->chunk_lengths[mesh->last.chunk] = 0;
     }
 
-    if (iter)
-        *iter = mesh->last;
+    MatrixMeshChunk *chunk = mesh->chunks[mesh->last.chunk];
+    guint32 k = mesh->last.offset;
 
-    MatrixMeshFace *face = &mesh->chunk_faces[mesh->last.chunk][mesh->last.offset];
+    chunk->row[k] = row;
+    chunk->column[k] = column;
+    chunk->n_rows[k] = n_rows;
+    chunk->n_columns[k] = n_columns;
+    chunk->z0[k] = z0;
+    chunk->z1[k] = z1;
+    chunk->hue[k] = _matrix_mesh_hue(hue);
+    chunk->plane[k] = plane;
 
-    ++mesh->last.offset;
-    if (mesh->last.offset == MATRIX_MESH_FACE_CHUNK_SIZE) {
+    mesh->chunk_lengths[mesh->last.chunk] = ++mesh->last.offset;
+    if (mesh->last.offset == chunk->capacity) {
         mesh->last.offset = 0;
         ++mesh->last.chunk;
     }
 
     ++mesh->nfaces;
-
-    return face;
 }
 
 void matrix_mesh_remove_last_face(MatrixMesh *mesh)
@@ -336,13 +1018,179 @@ void matrix_mesh_remove_last_face(MatrixMesh *mesh)
     if (mesh->nfaces == 0)
         return;
 
-    if (mesh->last.offset == 0) {
+    if (mesh->last.offset == 0)
         --mesh->last.chunk;
-        mesh->last.offset = MATRIX_MESH_FACE_CHUNK_SIZE;
+    mesh->last.offset = --mesh->chunk_lengths[mesh->last.chunk];
+
+    --mesh->nfaces;
+}
+
+/* Hash of a corner; equal heights with different signs of zero are equal. */
+static inline guint64 _matrix_mesh_corner_hash(const MatrixMeshCorner *corner)
+{
+    guint32 z_bits = 0;
+    guint64 hash;
+
+    if (corner->z != 0.0f)
+        memcpy(&z_bits, &corner->z, sizeof(guint32));
+
+    hash = (((guint64)corner->row << 32) | corner->column) * 0x9e3779b97f4a7c15ull;
+    hash ^= (z_bits + (hash >> 29)) * 0xbf58476d1ce4e5b9ull;
+
+    return hash ^ (hash >> 31);
+}
+
+static inline gboolean _matrix_mesh_corner_equal(const MatrixMeshCorner *a, const MatrixMeshCorner *b)
+{
+    return a->row == b->row && a->column == b->column &&
+        (a->z == b->z || memcmp(&a->z, &b->z, sizeof(float)) == 0);
+}
+
+/* Indices of the corners found so far, in open addressing; G_MAXUINT32 marks
+ * empty slots. Twice as many slots as corners keep the probes short. */
+typedef struct {
+    guint32 *slots;
+    guint64 mask;
+    MatrixMeshCorner *corners;
+    guint32 n_corners;
+    guint32 size;
+} MatrixMeshCornerTable;
+
+static void _matrix_mesh_corner_table_resize(MatrixMeshCornerTable *table, guint64 n_slots)
+{
+    guint64 slot;
+    guint32 k;
+
+    g_free(table->slots);
+    table->slots = g_malloc(n_slots * sizeof(guint32));
+    memset(table->slots, 0xff, n_slots * sizeof(guint32));
+    table->mask = n_slots - 1;
+
+    for (k = 0; k < table->n_corners; ++k) {
+        for (slot = _matrix_mesh_corner_hash(&table->corners[k]) & table->mask;
+             table->slots[slot] != G_MAXUINT32;
+             slot = (slot + 1) & table->mask);
+        table->slots[slot] = k;
     }
-    else {
-        --mesh->last.offset;
+}
+
+/* Index of corner, which is added if it is new; G_MAXUINT32 if there are too many. */
+static guint32 _matrix_mesh_corner_table_insert(MatrixMeshCornerTable *table, const MatrixMeshCorner *corner)
+{
+    guint64 slot;
+    guint32 k;
+
+    for (slot = _matrix_mesh_corner_hash(corner) & table->mask;
+         (k = table->slots[slot]) != G_MAXUINT32;
+         slot = (slot + 1) & table->mask) {
+        if (_matrix_mesh_corner_equal(&table->corners[k], corner))
+            return k;
     }
 
-    --mesh->nfaces;
+    if (table->n_corners == G_MAXUINT32 - 1)
+        return G_MAXUINT32;
+
+    if (table->n_corners == table->size) {
+        table->size = table->size < G_MAXUINT32 / 2 ? 2 * table->size : G_MAXUINT32 - 1;
+        table->corners = g_realloc(table->corners, (gsize)table->size * sizeof(MatrixMeshCorner));
+    }
+    k = table->n_corners++;
+    table->corners[k] = *corner;
+    table->slots[slot] = k;
+
+    if (2 * (guint64)table->n_corners > table->mask)
+        _matrix_mesh_corner_table_resize(table, 2 * (table->mask + 1));
+
+    return k;
+}
+
+/* Indexed form of the faces in chunks [first, end) of the mesh: corners shared
+ * by neighbouring faces are found on the grid and stored once; NULL if there
+ * are more than 32 bit indices can address. */
+static MatrixMeshIndexed *_matrix_mesh_get_indexed(MatrixMesh *mesh, guint32 first, guint32 end)
+{
+    MatrixMeshCornerTable table = { NULL, 0, NULL, 0, 0 };
+    MatrixMeshIndexed *indexed;
+    MatrixMeshCorner corners[4];
+    MatrixMeshIter iter;
+    double dx = 1.0f/MAX(mesh->n_columns, 1);
+    double dy = 1.0f/MAX(mesh->n_rows, 1);
+    guint64 face, n_faces = 0, n_slots = 16;
+    guint32 j, k;
+
+    for (k = first; k < end; ++k)
+        n_faces += mesh->chunk_lengths[k];
+
+    /* about two corners per face are new */
+    while (n_slots < 4 * n_faces)
+        n_slots *= 2;
+    table.size = (guint32)MIN(n_slots / 2, G_MAXUINT32 - 1);
+    table.corners = g_malloc((gsize)table.size * sizeof(MatrixMeshCorner));
+    _matrix_mesh_corner_table_resize(&table, n_slots);
+
+    indexed = g_malloc0(sizeof(MatrixMeshIndexed));
+    indexed->n_faces = n_faces;
+    indexed->indices = g_malloc(4 * n_faces * sizeof(guint32));
+    indexed->hues = g_malloc(n_faces * sizeof(guint16));
+    indexed->alpha_channel = mesh->alpha_channel;
+
+    for (iter.chunk = first, iter.offset = 0, face = 0;
+         face < n_faces && matrix_mesh_iter_is_valid(mesh, &iter);
+         matrix_mesh_iter_next(mesh, &iter), ++face) {
+        _matrix_mesh_get_corners(mesh->chunks[iter.chunk], iter.offset, corners);
+        for (j = 0; j < 4; ++j) {
+            if ((k = _matrix_mesh_corner_table_insert(&table, &corners[j])) == G_MAXUINT32) {
+                g_printerr("Too many vertices for an indexed mesh.\n");
+                g_free(table.slots);
+                g_free(table.corners);
+                matrix_mesh_indexed_free(indexed);
+                return NULL;
+            }
+            indexed->indices[4 * face + j] = k;
+        }
+        indexed->hues[face] = mesh->chunks[iter.chunk]->hue[iter.offset];
+    }
+
+    indexed->n_vertices = table.n_corners;
+    indexed->vertices = g_malloc((gsize)table.n_corners * 3 * sizeof(float));
+    for (k = 0; k < table.n_corners; ++k) {
+        indexed->vertices[3 * (gsize)k] = table.corners[k].column * dx - 0.5f;
+        indexed->vertices[3 * (gsize)k + 1] = 0.5f - table.corners[k].row * dy;
+        indexed->vertices[3 * (gsize)k + 2] = table.corners[k].z;
+    }
+
+    g_free(table.slots);
+    g_free(table.corners);
+
+    return indexed;
+}
+
+MatrixMeshIndexed *matrix_mesh_get_indexed(MatrixMesh *mesh)
+{
+    return _matrix_mesh_get_indexed(mesh, 0, mesh->n_chunks);
+}
+
+/* Indexed form of the faces of one tile, e.g. to draw the tiles that changed. */
+MatrixMeshIndexed *matrix_mesh_get_indexed_tile(MatrixMesh *mesh, guint32 tile)
+{
+    g_return_val_if_fail(tile < matrix_mesh_get_n_tiles(mesh), NULL);
+
+    return _matrix_mesh_get_indexed(mesh, mesh->tile_chunks[tile], mesh->tile_chunks[tile + 1]);
+}
+
+void matrix_mesh_indexed_free(MatrixMeshIndexed *indexed)
+{
+    if (!indexed)
+        return;
+    g_free(indexed->vertices);
+    g_free(indexed->indices);
+    g_free(indexed->hues);
+    g_free(indexed);
+}
+
+/* Color of a face of the indexed mesh. */
+void matrix_mesh_indexed_get_color(MatrixMeshIndexed *indexed, guint64 face, double *rgba)
+{
+    util_colors_gradient_rgb((double)indexed->hues[face] / MATRIX_MESH_HUE_STEPS, rgba);
+    rgba[3] = indexed->alpha_channel;
 }
@@ -2,6 +2,7 @@
 
 #include <glib.h>
 #include "matrix.h"
+#include "matrix-view.h"
 
 typedef enum {
     MatrixMeshFacePlaneNone = 0,
@@ -19,6 +20,31 @@ typedef struct {
 } MatrixMeshFace;
 
 #define MATRIX_MESH_FACE_CHUNK_SIZE 4096
+/* steps of the color gradient the hues of faces are stored in */
+#define MATRIX_MESH_HUE_STEPS 65535
+
+/* The faces of a mesh are stored compactly, one array per field. All corners
+ * lie on the lines between the entries, so a face is given by the grid lines
+ * it starts on (row from the top, column from the left), how many rows and
+ * columns it spans (0 across walls), its heights z0 and z1 (equal for top
+ * faces) and its hue; matrix_mesh_get_face() turns it into world coordinates
+ * and colors. That is 27 instead of 144 bytes per face. Chunks hold
+ * MATRIX_MESH_FACE_CHUNK_SIZE faces while they are filled; the last one of a
+ * tile is cut to its faces, the arrays follow in the same allocation. */
+typedef struct {
+    guint32 capacity;
+    guint32 *row;
+    guint32 *column;
+    guint32 *n_rows;
+    guint32 *n_columns;
+    float *z0;
+    float *z1;
+    guint16 *hue;
+    guint8 *plane;
+} MatrixMeshChunk;
+
+/* dense meshes are built in square tiles of this many rows and columns */
+#define MATRIX_MESH_TILE_SIZE 64
 
 typedef struct {
     guint32 chunk;
@@ -27,25 +53,67 @@ typedef struct {
 
 typedef struct {
     guint64 nfaces;
-    Matrix *matrix;
+    MatrixView *view;
     MatrixMeshIter last;
     guint32 n_chunks;
-    MatrixMeshFace **chunk_faces;
+    MatrixMeshChunk **chunks;
+    guint32 *chunk_lengths; /* faces in each chunk, which need not be full */
     double zrange[2];
     double unscaled_range[2];
     double alpha_channel;
+    gboolean track_changes;
+    double scale; /* heights per unit of the entries */
+    guint32 n_rows; /* of the grid */
+    guint32 n_columns;
+    /* The faces of each tile (in rows of n_tile_columns tiles) are kept in
+     * chunks of their own, from tile_chunks[tile] to tile_chunks[tile + 1].
+     * Meshes that are not made in tiles are one tile. Dense meshes keep three
+     * hashes per tile if asked to (of its entries, its last column and its
+     * last row), see matrix_mesh_change_view(); tiles_changed marks the tiles
+     * made or changed since it was last cleared. */
+    guint32 n_tile_rows;
+    guint32 n_tile_columns;
+    guint32 *tile_chunks;
+    guint8 *tiles_changed;
+    guint64 *tile_hashes;
 } MatrixMesh;
 
+/* A mesh with shared corners, for drawing with vertex arrays or 3D export: the
+ * corners of all faces once (x, y, z each), and for each face (in the order of
+ * the mesh) the indices of its four corners and its hue. */
+typedef struct {
+    guint32 n_vertices;
+    float *vertices;
+    guint64 n_faces;
+    guint32 *indices;
+    guint16 *hues;
+    double alpha_channel;
+} MatrixMeshIndexed;
+
 MatrixMesh *matrix_mesh_new(void);
 void matrix_mesh_set_matrix(MatrixMesh *mesh, Matrix *matrix);
+void matrix_mesh_set_view(MatrixMesh *mesh, MatrixView *view);
+void matrix_mesh_change_view(MatrixMesh *mesh, MatrixView *view);
 void matrix_mesh_set_alpha_channel(MatrixMesh *mesh, double alpha_channel);
+void matrix_mesh_set_track_changes(MatrixMesh *mesh, gboolean track_changes);
 void matrix_mesh_update(MatrixMesh *mesh);
 void matrix_mesh_iter_init(MatrixMesh *mesh, MatrixMeshIter *iter);
 void matrix_mesh_free(MatrixMesh *mesh);
 gboolean matrix_mesh_iter_next(MatrixMesh *mesh, MatrixMeshIter *iter);
 gboolean matrix_mesh_iter_is_valid(MatrixMesh *mesh, MatrixMeshIter *iter);
-MatrixMeshFace *matrix_mesh_append_face(MatrixMesh *mesh, MatrixMeshIter *iter);
+void matrix_mesh_get_face(MatrixMesh *mesh, MatrixMeshIter *iter, MatrixMeshFace *face);
+void matrix_mesh_append_face(MatrixMesh *mesh, MatrixMeshFacePlane plane, guint32 row, guint32 column,
+                             guint32 n_rows, guint32 n_columns, double z0, double z1, double hue);
 void matrix_mesh_remove_last_face(MatrixMesh *mesh);
+guint32 matrix_mesh_get_n_tiles(MatrixMesh *mesh);
+
+MatrixMeshIndexed *matrix_mesh_get_indexed(MatrixMesh *mesh);
+MatrixMeshIndexed *matrix_mesh_get_indexed_tile(MatrixMesh *mesh, guint32 tile);
+void matrix_mesh_indexed_free(MatrixMeshIndexed *indexed);
+void matrix_mesh_indexed_get_color(MatrixMeshIndexed *indexed, guint64 face, double *rgba);
 
 void matrix_mesh_set_z_epsilon(double eps);
+void matrix_mesh_set_clip_percentile(double percentile);
+void matrix_mesh_set_merge_tolerance(double tolerance);
+void matrix_mesh_get_range(MatrixView *view, double *min, double *max);
 
@@ -0,0 +1,948 @@
+#include "matrix-reader.h"
+#include "util-parallel.h"
+#include <string.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Text input: one row of the matrix per line, entries separated by blanks, tabs
+ * or commas. An empty line starts a new matrix. Rows and columns outside of the
+ * region are skipped without converting their entries. */
+
+#define MATRIX_READER_BLOCK_SIZE 64
+#define MATRIX_READER_BUFFER_SIZE (1 << 20)
+
+struct _MatrixReader {
+    GList *list;
+    Matrix *current;
+
+    /* values of the current line */
+    double *row;
+    guint32 row_alloc;
+    guint32 values;
+    guint32 columns;
+
+    /* lines of the current matrix so far and their length, including those
+     * outside of the region */
+    guint32 rows;
+    guint32 width;
+
+    /* the next row and column of the region, G_MAXUINT32 after the last one */
+    MatrixRegion region;
+    guint32 next_row;
+    guint32 next_column;
+    guint32 first_column;
+
+    /* keep matrices without entries, see _matrix_reader_parse_segments() */
+    gboolean keep_empty;
+
+    guint64 line;
+
+    /* messages of a segment, printed in order after all segments are read;
+     * NULL to print them right away */
+    GString *output;
+    GString *errors;
+
+    /* incomplete line left over from the last call to matrix_reader_feed() */
+    gchar *carry;
+    gsize carry_length;
+    gsize carry_alloc;
+};
+
+static const double _matrix_reader_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define IS_SEPARATOR(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == ',' || (c) == '\n')
+
+/* SWAR digit parsing: check/convert eight ascii digits at once (little endian load) */
+static inline gboolean _matrix_reader_is_eight_digits(guint64 val)
+{
+    return !(((val & 0xF0F0F0F0F0F0F0F0ULL) |
+              (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ^ 0x3333333333333333ULL);
+}
+
+static inline guint32 _matrix_reader_parse_eight_digits(guint64 val)
+{
+    val -= 0x3030303030303030ULL;
+    val = (val * 10) + (val >> 8);
+    val = (((val & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+           (((val >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+    return (guint32)val;
+}
+
+static inline gboolean _matrix_reader_load_eight_digits(const gchar *p, const gchar *end, guint64 *val)
+{
+    if (end - p < 8)
+        return FALSE;
+    memcpy(val, p, 8);
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    *val = GUINT64_SWAP_LE_BE(*val);
+#endif
+    return _matrix_reader_is_eight_digits(*val);
+}
+
+/* Parse a floating point number starting at str. Returns the number of characters
+ * consumed or 0 if there is no number. Numbers with at most 19 significant digits and
+ * a small exponent are converted exactly (Clinger's fast path: both the mantissa and
+ * the power of ten are representable, so one multiplication/division rounds correctly),
+ * everything else is handed to g_ascii_strtod(). */
+gsize matrix_reader_parse_double(const gchar *str, const gchar *end, double *value)
+{
+    const gchar *p = str;
+    const gchar *digits_start;
+    gboolean negative = FALSE;
+    gboolean truncated = FALSE;
+    guint64 mantissa = 0;
+    guint64 chunk;
+    gint64 exponent = 0;
+    gint64 exp_value;
+    gboolean exp_negative;
+    guint digits = 0;
+    gsize n_digits;
+    gchar *endptr;
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    /* integer part */
+    digits_start = p;
+    while (digits + 8 <= 19 && _matrix_reader_load_eight_digits(p, end, &chunk)) {
+        mantissa = mantissa * 100000000 + _matrix_reader_parse_eight_digits(chunk);
+        if (mantissa)
+            digits += 8;
+        p += 8;
+    }
+    for ( ; p < end && g_ascii_isdigit(*p); ++p) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                ++digits;
+        }
+        else {
+            ++exponent;
+            if (*p != '0')
+                truncated = TRUE;
+        }
+    }
+    n_digits = p - digits_start;
+
+    /* fractional part */
+    if (p < end && *p == '.') {
+        digits_start = ++p;
+        while (digits + 8 <= 19 && _matrix_reader_load_eight_digits(p, end, &chunk)) {
+            mantissa = mantissa * 100000000 + _matrix_reader_parse_eight_digits(chunk);
+            if (mantissa)
+                digits += 8;
+            exponent -= 8;
+            p += 8;
+        }
+        for ( ; p < end && g_ascii_isdigit(*p); ++p) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    ++digits;
+                --exponent;
+            }
+            else if (*p != '0') {
+                truncated = TRUE;
+            }
+        }
+        n_digits += p - digits_start;
+    }
+
+    if (n_digits == 0) {
+        /* inf, nan */
+        if (p < end && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N')) {
+            *value = g_ascii_strtod(str, &endptr);
+            if (endptr > str && endptr <= end)
+                return endptr - str;
+        }
+        return 0;
+    }
+
+    /* exponent; a trailing 'e' without digits is not part of the number */
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const gchar *q = p + 1;
+        exp_negative = FALSE;
+        if (q < end && (*q == '-' || *q == '+')) {
+            exp_negative = *q == '-';
+            ++q;
+        }
+        if (q < end && g_ascii_isdigit(*q)) {
+            for (exp_value = 0; q < end && g_ascii_isdigit(*q); ++q) {
+                if (exp_value < 100000)
+                    exp_value = exp_value * 10 + (*q - '0');
+            }
+            exponent += exp_negative ? -exp_value : exp_value;
+            p = q;
+        }
+    }
+
+    if (mantissa == 0) {
+        *value = negative ? -0.0 : 0.0;
+    }
+    else if (!truncated && mantissa <= (G_GUINT64_CONSTANT(1) << 53) &&
+             exponent >= -22 && exponent <= 22) {
+        *value = exponent >= 0 ? (double)mantissa * _matrix_reader_pow10[exponent]
+                               : (double)mantissa / _matrix_reader_pow10[-exponent];
+        if (negative)
+            *value = -*value;
+    }
+    else {
+        *value = g_ascii_strtod(str, NULL);
+    }
+
+    return p - str;
+}
+
+/* Mark separators (including newlines) and newlines of a block of 64 bytes; bit k
+ * of the masks corresponds to block[k]. */
+static inline void _matrix_reader_classify_block(const gchar *block, guint64 *separators, guint64 *newlines)
+{
+#ifdef __SSE2__
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i c, nl, sep;
+    guint64 s = 0, n = 0;
+    int k;
+
+    for (k = 0; k < MATRIX_READER_BLOCK_SIZE / 16; ++k) {
+        c = _mm_loadu_si128((const __m128i *)(block + 16 * k));
+        nl = _mm_cmpeq_epi8(c, newline);
+        sep = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, blank), _mm_cmpeq_epi8(c, tab)),
+                           _mm_or_si128(_mm_cmpeq_epi8(c, cr), _mm_cmpeq_epi8(c, comma)));
+        sep = _mm_or_si128(sep, nl);
+        s |= (guint64)(guint32)_mm_movemask_epi8(sep) << (16 * k);
+        n |= (guint64)(guint32)_mm_movemask_epi8(nl) << (16 * k);
+    }
+
+    *separators = s;
+    *newlines = n;
+#else
+    guint64 s = 0, n = 0;
+    int k;
+
+    for (k = 0; k < MATRIX_READER_BLOCK_SIZE; ++k) {
+        if (IS_SEPARATOR(block[k]))
+            s |= G_GUINT64_CONSTANT(1) << k;
+        if (block[k] == '\n')
+            n |= G_GUINT64_CONSTANT(1) << k;
+    }
+
+    *separators = s;
+    *newlines = n;
+#endif
+}
+
+static void _matrix_reader_reserve_row(MatrixReader *reader, guint32 size)
+{
+    if (size <= reader->row_alloc)
+        return;
+    reader->row_alloc = MAX(size, 2 * reader->row_alloc);
+    reader->row = g_realloc(reader->row, reader->row_alloc * sizeof(double));
+}
+
+/* The first index of slice at or after k. */
+static guint32 _matrix_reader_slice_next(const MatrixSlice *slice, guint64 k)
+{
+    if (k < slice->begin)
+        k = slice->begin;
+    else
+        k = slice->begin + (k - slice->begin + slice->step - 1) / slice->step * slice->step;
+
+    return k < slice->end ? (guint32)k : G_MAXUINT32;
+}
+
+/* The index after k, which is part of slice. */
+static inline guint32 _matrix_reader_slice_after(const MatrixSlice *slice, guint32 k)
+{
+    return (guint64)k + slice->step < slice->end ? k + slice->step : G_MAXUINT32;
+}
+
+/* Continue the current matrix at row, e.g. in the middle of a segment. */
+static void _matrix_reader_start_rows(MatrixReader *reader, guint32 row)
+{
+    reader->rows = row;
+    reader->width = 0;
+    reader->next_row = _matrix_reader_slice_next(&reader->region.rows, row);
+    reader->first_column = _matrix_reader_slice_next(&reader->region.columns, 0);
+    reader->next_column = reader->first_column;
+}
+
+/* Print a message on stdout or stderr, or collect it for later. */
+static void _matrix_reader_message(MatrixReader *reader, gboolean error, const gchar *format, ...)
+{
+    GString *collected = error ? reader->errors : reader->output;
+    gchar *message;
+    va_list args;
+
+    va_start(args, format);
+    if (collected) {
+        g_string_append_vprintf(collected, format, args);
+    }
+    else {
+        message = g_strdup_vprintf(format, args);
+        if (error)
+            g_printerr("%s", message);
+        else
+            g_print("%s", message);
+        g_free(message);
+    }
+    va_end(args);
+}
+
+static void _matrix_reader_end_line(MatrixReader *reader)
+{
+    Matrix *m = reader->current;
+
+    if (reader->columns == 0) {
+        if (reader->rows != 0) {
+            _matrix_reader_message(reader, FALSE, "start of new matrix at line %" G_GUINT64_FORMAT "\n", reader->line);
+            reader->current = matrix_new();
+            reader->list = g_list_prepend(reader->list, reader->current);
+            _matrix_reader_start_rows(reader, 0);
+        }
+    }
+    else {
+        if (reader->width == 0) {
+            reader->width = reader->columns;
+            m->n_columns = matrix_slice_count(&reader->region.columns, reader->width);
+        }
+        else if (reader->width != reader->columns) {
+            _matrix_reader_message(reader, TRUE, "column mismatch at line %" G_GUINT64_FORMAT "\n", reader->line);
+        }
+        if (reader->rows == reader->next_row) {
+            /* keep the matrix rectangular: pad short rows with zeros, cut long ones */
+            if (reader->values < m->n_columns) {
+                _matrix_reader_reserve_row(reader, m->n_columns);
+                memset(reader->row + reader->values, 0, (m->n_columns - reader->values) * sizeof(double));
+            }
+            matrix_append_row(m, reader->row, m->n_columns);
+            ++m->n_rows;
+            reader->next_row = _matrix_reader_slice_after(&reader->region.rows, reader->rows);
+        }
+        ++reader->rows;
+        reader->values = 0;
+        reader->columns = 0;
+        reader->next_column = reader->first_column;
+    }
+
+    ++reader->line;
+}
+
+static inline void _matrix_reader_token(MatrixReader *reader, const gchar *p, const gchar *end)
+{
+    double value;
+    gsize n;
+
+    /* entries outside of the region are only counted */
+    if (reader->columns != reader->next_column || reader->rows != reader->next_row) {
+        ++reader->columns;
+        return;
+    }
+
+    n = matrix_reader_parse_double(p, end, &value);
+
+    /* data always ends with a newline, so p[n] is valid */
+    if (n == 0 || !IS_SEPARATOR(p[n])) {
+        _matrix_reader_message(reader, TRUE, "invalid number at line %" G_GUINT64_FORMAT "\n", reader->line);
+        return;
+    }
+
+    if (G_UNLIKELY(reader->values == reader->row_alloc))
+        _matrix_reader_reserve_row(reader, reader->values + 1);
+    reader->row[reader->values++] = value;
+    reader->next_column = _matrix_reader_slice_after(&reader->region.columns, reader->columns);
+    ++reader->columns;
+}
+
+/* Parse complete lines, i.e. data[length-1] has to be a newline. Separators and
+ * newlines are located 64 bytes at a time; a token starts at every non-separator
+ * following a separator. Characters after a number that are not separators make
+ * the whole token invalid (e.g. 0.5-1.2). */
+static void _matrix_reader_process(MatrixReader *reader, const gchar *data, gsize length)
+{
+    gchar tail[MATRIX_READER_BLOCK_SIZE];
+    const gchar *block;
+    const gchar *end = data + length;
+    gsize pos, remaining;
+    guint64 separators, newlines, starts, bits, mask;
+    guint64 carry = 1;
+    guint k;
+
+    for (pos = 0; pos < length; pos += MATRIX_READER_BLOCK_SIZE) {
+        remaining = length - pos;
+        if (remaining >= MATRIX_READER_BLOCK_SIZE) {
+            block = data + pos;
+            mask = G_MAXUINT64;
+        }
+        else {
+            memset(tail, 0, MATRIX_READER_BLOCK_SIZE);
+            memcpy(tail, data + pos, remaining);
+            block = tail;
+            mask = (G_GUINT64_CONSTANT(1) << remaining) - 1;
+        }
+
+        _matrix_reader_classify_block(block, &separators, &newlines);
+
+        starts = ~separators & ((separators << 1) | carry);
+        carry = separators >> 63;
+
+        for (bits = (starts | newlines) & mask; bits; bits &= bits - 1) {
+            k = __builtin_ctzll(bits);
+            if (data[pos + k] == '\n')
+                _matrix_reader_end_line(reader);
+            else
+                _matrix_reader_token(reader, data + pos + k, end);
+        }
+    }
+}
+
+static void _matrix_reader_carry_append(MatrixReader *reader, const gchar *data, gsize length)
+{
+    if (reader->carry_length + length > reader->carry_alloc) {
+        reader->carry_alloc = MAX(reader->carry_length + length, 2 * reader->carry_alloc);
+        reader->carry = g_realloc(reader->carry, reader->carry_alloc);
+    }
+    memcpy(reader->carry + reader->carry_length, data, length);
+    reader->carry_length += length;
+}
+
+MatrixReader *matrix_reader_new(void)
+{
+    MatrixReader *reader = g_malloc0(sizeof(MatrixReader));
+
+    reader->line = 1;
+    reader->current = matrix_new();
+    reader->list = g_list_prepend(NULL, reader->current);
+    matrix_region_init(&reader->region);
+    _matrix_reader_start_rows(reader, 0);
+
+    return reader;
+}
+
+/* Keep only the given rows and columns of each matrix; call this before the
+ * first call to matrix_reader_feed(). */
+void matrix_reader_set_region(MatrixReader *reader, const MatrixRegion *region)
+{
+    g_return_if_fail(reader != NULL);
+
+    if (region)
+        reader->region = *region;
+    else
+        matrix_region_init(&reader->region);
+    _matrix_reader_start_rows(reader, reader->rows);
+}
+
+/* Data may be split anywhere; incomplete lines are kept until the next call. */
+void matrix_reader_feed(MatrixReader *reader, const gchar *data, gsize length)
+{
+    const gchar *nl;
+    gsize n;
+
+    g_return_if_fail(reader != NULL);
+
+    if (length == 0)
+        return;
+
+    if (reader->carry_length) {
+        nl = memchr(data, '\n', length);
+        n = nl ? (gsize)(nl - data) + 1 : length;
+        _matrix_reader_carry_append(reader, data, n);
+        if (!nl)
+            return;
+        _matrix_reader_process(reader, reader->carry, reader->carry_length);
+        reader->carry_length = 0;
+        data += n;
+        length -= n;
+    }
+
+    for (n = length; n > 0 && data[n - 1] != '\n'; --n);
+
+    if (n)
+        _matrix_reader_process(reader, data, n);
+    if (n < length)
+        _matrix_reader_carry_append(reader, data + n, length - n);
+}
+
+/* Matrices without a single entry in the region. */
+static GList *_matrix_reader_drop_empty(GList *list)
+{
+    GList *tmp, *next;
+    Matrix *m;
+
+    for (tmp = list; tmp; tmp = next) {
+        next = g_list_next(tmp);
+        m = tmp->data;
+        if (m->n_rows == 0 || m->n_columns == 0) {
+            matrix_free(m);
+            list = g_list_delete_link(list, tmp);
+        }
+    }
+
+    return list;
+}
+
+GList *matrix_reader_finish(MatrixReader *reader)
+{
+    GList *list;
+
+    g_return_val_if_fail(reader != NULL, NULL);
+
+    if (reader->carry_length) {
+        _matrix_reader_carry_append(reader, "\n", 1);
+        _matrix_reader_process(reader, reader->carry, reader->carry_length);
+    }
+
+    list = reader->list;
+    if (list && reader->rows == 0) {
+        matrix_free((Matrix *)list->data);
+        list = g_list_delete_link(list, list);
+    }
+    if (!reader->keep_empty)
+        list = _matrix_reader_drop_empty(list);
+
+    g_free(reader->row);
+    g_free(reader->carry);
+    g_free(reader);
+
+    return g_list_reverse(list);
+}
+
+static GList *_matrix_read_from_buffer(const gchar *data, gsize length, const MatrixRegion *region,
+                                       guint64 first_line)
+{
+    MatrixReader *reader = matrix_reader_new();
+    reader->line = first_line;
+    matrix_reader_set_region(reader, region);
+    matrix_reader_feed(reader, data, length);
+    return matrix_reader_finish(reader);
+}
+
+GList *matrix_read_from_buffer(const gchar *data, gsize length)
+{
+    return _matrix_read_from_buffer(data, length, NULL, 1);
+}
+
+/* Parallel reading of one buffer: the data is cut into one segment per job at
+ * line boundaries, preferably at empty lines so that segments hold whole matrices.
+ * Segments that start in the middle of a matrix are appended to the last matrix
+ * of the preceding segment, so the result is the same as for serial reading. */
+
+#define MATRIX_READER_MIN_SEGMENT_SIZE (1 << 22)
+#define MATRIX_READER_SPLIT_WINDOW (1 << 20)
+
+typedef struct {
+    const gchar *data;
+    gsize length;
+    guint64 first_line;
+    gboolean continues;
+    GList *matrices;
+
+    /* with a row region: the row of the matrix the segment continues, the rows
+     * after its last empty line and whether it has one */
+    const MatrixRegion *region;
+    guint32 first_row;
+    guint32 trailing_rows;
+    gboolean has_break;
+
+    /* messages while parsing, see _matrix_reader_message() */
+    GString *output;
+    GString *errors;
+} MatrixReaderSegment;
+
+static guint64 _matrix_reader_count_lines(const gchar *data, gsize length)
+{
+    guint64 count = 0;
+    gsize pos = 0;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i c;
+
+    for ( ; pos + 16 <= length; pos += 16) {
+        c = _mm_loadu_si128((const __m128i *)(data + pos));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(c, newline)));
+    }
+#endif
+    for ( ; pos < length; ++pos)
+        if (data[pos] == '\n')
+            ++count;
+
+    return count;
+}
+
+/* Does the line starting at data[pos] contain only separators? */
+static gboolean _matrix_reader_line_is_empty(const gchar *data, gsize length, gsize pos, gsize *next)
+{
+    gboolean empty = TRUE;
+
+    for ( ; pos < length && data[pos] != '\n'; ++pos)
+        if (!IS_SEPARATOR(data[pos]))
+            empty = FALSE;
+
+    *next = pos < length ? pos + 1 : length;
+
+    return empty;
+}
+
+/* Find the start of a segment at or after target. */
+static gsize _matrix_reader_find_split(const gchar *data, gsize length, gsize target, gsize limit, gboolean *continues)
+{
+    gsize pos, next, first;
+    const gchar *nl;
+
+    if (target >= length)
+        return length;
+
+    nl = memchr(data + target, '\n', length - target);
+    if (nl == NULL)
+        return length;
+    first = nl - data + 1;
+
+    /* the line of the target may be empty itself */
+    for (pos = target; pos > 0 && data[pos - 1] != '\n'; --pos);
+    if (_matrix_reader_line_is_empty(data, length, pos, &next)) {
+        while (next < length && _matrix_reader_line_is_empty(data, length, next, &pos))
+            next = pos;
+        *continues = FALSE;
+        return next;
+    }
+
+    /* look for an empty line close to the target */
+    for (pos = first; pos < length && pos < limit; pos = next) {
+        if (_matrix_reader_line_is_empty(data, length, pos, &next)) {
+            /* skip further empty lines */
+            while (next < length && _matrix_reader_line_is_empty(data, length, next, &pos))
+                next = pos;
+            *continues = FALSE;
+            return next;
+        }
+    }
+
+    /* no matrix boundary, split between two rows */
+    *continues = TRUE;
+    return first;
+}
+
+/* Count the lines after the last empty one; returns whether there is one. */
+static gboolean _matrix_reader_count_trailing_rows(const gchar *data, gsize length, guint32 *rows)
+{
+    gsize start, end = length, next;
+    guint32 count = 0;
+
+    if (end > 0 && data[end - 1] == '\n')
+        --end;
+
+    for (;;) {
+        for (start = end; start > 0 && data[start - 1] != '\n'; --start);
+        if (_matrix_reader_line_is_empty(data, length, start, &next))
+            break;
+        ++count;
+        if (start == 0) {
+            *rows = count;
+            return FALSE;
+        }
+        end = start - 1;
+    }
+
+    *rows = count;
+    return TRUE;
+}
+
+/* Rows outside of the region are only skipped if we know where a segment is in
+ * its matrix. */
+static gboolean _matrix_reader_has_row_region(const MatrixRegion *region)
+{
+    return region && (region->rows.begin != 0 || region->rows.step != 1 || region->rows.end != G_MAXUINT32);
+}
+
+static void _matrix_reader_count_segments(guint64 begin, guint64 end, guint band, MatrixReaderSegment *segments)
+{
+    MatrixReaderSegment *segment;
+
+    for (segment = segments + begin; segment < segments + end; ++segment) {
+        segment->first_line = _matrix_reader_count_lines(segment->data, segment->length);
+        if (_matrix_reader_has_row_region(segment->region))
+            segment->has_break = _matrix_reader_count_trailing_rows(segment->data, segment->length,
+                                                                    &segment->trailing_rows);
+    }
+}
+
+static void _matrix_reader_parse_segments(guint64 begin, guint64 end, guint band, MatrixReaderSegment *segments)
+{
+    MatrixReaderSegment *segment;
+    MatrixReader *reader;
+
+    for (segment = segments + begin; segment < segments + end; ++segment) {
+        reader = matrix_reader_new();
+        reader->line = segment->first_line;
+        /* matrices may continue in the next segment, see matrix_read_from_buffer_parallel() */
+        reader->keep_empty = TRUE;
+        reader->output = segment->output = g_string_new(NULL);
+        reader->errors = segment->errors = g_string_new(NULL);
+        matrix_reader_set_region(reader, segment->region);
+        _matrix_reader_start_rows(reader, segment->first_row);
+        matrix_reader_feed(reader, segment->data, segment->length);
+        segment->matrices = matrix_reader_finish(reader);
+    }
+}
+
+static GList *_matrix_read_from_buffer_parallel(const gchar *data, gsize length, guint n_jobs,
+                                                const MatrixRegion *region, guint64 first_line)
+{
+    MatrixReaderSegment *segments;
+    guint n_segments, i;
+    gsize pos, next, target;
+    guint64 line, count;
+    GList *list = NULL, *tail = NULL;
+    gboolean continues = FALSE;
+
+    if (n_jobs > length / MATRIX_READER_MIN_SEGMENT_SIZE)
+        n_jobs = length / MATRIX_READER_MIN_SEGMENT_SIZE;
+    if (n_jobs <= 1)
+        return _matrix_read_from_buffer(data, length, region, first_line);
+
+    segments = g_malloc0(n_jobs * sizeof(MatrixReaderSegment));
+
+    for (pos = 0, n_segments = 0; pos < length && n_segments < n_jobs; pos = next, ++n_segments) {
+        segments[n_segments].data = data + pos;
+        segments[n_segments].continues = continues;
+        segments[n_segments].region = region;
+
+        target = (n_segments + 1) * (length / n_jobs);
+        next = n_segments + 1 == n_jobs ? length :
+            _matrix_reader_find_split(data, length, MAX(target, pos), MAX(target, pos) + MATRIX_READER_SPLIT_WINDOW, &continues);
+        segments[n_segments].length = next - pos;
+    }
+
+    /* line numbers for messages: count lines of all segments first */
+    util_parallel_for(n_segments, n_segments, (UtilParallelFunc)_matrix_reader_count_segments, segments);
+    for (i = 0, line = first_line; i < n_segments; ++i) {
+        count = segments[i].first_line;
+        segments[i].first_line = line;
+        line += count;
+    }
+
+    /* without an empty line, all lines of a segment are rows of the same matrix */
+    for (i = 1; i < n_segments && _matrix_reader_has_row_region(region); ++i) {
+        if (segments[i].continues)
+            segments[i].first_row = segments[i - 1].has_break ? segments[i - 1].trailing_rows :
+                segments[i - 1].first_row + (segments[i].first_line - segments[i - 1].first_line);
+    }
+
+    util_parallel_for(n_segments, n_segments, (UtilParallelFunc)_matrix_reader_parse_segments, segments);
+
+    /* join in order, with the messages of each segment */
+    for (i = 0; i < n_segments; ++i) {
+        if (segments[i].continues && tail && segments[i].matrices) {
+            Matrix *first = segments[i].matrices->data;
+            if (((Matrix *)tail->data)->n_columns != first->n_columns)
+                g_printerr("column mismatch at line %" G_GUINT64_FORMAT "\n", segments[i].first_line);
+            matrix_append_matrix((Matrix *)tail->data, first);
+            matrix_free(first);
+            segments[i].matrices = g_list_delete_link(segments[i].matrices, segments[i].matrices);
+        }
+        if (segments[i].output->len)
+            g_print("%s", segments[i].output->str);
+        if (segments[i].errors->len)
+            g_printerr("%s", segments[i].errors->str);
+        g_string_free(segments[i].output, TRUE);
+        g_string_free(segments[i].errors, TRUE);
+        if (segments[i].matrices) {
+            list = g_list_concat(list, segments[i].matrices);
+            tail = g_list_last(segments[i].matrices);
+        }
+    }
+
+    g_free(segments);
+
+    return _matrix_reader_drop_empty(list);
+}
+
+GList *matrix_read_from_buffer_parallel(const gchar *data, gsize length, guint n_jobs, const MatrixRegion *region)
+{
+    return _matrix_read_from_buffer_parallel(data, length, n_jobs, region, 1);
+}
+
+/* Index of text input: where each matrix starts and ends, and its size, without
+ * converting a single entry. Lines are told apart as in _matrix_reader_process(),
+ * but only the token starts of each line are counted. */
+
+typedef struct {
+    GArray *frames;
+    MatrixReaderFrame frame;
+    gboolean in_frame;
+    guint64 line;
+    gsize line_start;
+    guint64 tokens;
+} MatrixReaderIndex;
+
+/* The line that started at index->line_start ends before pos. */
+static void _matrix_reader_index_end_line(MatrixReaderIndex *index, gsize pos)
+{
+    if (index->tokens == 0) {
+        if (index->in_frame) {
+            index->frame.length = index->line_start - index->frame.offset;
+            g_array_append_val(index->frames, index->frame);
+            index->in_frame = FALSE;
+        }
+    }
+    else {
+        if (!index->in_frame) {
+            index->frame.offset = index->line_start;
+            index->frame.line = index->line;
+            index->frame.n_rows = 0;
+            index->frame.n_columns = (guint32)MIN(index->tokens, G_MAXUINT32);
+            index->in_frame = TRUE;
+        }
+        if (index->frame.n_rows < G_MAXUINT32)
+            ++index->frame.n_rows;
+    }
+
+    index->line_start = pos + 1;
+    index->tokens = 0;
+    ++index->line;
+}
+
+/* The matrices in data as MatrixReaderFrame, in order. Each one can be read on
+ * its own with matrix_read_frame(). */
+GArray *matrix_reader_index_buffer(const gchar *data, gsize length)
+{
+    MatrixReaderIndex index;
+    gchar tail[MATRIX_READER_BLOCK_SIZE];
+    const gchar *block;
+    gsize pos, remaining;
+    guint64 separators, newlines, starts, mask, bits;
+    guint64 carry = 1;
+    guint from, k;
+
+    memset(&index, 0, sizeof(MatrixReaderIndex));
+    index.frames = g_array_new(FALSE, FALSE, sizeof(MatrixReaderFrame));
+    index.line = 1;
+
+    for (pos = 0; pos < length; pos += MATRIX_READER_BLOCK_SIZE) {
+        remaining = length - pos;
+        if (remaining >= MATRIX_READER_BLOCK_SIZE) {
+            block = data + pos;
+            mask = G_MAXUINT64;
+        }
+        else {
+            memset(tail, 0, MATRIX_READER_BLOCK_SIZE);
+            memcpy(tail, data + pos, remaining);
+            block = tail;
+            mask = (G_GUINT64_CONSTANT(1) << remaining) - 1;
+        }
+
+        _matrix_reader_classify_block(block, &separators, &newlines);
+
+        starts = ~separators & ((separators << 1) | carry) & mask;
+        carry = separators >> 63;
+
+        /* token starts before each newline belong to its line */
+        for (bits = newlines & mask, from = 0; bits; bits &= bits - 1) {
+            k = __builtin_ctzll(bits);
+            index.tokens += __builtin_popcountll((starts & ((G_GUINT64_CONSTANT(1) << k) - 1)) >> from);
+            _matrix_reader_index_end_line(&index, pos + k);
+            from = k + 1;
+        }
+        if (from < MATRIX_READER_BLOCK_SIZE)
+            index.tokens += __builtin_popcountll(starts >> from);
+    }
+
+    /* data need not end with a newline */
+    if (index.line_start < length)
+        _matrix_reader_index_end_line(&index, length);
+    if (index.in_frame) {
+        index.frame.length = length - index.frame.offset;
+        g_array_append_val(index.frames, index.frame);
+    }
+
+    return index.frames;
+}
+
+/* Read the matrix at frame of the data given to matrix_reader_index_buffer(),
+ * keeping only the entries in region (NULL for all). Returns NULL if there are
+ * none. */
+Matrix *matrix_read_frame(const gchar *data, const MatrixReaderFrame *frame, guint n_jobs,
+                          const MatrixRegion *region)
+{
+    GList *list;
+    Matrix *m;
+
+    g_return_val_if_fail(frame != NULL, NULL);
+
+    list = _matrix_read_from_buffer_parallel(data + frame->offset, frame->length, n_jobs, region, frame->line);
+    if (list == NULL)
+        return NULL;
+
+    /* lines without a valid number end a matrix while reading, but not in the
+     * index; keep the first part */
+    m = list->data;
+    g_list_free_full(g_list_delete_link(list, list), (GDestroyNotify)matrix_free);
+
+    return m;
+}
+
+GList *matrix_read_from_file(int fd)
+{
+    return matrix_read_from_file_parallel(fd, 1, NULL);
+}
+
+/* Read all matrices from fd, keeping only the entries in region (NULL for all). */
+GList *matrix_read_from_file_parallel(int fd, guint n_jobs, const MatrixRegion *region)
+{
+    struct stat st;
+    off_t offset;
+    gchar *data;
+    gssize n;
+    GList *list;
+    MatrixReader *reader;
+
+    /* regular files are mapped as a whole */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > offset) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            list = matrix_read_from_buffer_parallel(data + offset, st.st_size - offset, n_jobs, region);
+            munmap(data, st.st_size);
+            lseek(fd, 0, SEEK_END);
+            return list;
+        }
+    }
+
+    /* pipes, terminals and files we cannot map */
+    reader = matrix_reader_new();
+    matrix_reader_set_region(reader, region);
+    data = g_malloc(MATRIX_READER_BUFFER_SIZE);
+
+    while ((n = read(fd, data, MATRIX_READER_BUFFER_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            g_printerr("Error reading input: %s\n", g_strerror(errno));
+            break;
+        }
+        matrix_reader_feed(reader, data, n);
+    }
+
+    g_free(data);
+
+    return matrix_reader_finish(reader);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+
+typedef struct _MatrixReader MatrixReader;
+
+/* A matrix of text input: its bytes, the line it starts at and its size. */
+typedef struct {
+    guint64 offset;
+    guint64 length;
+    guint64 line;
+    guint32 n_rows;
+    guint32 n_columns;
+} MatrixReaderFrame;
+
+MatrixReader *matrix_reader_new(void);
+void matrix_reader_set_region(MatrixReader *reader, const MatrixRegion *region);
+void matrix_reader_feed(MatrixReader *reader, const gchar *data, gsize length);
+GList *matrix_reader_finish(MatrixReader *reader);
+
+GList *matrix_read_from_buffer(const gchar *data, gsize length);
+GList *matrix_read_from_buffer_parallel(const gchar *data, gsize length, guint n_jobs,
+                                        const MatrixRegion *region);
+GList *matrix_read_from_file(int fd);
+GList *matrix_read_from_file_parallel(int fd, guint n_jobs, const MatrixRegion *region);
+
+GArray *matrix_reader_index_buffer(const gchar *data, gsize length);
+Matrix *matrix_read_frame(const gchar *data, const MatrixReaderFrame *frame, guint n_jobs,
+                          const MatrixRegion *region);
+
+gsize matrix_reader_parse_double(const gchar *str, const gchar *end, double *value);
@@ -0,0 +1,285 @@
+#include "matrix-rmx.h"
+#include "matrix-binary.h"
+#include <string.h>
+#include <stdio.h>
+
+#define MATRIX_RMX_HEADER_SIZE (MATRIX_RMX_MAGIC_LENGTH + 2 * sizeof(guint32))
+#define MATRIX_RMX_ENTRY_SIZE_V1 G_STRUCT_OFFSET(MatrixRmxEntry, abs_min)
+
+static inline double _matrix_rmx_swap_double(double value)
+{
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    guint64 bits;
+    memcpy(&bits, &value, sizeof(double));
+    bits = GUINT64_SWAP_LE_BE(bits);
+    memcpy(&value, &bits, sizeof(double));
+#endif
+    return value;
+}
+
+/* Convert between file (little endian) and host byte order; the operation is
+ * its own inverse. */
+static void _matrix_rmx_entry_swap(MatrixRmxEntry *entry)
+{
+    entry->n_rows = GUINT64_FROM_LE(entry->n_rows);
+    entry->n_columns = GUINT64_FROM_LE(entry->n_columns);
+    entry->dtype = GUINT32_FROM_LE(entry->dtype);
+    entry->flags = GUINT32_FROM_LE(entry->flags);
+    entry->offset = GUINT64_FROM_LE(entry->offset);
+    entry->min = _matrix_rmx_swap_double(entry->min);
+    entry->max = _matrix_rmx_swap_double(entry->max);
+    entry->abs_min = _matrix_rmx_swap_double(entry->abs_min);
+    entry->abs_max = _matrix_rmx_swap_double(entry->abs_max);
+    entry->sum = _matrix_rmx_swap_double(entry->sum);
+    entry->n_zeros = GUINT64_FROM_LE(entry->n_zeros);
+    entry->n_nonfinite = GUINT64_FROM_LE(entry->n_nonfinite);
+}
+
+/* Statistics of the entries as stored in a version 2 entry. */
+static void _matrix_rmx_entry_get_stats(MatrixRmxEntry *entry, MatrixStats *stats, guint64 count)
+{
+    stats->n_entries = count;
+    stats->n_zeros = entry->n_zeros;
+    stats->n_nonfinite = entry->n_nonfinite;
+    stats->min = entry->min;
+    stats->max = entry->max;
+    stats->abs_min = entry->abs_min;
+    stats->abs_max = entry->abs_max;
+    stats->sum = entry->sum;
+}
+
+static void _matrix_rmx_entry_set_stats(MatrixRmxEntry *entry, const MatrixStats *stats)
+{
+    entry->n_zeros = stats->n_zeros;
+    entry->n_nonfinite = stats->n_nonfinite;
+    entry->min = stats->min;
+    entry->max = stats->max;
+    entry->abs_min = stats->abs_min;
+    entry->abs_max = stats->abs_max;
+    entry->sum = stats->sum;
+}
+
+static inline guint64 _matrix_rmx_align(guint64 offset)
+{
+    return (offset + MATRIX_RMX_ALIGNMENT - 1) & ~(guint64)(MATRIX_RMX_ALIGNMENT - 1);
+}
+
+/* Size of the data block of a matrix with count entries, padded so that the
+ * next block is aligned. */
+static inline guint64 _matrix_rmx_block_size(guint64 count, gsize element_size)
+{
+    return _matrix_rmx_align(count * element_size);
+}
+
+gboolean matrix_rmx_check_magic(const gchar *data, gsize length)
+{
+    return length >= MATRIX_RMX_MAGIC_LENGTH &&
+        memcmp(data, MATRIX_RMX_MAGIC, MATRIX_RMX_MAGIC_LENGTH) == 0;
+}
+
+GList *matrix_rmx_read_from_file(int fd)
+{
+    GMappedFile *mapping;
+    GError *error = NULL;
+    gchar *data;
+    gsize length;
+    guint32 version, n_matrices, i;
+    MatrixRmxEntry entry;
+    Matrix *matrix;
+    GList *list = NULL;
+    guint64 count;
+    gsize element_size, entry_size;
+
+    /* read only: matrices copy mapped entries before they change them, and a
+     * writable private mapping is charged in full against the memory limit */
+    if ((mapping = g_mapped_file_new_from_fd(fd, FALSE, &error)) == NULL) {
+        g_printerr("Could not map input: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    data = g_mapped_file_get_contents(mapping);
+    length = g_mapped_file_get_length(mapping);
+
+    if (length < MATRIX_RMX_HEADER_SIZE || !matrix_rmx_check_magic(data, length)) {
+        g_printerr("Not a matrix container.\n");
+        goto done;
+    }
+
+    memcpy(&version, data + MATRIX_RMX_MAGIC_LENGTH, sizeof(guint32));
+    memcpy(&n_matrices, data + MATRIX_RMX_MAGIC_LENGTH + sizeof(guint32), sizeof(guint32));
+    version = GUINT32_FROM_LE(version);
+    n_matrices = GUINT32_FROM_LE(n_matrices);
+
+    if (version != 1 && version != MATRIX_RMX_VERSION) {
+        g_printerr("Unsupported container version %u.\n", version);
+        goto done;
+    }
+    entry_size = version == 1 ? MATRIX_RMX_ENTRY_SIZE_V1 : sizeof(MatrixRmxEntry);
+    if ((length - MATRIX_RMX_HEADER_SIZE) / entry_size < n_matrices) {
+        g_printerr("Container truncated.\n");
+        goto done;
+    }
+
+    for (i = 0; i < n_matrices; ++i) {
+        memset(&entry, 0, sizeof(MatrixRmxEntry));
+        memcpy(&entry, data + MATRIX_RMX_HEADER_SIZE + i * entry_size, entry_size);
+        _matrix_rmx_entry_swap(&entry);
+
+        if (entry.dtype == MATRIX_RMX_DTYPE_F64)
+            element_size = sizeof(double);
+        else if (entry.dtype == MATRIX_RMX_DTYPE_F32)
+            element_size = sizeof(float);
+        else {
+            g_printerr("Matrix %u: unknown data type %u. Skipping.\n", i + 1, entry.dtype);
+            continue;
+        }
+
+        if (!matrix_size_is_valid(entry.n_rows, entry.n_columns)) {
+            g_printerr("Matrix %u: too large. Skipping.\n", i + 1);
+            continue;
+        }
+        count = entry.n_rows * entry.n_columns;
+        if (entry.offset > length || count > (length - entry.offset) / element_size) {
+            g_printerr("Matrix %u: data outside of file. Skipping.\n", i + 1);
+            continue;
+        }
+
+        matrix = matrix_new();
+        matrix->n_rows = entry.n_rows;
+        matrix->n_columns = entry.n_columns;
+
+        if (G_BYTE_ORDER == G_LITTLE_ENDIAN && entry.offset % element_size == 0) {
+            matrix->precision = entry.dtype == MATRIX_RMX_DTYPE_F64 ? MATRIX_PRECISION_F64 : MATRIX_PRECISION_F32;
+            matrix_map_data(matrix, mapping, data + entry.offset, count);
+        }
+        else
+            matrix_binary_append_values(matrix, data + entry.offset, count,
+                                        entry.dtype == MATRIX_RMX_DTYPE_F64 ? MATRIX_BINARY_F64 : MATRIX_BINARY_F32, FALSE);
+
+        /* a range alone (version 1) is not enough, the statistics are collected on demand */
+        if (version != 1 && (entry.flags & MATRIX_RMX_FLAG_STATS)) {
+            _matrix_rmx_entry_get_stats(&entry, &matrix->stats, count);
+            matrix->has_stats = TRUE;
+        }
+
+        list = g_list_prepend(list, matrix);
+    }
+
+done:
+    g_mapped_file_unref(mapping);
+
+    return g_list_reverse(list);
+}
+
+static gboolean _matrix_rmx_write_zeros(FILE *file, guint64 size)
+{
+    static const gchar zeros[MATRIX_RMX_ALIGNMENT];
+    gsize n;
+
+    while (size > 0) {
+        n = size > MATRIX_RMX_ALIGNMENT ? MATRIX_RMX_ALIGNMENT : size;
+        if (fwrite(zeros, 1, n, file) != n)
+            return FALSE;
+        size -= n;
+    }
+
+    return TRUE;
+}
+
+static gboolean _matrix_rmx_write_data(FILE *file, Matrix *matrix, guint64 count)
+{
+    double buffer[MATRIX_CHUNK_SIZE];
+    guint64 offset;
+    guint32 n;
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    guint32 k;
+#else
+    if (matrix->precision == MATRIX_PRECISION_F64)
+        return fwrite(matrix->data, sizeof(double), count, file) == count;
+#endif
+
+    for (offset = 0; offset < count; offset += n) {
+        n = count - offset > MATRIX_CHUNK_SIZE ? MATRIX_CHUNK_SIZE : count - offset;
+        matrix_get_values(matrix, offset, n, buffer);
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+        for (k = 0; k < n; ++k)
+            buffer[k] = _matrix_rmx_swap_double(buffer[k]);
+#endif
+        if (fwrite(buffer, sizeof(double), n, file) != n)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Write all frames in double precision with their statistics. The frames are
+ * read one at a time, the table of entries is written after their data. */
+gboolean matrix_rmx_write_file(const gchar *filename, MatrixFrames *frames)
+{
+    FILE *file;
+    Matrix *matrix;
+    MatrixRmxEntry *entries;
+    guint32 n_matrices = matrix_frames_get_count(frames);
+    guint32 value, k;
+    guint64 offset, count, position;
+    gboolean success = TRUE;
+
+    if ((file = fopen(filename, "wb")) == NULL) {
+        g_printerr("Could not open `%s'.\n", filename);
+        return FALSE;
+    }
+
+    success &= fwrite(MATRIX_RMX_MAGIC, 1, MATRIX_RMX_MAGIC_LENGTH, file) == MATRIX_RMX_MAGIC_LENGTH;
+    value = GUINT32_TO_LE(MATRIX_RMX_VERSION);
+    success &= fwrite(&value, sizeof(guint32), 1, file) == 1;
+    value = GUINT32_TO_LE(n_matrices);
+    success &= fwrite(&value, sizeof(guint32), 1, file) == 1;
+
+    /* room for the entries */
+    position = MATRIX_RMX_HEADER_SIZE;
+    offset = _matrix_rmx_align(position + n_matrices * sizeof(MatrixRmxEntry));
+    success &= _matrix_rmx_write_zeros(file, offset - position);
+
+    entries = g_malloc0(n_matrices * sizeof(MatrixRmxEntry));
+    for (k = 0; k < n_matrices && success; ++k) {
+        if ((matrix = matrix_frames_get(frames, k)) == NULL) {
+            success = FALSE;
+            break;
+        }
+        if (matrix->storage != MATRIX_STORAGE_DENSE) {
+            g_printerr("Sparse matrices cannot be converted.\n");
+            fclose(file);
+            remove(filename);
+            g_free(entries);
+            return FALSE;
+        }
+        count = (guint64)matrix->n_rows * matrix->n_columns;
+
+        entries[k].n_rows = matrix->n_rows;
+        entries[k].n_columns = matrix->n_columns;
+        entries[k].dtype = MATRIX_RMX_DTYPE_F64;
+        entries[k].flags = MATRIX_RMX_FLAG_RANGE | MATRIX_RMX_FLAG_STATS;
+        entries[k].offset = offset;
+        _matrix_rmx_entry_set_stats(&entries[k], matrix_get_stats(matrix));
+        _matrix_rmx_entry_swap(&entries[k]);
+
+        success &= _matrix_rmx_write_data(file, matrix, count);
+        success &= _matrix_rmx_write_zeros(file, _matrix_rmx_block_size(count, sizeof(double)) - count * sizeof(double));
+        offset += _matrix_rmx_block_size(count, sizeof(double));
+    }
+
+    if (success) {
+        success &= fseek(file, MATRIX_RMX_HEADER_SIZE, SEEK_SET) == 0;
+        success &= fwrite(entries, sizeof(MatrixRmxEntry), n_matrices, file) == n_matrices;
+    }
+    g_free(entries);
+
+    if (fclose(file) != 0)
+        success = FALSE;
+
+    if (!success)
+        g_printerr("Failed to write `%s'.\n", filename);
+
+    return success;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+#include "matrix-frames.h"
+
+/* Binary container for matrices (.rmx):
+ *
+ *   header   magic "RMATRIX\n", guint32 version, guint32 n_matrices
+ *   entries  n_matrices * MatrixRmxEntry
+ *   data     one block per matrix at entry.offset, aligned to MATRIX_RMX_ALIGNMENT
+ *            bytes and padded with zeros up to the next block
+ *
+ * All numbers are little endian. Blocks are used in place, i.e. the data of the
+ * matrix points into the mapped file, and the statistics of version 2 entries
+ * are taken as they are. Version 1 entries end after max. */
+
+#define MATRIX_RMX_MAGIC "RMATRIX\n"
+#define MATRIX_RMX_MAGIC_LENGTH 8
+#define MATRIX_RMX_VERSION 2
+#define MATRIX_RMX_ALIGNMENT 4096
+
+typedef enum {
+    MATRIX_RMX_DTYPE_F64 = 1,
+    MATRIX_RMX_DTYPE_F32 = 2
+} MatrixRmxDType;
+
+typedef enum {
+    MATRIX_RMX_FLAG_RANGE = 1 << 0, /* min/max are valid */
+    MATRIX_RMX_FLAG_STATS = 1 << 1  /* all statistics are valid, see MatrixStats */
+} MatrixRmxFlags;
+
+typedef struct {
+    guint64 n_rows;
+    guint64 n_columns;
+    guint32 dtype;
+    guint32 flags;
+    guint64 offset;
+    double min;
+    double max;
+    /* version 2 */
+    double abs_min;
+    double abs_max;
+    double sum;
+    guint64 n_zeros;
+    guint64 n_nonfinite;
+} MatrixRmxEntry;
+
+gboolean matrix_rmx_check_magic(const gchar *data, gsize length);
+GList *matrix_rmx_read_from_file(int fd);
+gboolean matrix_rmx_write_file(const gchar *filename, MatrixFrames *frames);
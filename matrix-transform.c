@@ -0,0 +1,541 @@
+#include "matrix-transform.h"
+#include "util-parallel.h"
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The display transforms in one pass over the source: each row is read once,
+ * moved to its permutated position and written with all elementwise transforms
+ * applied, instead of copying the matrix and modifying it up to five times. */
+
+/* log(1+u) for u >= 0, following fdlibm: 1+u = 2^k * m with m in [sqrt(2)/2, sqrt(2)),
+ * log(m) = 2s + s*R(s^2) with s = (m-1)/(m+1). The same steps are used by the scalar
+ * and the vector version, so the result does not depend on the position of an entry. */
+#define MATRIX_LG1 6.666666666666735130e-01
+#define MATRIX_LG2 3.999999999940941908e-01
+#define MATRIX_LG3 2.857142874366239149e-01
+#define MATRIX_LG4 2.222219843214978396e-01
+#define MATRIX_LG5 1.818357216161805012e-01
+#define MATRIX_LG6 1.531383769920937332e-01
+#define MATRIX_LG7 1.479819860511658591e-01
+#define MATRIX_LN2_HI 6.93147180369123816490e-01
+#define MATRIX_LN2_LO 1.90821492927058770002e-10
+
+#define MATRIX_EXPONENT_MASK G_GUINT64_CONSTANT(0x7ff0000000000000)
+#define MATRIX_MANTISSA_MASK G_GUINT64_CONSTANT(0x000fffffffffffff)
+
+typedef void (*MatrixTransformKernel)(double *dst, const double *src, guint32 count, gint flip);
+
+/* sgn(x) * log(1+|x|); zeros, infinities and NaN are kept */
+static inline double _matrix_transform_log(double x)
+{
+    union { double d; guint64 i; } m;
+    double u = 1.0 + fabs(x);
+    double k, f, s, z, w, r, hfsq;
+
+    m.d = u;
+    if ((m.i & MATRIX_EXPONENT_MASK) == MATRIX_EXPONENT_MASK)
+        return x;
+
+    k = (double)((gint)(m.i >> 52) - 1023);
+    m.i = (m.i & MATRIX_MANTISSA_MASK) | G_GUINT64_CONSTANT(0x3ff0000000000000);
+    if (m.d > G_SQRT2) {
+        m.d *= 0.5;
+        k += 1.0;
+    }
+
+    f = m.d - 1.0;
+    s = f / (2.0 + f);
+    z = s * s;
+    w = z * z;
+    r = z * (MATRIX_LG1 + w * (MATRIX_LG3 + w * (MATRIX_LG5 + w * MATRIX_LG7)))
+        + w * (MATRIX_LG2 + w * (MATRIX_LG4 + w * MATRIX_LG6));
+    hfsq = 0.5 * f * f;
+
+    return copysign(k * MATRIX_LN2_HI - ((hfsq - (s * (hfsq + r) + k * MATRIX_LN2_LO)) - f), x);
+}
+
+static inline double _matrix_transform_signum(double x)
+{
+    return x > 0 ? 1.0 : (x < 0 ? -1.0 : 0.0);
+}
+
+static inline double _matrix_transform_value(double x, gboolean log_scale, gboolean absolute_values,
+                                             gboolean show_signum)
+{
+    if (log_scale)
+        x = _matrix_transform_log(x);
+    if (absolute_values)
+        x = fabs(x);
+    if (show_signum)
+        x = _matrix_transform_signum(x);
+
+    return x;
+}
+
+#ifdef __SSE2__
+static inline __m128d _matrix_transform_log_sse2(__m128d x)
+{
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d half = _mm_set1_pd(0.5);
+    __m128d u, m, k, big, f, s, z, w, r, hfsq, finite;
+    __m128i bits, e;
+
+    u = _mm_add_pd(one, _mm_andnot_pd(sign, x));
+    bits = _mm_castpd_si128(u);
+
+    /* the exponents are in the low halves of the two lanes */
+    e = _mm_sub_epi64(_mm_srli_epi64(bits, 52), _mm_set1_epi64x(1023));
+    k = _mm_cvtepi32_pd(_mm_shuffle_epi32(e, _MM_SHUFFLE(3, 3, 2, 0)));
+    m = _mm_castsi128_pd(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi64x(MATRIX_MANTISSA_MASK)),
+                                      _mm_castpd_si128(one)));
+    big = _mm_cmpgt_pd(m, _mm_set1_pd(G_SQRT2));
+    m = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(m, half)), _mm_andnot_pd(big, m));
+    k = _mm_add_pd(k, _mm_and_pd(big, one));
+
+    f = _mm_sub_pd(m, one);
+    s = _mm_div_pd(f, _mm_add_pd(_mm_set1_pd(2.0), f));
+    z = _mm_mul_pd(s, s);
+    w = _mm_mul_pd(z, z);
+    r = _mm_add_pd(
+            _mm_mul_pd(z, _mm_add_pd(_mm_set1_pd(MATRIX_LG1),
+                          _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(MATRIX_LG3),
+                          _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(MATRIX_LG5),
+                          _mm_mul_pd(w, _mm_set1_pd(MATRIX_LG7)))))))),
+            _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(MATRIX_LG2),
+                          _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(MATRIX_LG4),
+                          _mm_mul_pd(w, _mm_set1_pd(MATRIX_LG6)))))));
+    hfsq = _mm_mul_pd(half, _mm_mul_pd(f, f));
+
+    r = _mm_add_pd(hfsq, r);
+    r = _mm_add_pd(_mm_mul_pd(s, r), _mm_mul_pd(k, _mm_set1_pd(MATRIX_LN2_LO)));
+    r = _mm_sub_pd(_mm_sub_pd(hfsq, r), f);
+    r = _mm_sub_pd(_mm_mul_pd(k, _mm_set1_pd(MATRIX_LN2_HI)), r);
+
+    /* infinities and NaN are passed through */
+    finite = _mm_cmplt_pd(u, _mm_set1_pd(INFINITY));
+    r = _mm_or_pd(_mm_and_pd(finite, r), _mm_andnot_pd(finite, u));
+
+    return _mm_or_pd(r, _mm_and_pd(sign, x));
+}
+
+static inline __m128d _matrix_transform_value_sse2(__m128d x, gboolean log_scale, gboolean absolute_values,
+                                                   gboolean show_signum)
+{
+    const __m128d zero = _mm_setzero_pd();
+
+    if (log_scale)
+        x = _matrix_transform_log_sse2(x);
+    if (absolute_values)
+        x = _mm_andnot_pd(_mm_set1_pd(-0.0), x);
+    if (show_signum)
+        x = _mm_or_pd(_mm_and_pd(_mm_cmpgt_pd(x, zero), _mm_set1_pd(1.0)),
+                      _mm_and_pd(_mm_cmplt_pd(x, zero), _mm_set1_pd(-1.0)));
+
+    return x;
+}
+#endif
+
+/* Transform count values; if flip is 0 or 1, the entries with j % 2 == flip are
+ * negated first. dst may be equal to src. */
+static inline void _matrix_transform_kernel(double *dst, const double *src, guint32 count, gint flip,
+                                            gboolean log_scale, gboolean absolute_values, gboolean show_signum)
+{
+    guint32 j = 0;
+    double x;
+
+#ifdef __SSE2__
+    const __m128d negate = _mm_set_pd(flip == 1 ? -0.0 : 0.0, flip == 0 ? -0.0 : 0.0);
+
+    for (; j + 2 <= count; j += 2)
+        _mm_storeu_pd(dst + j, _matrix_transform_value_sse2(_mm_xor_pd(_mm_loadu_pd(src + j), negate),
+                                                            log_scale, absolute_values, show_signum));
+#endif
+
+    for (; j < count; ++j) {
+        x = (gint)(j % 2) == flip ? -src[j] : src[j];
+        dst[j] = _matrix_transform_value(x, log_scale, absolute_values, show_signum);
+    }
+}
+
+/* one kernel for each combination of the elementwise transforms */
+#define MATRIX_TRANSFORM_KERNEL(name, log_scale, absolute_values, show_signum) \
+    static void name(double *dst, const double *src, guint32 count, gint flip) \
+    { \
+        _matrix_transform_kernel(dst, src, count, flip, log_scale, absolute_values, show_signum); \
+    }
+
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_none, FALSE, FALSE, FALSE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_l, TRUE, FALSE, FALSE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_a, FALSE, TRUE, FALSE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_la, TRUE, TRUE, FALSE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_s, FALSE, FALSE, TRUE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_ls, TRUE, FALSE, TRUE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_as, FALSE, TRUE, TRUE)
+MATRIX_TRANSFORM_KERNEL(_matrix_transform_las, TRUE, TRUE, TRUE)
+
+#undef MATRIX_TRANSFORM_KERNEL
+
+static MatrixTransformKernel _matrix_transform_get_kernel(const MatrixTransform *transform)
+{
+    static const MatrixTransformKernel kernels[8] = {
+        _matrix_transform_none, _matrix_transform_l, _matrix_transform_a, _matrix_transform_la,
+        _matrix_transform_s, _matrix_transform_ls, _matrix_transform_as, _matrix_transform_las
+    };
+
+    return kernels[(transform->log_scale ? 1 : 0) | (transform->absolute_values ? 2 : 0) |
+                   (transform->show_signum ? 4 : 0)];
+}
+
+/* Apply the elementwise transforms (log scale, absolute values, signum) to count
+ * values. dst may be equal to src. */
+void matrix_transform_values(double *dst, const double *src, guint32 count, const MatrixTransform *transform)
+{
+    if (matrix_transform_is_identity(transform)) {
+        if (dst != src)
+            memcpy(dst, src, count * sizeof(double));
+        return;
+    }
+    _matrix_transform_get_kernel(transform)(dst, src, count, -1);
+}
+
+/* Entries with j % 2 == flip are negated in row r, or none for -1. The signs
+ * alternate after the log scale, which is odd, and vanish with |x|. */
+static inline gint _matrix_transform_flip(const MatrixTransform *transform, guint32 r)
+{
+    if (!transform->alternate_signs || transform->absolute_values)
+        return -1;
+
+    return (r + (transform->shift_signs ? 0 : 1)) % 2;
+}
+
+/* count entries of a source row or column, which becomes row or column r,
+ * transformed into out. span tells the expression, if any, where the source
+ * line lies. */
+static void _matrix_transform_line(const double *in, guint32 count, guint32 r, double *out,
+                                   const MatrixTransform *transform, MatrixTransformKernel kernel,
+                                   MatrixExpressionSpan *span)
+{
+    guint32 j, oj = (count + 1) / 2;
+
+    if (transform->permutate_entries) {
+        for (j = 0; j < count; ++j)
+            out[j % 2 ? j/2 + oj : j/2] = in[j];
+        in = out;
+
+        /* the even source positions, then the odd ones */
+        if (transform->expression) {
+            span->first = 0;
+            span->step = 2;
+            matrix_expression_eval(transform->expression, out, out, oj, span);
+            span->first = 1;
+            matrix_expression_eval(transform->expression, out + oj, out + oj, count - oj, span);
+        }
+    }
+    else if (transform->expression) {
+        span->first = 0;
+        span->step = 1;
+        matrix_expression_eval(transform->expression, out, in, count, span);
+        in = out;
+    }
+
+    /* the sign pattern is symmetric, so a column flips like the row of that index */
+    kernel(out, in, count, _matrix_transform_flip(transform, r));
+}
+
+/* Source row i, which becomes row r, transformed into out. */
+static void _matrix_transform_row(Matrix *src, guint32 i, guint32 r, double *out, double *scratch,
+                                  const MatrixTransform *transform, MatrixTransformKernel kernel)
+{
+    MatrixExpressionSpan span = { src->n_rows, src->n_columns, i, FALSE, 0, 1, NULL };
+
+    _matrix_transform_line(matrix_row(src, i, scratch), src->n_columns, r, out, transform, kernel, &span);
+}
+
+/* The expression on the entries of each row in place; sparse rows pass the
+ * columns of their stored entries. */
+static void _matrix_transform_expression_row(double *values, guint32 count, guint32 row, gpointer userdata)
+{
+    Matrix *matrix = ((gpointer *)userdata)[0];
+    MatrixExpressionSpan span = { matrix->n_rows, matrix->n_columns, row, FALSE, 0, 1, NULL };
+
+    if (matrix->storage == MATRIX_STORAGE_CSR)
+        span.positions = matrix->column_indices + (values - matrix->values);
+
+    matrix_expression_eval(((gpointer *)userdata)[1], values, values, count, &span);
+}
+
+static void _matrix_transform_sequential(Matrix *dst, Matrix *src, const MatrixTransform *transform)
+{
+    gpointer expression_data[2] = { dst, transform->expression };
+
+    matrix_copy(dst, src);
+    if (transform->expression)
+        matrix_foreach_row(dst, _matrix_transform_expression_row, expression_data);
+    if (transform->log_scale)
+        matrix_log_scale(dst);
+    if (transform->permutate_entries)
+        matrix_permutate_matrix(dst);
+    if (transform->alternate_signs)
+        matrix_alternate_signs(dst, transform->shift_signs);
+    if (transform->absolute_values)
+        matrix_set_absolute(dst);
+    if (transform->show_signum)
+        matrix_set_signum(dst);
+}
+
+typedef struct {
+    Matrix *src;
+    Matrix *dst;
+    const MatrixTransform *transform;
+    MatrixTransformKernel kernel;
+    gboolean store;
+    MatrixStats *stats;
+} MatrixTransformBands;
+
+/* Source rows [begin, end): store them in dst, or only collect the statistics
+ * of the new values. Double precision results are written in place and their
+ * statistics are collected as well. */
+static void _matrix_transform_band(guint64 begin, guint64 end, guint band, MatrixTransformBands *bands)
+{
+    Matrix *src = bands->src, *dst = bands->dst;
+    guint32 n_columns = src->n_columns, oi = (src->n_rows + 1) / 2;
+    double *scratch = g_malloc(n_columns * sizeof(double));
+    double *row = g_malloc(n_columns * sizeof(double));
+    double *out;
+    guint32 i, r;
+
+    matrix_stats_init(bands->stats + band);
+
+    for (i = begin; i < end; ++i) {
+        r = bands->transform->permutate_entries ? (i % 2 ? i/2 + oi : i/2) : i;
+        out = bands->store && src->precision == MATRIX_PRECISION_F64 ?
+            (double *)dst->data + (guint64)r * n_columns : row;
+        _matrix_transform_row(src, i, r, out, scratch, bands->transform, bands->kernel);
+        if (!bands->store || src->precision == MATRIX_PRECISION_F64)
+            matrix_stats_update(bands->stats + band, out, n_columns);
+        else
+            matrix_set_values(dst, (guint64)r * n_columns, n_columns, out);
+    }
+
+    g_free(scratch);
+    g_free(row);
+}
+
+static void _matrix_transform_bands_init(MatrixTransformBands *bands, Matrix *dst, Matrix *src,
+                                         const MatrixTransform *transform)
+{
+    bands->src = src;
+    bands->dst = dst;
+    bands->transform = transform;
+    bands->kernel = _matrix_transform_get_kernel(transform);
+    bands->store = FALSE;
+    bands->stats = NULL;
+}
+
+/* Process all rows in bands on util_parallel_get_threads() threads; stats
+ * summarizes the values the bands collected. */
+static void _matrix_transform_run(MatrixTransformBands *bands, MatrixStats *stats)
+{
+    guint n_bands = util_parallel_get_bands(bands->src->n_rows, bands->src->n_columns);
+    guint k;
+
+    bands->stats = g_malloc(n_bands * sizeof(MatrixStats));
+    util_parallel_for(bands->src->n_rows, n_bands, (UtilParallelFunc)_matrix_transform_band, bands);
+
+    matrix_stats_init(stats);
+    for (k = 0; k < n_bands; ++k)
+        matrix_stats_merge(stats, bands->stats + k);
+
+    g_free(bands->stats);
+    bands->stats = NULL;
+}
+
+gboolean matrix_transform_is_identity(const MatrixTransform *transform)
+{
+    return !transform || !(transform->log_scale || transform->permutate_entries || transform->alternate_signs ||
+                           transform->absolute_values || transform->show_signum || transform->expression);
+}
+
+/* Whether zeros stay zero: the built-in transforms keep them, an expression
+ * may not, see matrix_expression_keeps_zero(). */
+gboolean matrix_transform_keeps_zeros(const MatrixTransform *transform)
+{
+    return !transform || matrix_expression_keeps_zero(transform->expression);
+}
+
+/* dst becomes src with the transforms applied; dst keeps the precision of src.
+ * Sparse matrices become dense (in double precision) if the transforms change
+ * their zeros. */
+void matrix_transform(Matrix *dst, Matrix *src, const MatrixTransform *transform)
+{
+    MatrixTransformBands bands;
+    MatrixPrecision precision = src->precision;
+    MatrixStats stats;
+    double min = 0.0, max = 0.0;
+
+    if (matrix_transform_is_identity(transform)) {
+        matrix_copy(dst, src);
+        return;
+    }
+
+    /* sparse matrices keep their structure if the transforms keep their zeros,
+     * and the passes handle them one by one */
+    if (src->storage == MATRIX_STORAGE_CSR && !matrix_transform_keeps_zeros(transform) &&
+            dst != src && matrix_size_is_valid(src->n_rows, src->n_columns)) {
+        precision = MATRIX_PRECISION_F64;
+    }
+    else if (dst == src || src->storage == MATRIX_STORAGE_CSR) {
+        if (src->storage == MATRIX_STORAGE_CSR && !matrix_transform_keeps_zeros(transform))
+            g_printerr("Transform `%s' changes zeros, but the sparse matrix cannot be made dense; "
+                       "only its stored entries are transformed.\n",
+                       matrix_expression_get_text(transform->expression));
+        _matrix_transform_sequential(dst, src, transform);
+        return;
+    }
+
+    _matrix_transform_bands_init(&bands, dst, src, transform);
+
+    /* quantized: the scale depends on the range of the new values */
+    if (precision == MATRIX_PRECISION_Q16 || precision == MATRIX_PRECISION_Q8) {
+        _matrix_transform_run(&bands, &stats);
+        matrix_stats_get_range(&stats, &min, &max);
+    }
+
+    matrix_init_dense(dst, src->n_rows, src->n_columns, precision, min, max);
+
+    bands.store = TRUE;
+    _matrix_transform_run(&bands, &stats);
+
+    if (precision == MATRIX_PRECISION_F64) {
+        dst->stats = stats;
+        dst->has_stats = TRUE;
+    }
+}
+
+/* Range of the transformed matrix from the statistics of src alone, if they
+ * determine it: the log scale and signum keep the order of the entries, absolute
+ * values take the range of |x|, and the permutation moves entries only. The
+ * alternating signs do not follow from the statistics, and neither does signum
+ * of NaN, which becomes zero. Returns FALSE if the entries have to be scanned. */
+gboolean matrix_transform_derive_range(Matrix *src, const MatrixTransform *transform, double *min, double *max)
+{
+    const MatrixStats *stats;
+    double lo, hi, abs_lo, abs_hi;
+
+    if (matrix_transform_is_identity(transform)) {
+        matrix_get_range(src, min, max);
+        return TRUE;
+    }
+    if (transform->expression || (transform->alternate_signs && !transform->absolute_values))
+        return FALSE;
+
+    stats = matrix_get_stats(src);
+    if (transform->show_signum && stats->n_nonfinite)
+        return FALSE;
+
+    matrix_stats_get_range(stats, &lo, &hi);
+    abs_lo = stats->abs_min <= stats->abs_max ? stats->abs_min : 0.0;
+    abs_hi = stats->abs_min <= stats->abs_max ? stats->abs_max : 0.0;
+
+    if (transform->log_scale) {
+        lo = _matrix_transform_log(lo);
+        hi = _matrix_transform_log(hi);
+        abs_lo = _matrix_transform_log(abs_lo);
+        abs_hi = _matrix_transform_log(abs_hi);
+    }
+    if (transform->absolute_values) {
+        lo = abs_lo;
+        hi = abs_hi;
+    }
+    if (transform->show_signum) {
+        lo = _matrix_transform_signum(lo);
+        hi = _matrix_transform_signum(hi);
+    }
+
+    if (min)
+        *min = lo;
+    if (max)
+        *max = hi;
+
+    return TRUE;
+}
+
+/* Range of the transformed matrix without storing it. */
+void matrix_transform_get_range(Matrix *src, const MatrixTransform *transform, double *min, double *max)
+{
+    MatrixTransformBands bands;
+    MatrixStats stats;
+    Matrix *tmp;
+
+    if (matrix_transform_derive_range(src, transform, min, max))
+        return;
+
+    if (src->storage == MATRIX_STORAGE_CSR) {
+        tmp = matrix_new();
+        matrix_transform(tmp, src, transform);
+        matrix_get_range(tmp, min, max);
+        matrix_free(tmp);
+        return;
+    }
+
+    _matrix_transform_bands_init(&bands, NULL, src, transform);
+    _matrix_transform_run(&bands, &stats);
+    matrix_stats_get_range(&stats, min, max);
+}
+
+/* Row (or column) k of the transformed matrix of n rows comes from this source
+ * row (or column). */
+guint32 matrix_transform_source_index(const MatrixTransform *transform, guint32 k, guint32 n)
+{
+    guint32 o = (n + 1) / 2;
+
+    if (!transform || !transform->permutate_entries)
+        return k;
+
+    /* even/odd permutation */
+    return k < o ? 2 * k : 2 * (k - o) + 1;
+}
+
+/* The source row (or column, if is_column) in of a matrix of n_rows and
+ * n_columns, transformed into row (or column) index. Returns out, or in if
+ * nothing changes it. */
+const double *matrix_transform_line(const double *in, guint32 n_rows, guint32 n_columns, guint32 index,
+                                    gboolean is_column, const MatrixTransform *transform, double *out)
+{
+    MatrixExpressionSpan span = { n_rows, n_columns, 0, is_column, 0, 1, NULL };
+
+    if (matrix_transform_is_identity(transform))
+        return in;
+
+    span.index = matrix_transform_source_index(transform, index, is_column ? n_columns : n_rows);
+    _matrix_transform_line(in, is_column ? n_rows : n_columns, index, out, transform,
+                           _matrix_transform_get_kernel(transform), &span);
+
+    return out;
+}
+
+/* Row of the transformed matrix; out and scratch hold n_columns values. The
+ * result is in out, or in scratch or src itself if nothing changes the row. */
+const double *matrix_transform_row(Matrix *src, guint32 row, const MatrixTransform *transform,
+                                   double *out, double *scratch)
+{
+    guint32 i = matrix_transform_source_index(transform, row, src->n_rows);
+
+    return matrix_transform_line(matrix_row(src, i, scratch), src->n_rows, src->n_columns, row, FALSE,
+                                 transform, out);
+}
+
+/* Column of the transformed matrix; out and scratch hold n_rows values. */
+const double *matrix_transform_column(Matrix *src, guint32 column, const MatrixTransform *transform,
+                                      double *out, double *scratch)
+{
+    guint32 j = matrix_transform_source_index(transform, column, src->n_columns);
+
+    return matrix_transform_line(matrix_column(src, j, scratch), src->n_rows, src->n_columns, column, TRUE,
+                                 transform, out);
+}
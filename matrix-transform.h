@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+#include "matrix-expression.h"
+
+/* Display transforms, applied in this order: a custom expression, log scale,
+ * permutation of the entries, alternating signs, absolute values, signum.
+ * Functions taking a transform accept NULL for none. */
+typedef struct {
+    gboolean log_scale;
+    gboolean permutate_entries;
+    gboolean alternate_signs;
+    gboolean shift_signs;
+    gboolean absolute_values;
+    gboolean show_signum;
+    /* of the entry and its position in the untransformed matrix; sparse
+     * matrices become dense if it changes their zeros. Not owned. */
+    MatrixExpression *expression;
+} MatrixTransform;
+
+gboolean matrix_transform_is_identity(const MatrixTransform *transform);
+gboolean matrix_transform_keeps_zeros(const MatrixTransform *transform);
+void matrix_transform_values(double *dst, const double *src, guint32 count, const MatrixTransform *transform);
+void matrix_transform(Matrix *dst, Matrix *src, const MatrixTransform *transform);
+gboolean matrix_transform_derive_range(Matrix *src, const MatrixTransform *transform, double *min, double *max);
+void matrix_transform_get_range(Matrix *src, const MatrixTransform *transform, double *min, double *max);
+guint32 matrix_transform_source_index(const MatrixTransform *transform, guint32 k, guint32 n);
+const double *matrix_transform_line(const double *in, guint32 n_rows, guint32 n_columns, guint32 index,
+                                    gboolean is_column, const MatrixTransform *transform, double *out);
+const double *matrix_transform_row(Matrix *src, guint32 row, const MatrixTransform *transform,
+                                   double *out, double *scratch);
+const double *matrix_transform_column(Matrix *src, guint32 column, const MatrixTransform *transform,
+                                      double *out, double *scratch);
@@ -0,0 +1,419 @@
+#include "matrix-view.h"
+#include "util-parallel.h"
+#include <string.h>
+#include <math.h>
+
+/* most recently used first */
+static MatrixView *matrix_view_cache[MATRIX_VIEW_CACHE_SIZE];
+G_LOCK_DEFINE_STATIC(matrix_view_cache);
+
+static void _matrix_view_normalize(MatrixTransform *dst, const MatrixTransform *src)
+{
+    memset(dst, 0, sizeof(MatrixTransform));
+    if (!src)
+        return;
+
+    dst->log_scale = !!src->log_scale;
+    dst->permutate_entries = !!src->permutate_entries;
+    dst->alternate_signs = !!src->alternate_signs;
+    dst->shift_signs = !!src->shift_signs;
+    dst->absolute_values = !!src->absolute_values;
+    dst->show_signum = !!src->show_signum;
+    dst->expression = src->expression;
+}
+
+/* The indices of slice below n, with the end right after the last one. */
+static guint32 _matrix_view_clip(MatrixSlice *dst, const MatrixSlice *src, guint32 n)
+{
+    guint32 count = matrix_slice_count(src, n);
+
+    dst->begin = count ? src->begin : 0;
+    dst->step = count > 1 ? src->step : 1;
+    dst->end = dst->begin + (count ? (count - 1) * dst->step + 1 : 0);
+
+    return count;
+}
+
+static void _matrix_view_clip_region(MatrixRegion *dst, const MatrixRegion *src, Matrix *source)
+{
+    if (!src) {
+        matrix_region_init(dst);
+        src = dst;
+    }
+
+    _matrix_view_clip(&dst->rows, &src->rows, source->n_rows);
+    _matrix_view_clip(&dst->columns, &src->columns, source->n_columns);
+}
+
+/* A view outside of the cache, e.g. of a temporary matrix. region may be NULL
+ * for the whole matrix. */
+MatrixView *matrix_view_new(Matrix *source, const MatrixRegion *region, const MatrixTransform *transform)
+{
+    MatrixView *view = g_malloc0(sizeof(MatrixView));
+
+    view->source = source;
+    _matrix_view_normalize(&view->transform, transform);
+    _matrix_view_clip_region(&view->region, region, source);
+    view->n_rows = matrix_slice_count(&view->region.rows, source->n_rows);
+    view->n_columns = matrix_slice_count(&view->region.columns, source->n_columns);
+    view->is_sliced = !matrix_region_is_all(&view->region, source->n_rows, source->n_columns);
+    view->ref_count = 1;
+
+    return view;
+}
+
+/* View of a region (NULL for all) of source through transform (NULL for none)
+ * from the cache. Returns a new reference. Cached views keep pointing to their
+ * source, so the cache has to be cleared before sources are freed. */
+MatrixView *matrix_view_get(Matrix *source, const MatrixRegion *region, const MatrixTransform *transform)
+{
+    MatrixTransform key;
+    MatrixRegion key_region;
+    MatrixView *view = NULL;
+    guint k;
+
+    g_return_val_if_fail(source != NULL, NULL);
+
+    _matrix_view_normalize(&key, transform);
+    _matrix_view_clip_region(&key_region, region, source);
+
+    G_LOCK(matrix_view_cache);
+
+    for (k = 0; k < MATRIX_VIEW_CACHE_SIZE && matrix_view_cache[k]; ++k) {
+        if (matrix_view_cache[k]->source == source &&
+                memcmp(&matrix_view_cache[k]->transform, &key, sizeof(MatrixTransform)) == 0 &&
+                memcmp(&matrix_view_cache[k]->region, &key_region, sizeof(MatrixRegion)) == 0) {
+            view = matrix_view_cache[k];
+            break;
+        }
+    }
+
+    if (!view) {
+        /* drop the least recently used one */
+        k = MATRIX_VIEW_CACHE_SIZE - 1;
+        matrix_view_unref(matrix_view_cache[k]);
+        view = matrix_view_new(source, &key_region, &key);
+    }
+
+    memmove(matrix_view_cache + 1, matrix_view_cache, k * sizeof(MatrixView *));
+    matrix_view_cache[0] = view;
+
+    G_UNLOCK(matrix_view_cache);
+
+    return matrix_view_ref(view);
+}
+
+MatrixView *matrix_view_ref(MatrixView *view)
+{
+    if (view)
+        g_atomic_int_inc(&view->ref_count);
+
+    return view;
+}
+
+void matrix_view_unref(MatrixView *view)
+{
+    if (!view || !g_atomic_int_dec_and_test(&view->ref_count))
+        return;
+
+    matrix_free(view->matrix);
+    util_sketch_free(view->sketch);
+    g_free(view);
+}
+
+/* Forget all cached views, e.g. before the sources are freed. */
+void matrix_view_cache_clear(void)
+{
+    guint k;
+
+    G_LOCK(matrix_view_cache);
+    for (k = 0; k < MATRIX_VIEW_CACHE_SIZE; ++k) {
+        matrix_view_unref(matrix_view_cache[k]);
+        matrix_view_cache[k] = NULL;
+    }
+    G_UNLOCK(matrix_view_cache);
+}
+
+/* Forget the cached views of source, e.g. before it is freed. */
+void matrix_view_cache_remove(Matrix *source)
+{
+    guint k, n;
+
+    G_LOCK(matrix_view_cache);
+    for (k = 0, n = 0; k < MATRIX_VIEW_CACHE_SIZE; ++k) {
+        if (matrix_view_cache[k] && matrix_view_cache[k]->source == source)
+            matrix_view_unref(matrix_view_cache[k]);
+        else
+            matrix_view_cache[n++] = matrix_view_cache[k];
+    }
+    for ( ; n < MATRIX_VIEW_CACHE_SIZE; ++n)
+        matrix_view_cache[n] = NULL;
+    G_UNLOCK(matrix_view_cache);
+}
+
+/* Source row i of the region, in place if possible. */
+static const double *_matrix_view_source_row(MatrixView *view, guint32 i, double *values)
+{
+    Matrix *m = view->source;
+    guint64 index = (guint64)(view->region.rows.begin + i * view->region.rows.step) * m->n_columns +
+                    view->region.columns.begin;
+
+    if (m->precision == MATRIX_PRECISION_F64 && view->region.columns.step == 1)
+        return (const double *)m->data + index;
+
+    matrix_get_strided(m, index, view->region.columns.step, view->n_columns, values);
+
+    return values;
+}
+
+/* Source column j of the region. */
+static const double *_matrix_view_source_column(MatrixView *view, guint32 j, double *values)
+{
+    Matrix *m = view->source;
+    guint64 index = (guint64)view->region.rows.begin * m->n_columns +
+                    view->region.columns.begin + j * view->region.columns.step;
+
+    matrix_get_strided(m, index, (guint64)view->region.rows.step * m->n_columns, view->n_rows, values);
+
+    return values;
+}
+
+/* The region as a matrix of its own: sparse ones keep their structure, dense
+ * ones are gathered in double precision. */
+static Matrix *_matrix_view_dup_region(MatrixView *view)
+{
+    Matrix *m;
+    double *row;
+    guint32 i;
+
+    if (view->source->storage == MATRIX_STORAGE_CSR) {
+        m = matrix_dup(view->source);
+        matrix_slice(m, &view->region);
+        return m;
+    }
+
+    m = matrix_new();
+    matrix_init_dense(m, view->n_rows, view->n_columns, MATRIX_PRECISION_F64, 0.0, 0.0);
+    row = g_malloc(view->n_columns * sizeof(double));
+    for (i = 0; i < view->n_rows; ++i)
+        matrix_set_values(m, (guint64)i * view->n_columns, view->n_columns,
+                          _matrix_view_source_row(view, i, row));
+    g_free(row);
+
+    return m;
+}
+
+/* The transformed matrix as a whole: the source itself if nothing changes it.
+ * Only sparse sources are transformed (once) this way; dense ones are copied,
+ * which the row and column functions avoid. */
+Matrix *matrix_view_get_matrix(MatrixView *view)
+{
+    Matrix *region;
+
+    if (!view->is_sliced && matrix_transform_is_identity(&view->transform))
+        return view->source;
+
+    if (!view->matrix) {
+        region = view->is_sliced ? _matrix_view_dup_region(view) : view->source;
+        if (matrix_transform_is_identity(&view->transform)) {
+            view->matrix = region;
+            return view->matrix;
+        }
+        view->matrix = matrix_new();
+        matrix_transform(view->matrix, region, &view->transform);
+        if (region != view->source)
+            matrix_free(region);
+    }
+
+    return view->matrix;
+}
+
+/* Whether the view keeps the sparse structure of its source, which transforms
+ * that change zeros do not, see matrix_transform(). */
+gboolean matrix_view_is_sparse(MatrixView *view)
+{
+    return view->source->storage == MATRIX_STORAGE_CSR &&
+        matrix_view_get_matrix(view)->storage == MATRIX_STORAGE_CSR;
+}
+
+/* Row of the view; out and scratch hold n_columns values. */
+const double *matrix_view_row(MatrixView *view, guint32 row, double *out, double *scratch)
+{
+    guint32 i;
+
+    if (view->source->storage == MATRIX_STORAGE_CSR)
+        return matrix_row(matrix_view_get_matrix(view), row, scratch);
+
+    if (!view->is_sliced)
+        return matrix_transform_row(view->source, row, &view->transform, out, scratch);
+
+    i = matrix_transform_source_index(&view->transform, row, view->n_rows);
+
+    return matrix_transform_line(_matrix_view_source_row(view, i, scratch), view->n_rows, view->n_columns, row,
+                                 FALSE, &view->transform, out);
+}
+
+/* Column of the view; out and scratch hold n_rows values. */
+const double *matrix_view_column(MatrixView *view, guint32 column, double *out, double *scratch)
+{
+    guint32 j;
+
+    if (view->source->storage == MATRIX_STORAGE_CSR)
+        return matrix_column(matrix_view_get_matrix(view), column, scratch);
+
+    if (!view->is_sliced)
+        return matrix_transform_column(view->source, column, &view->transform, out, scratch);
+
+    j = matrix_transform_source_index(&view->transform, column, view->n_columns);
+
+    return matrix_transform_line(_matrix_view_source_column(view, j, scratch), view->n_rows, view->n_columns,
+                                 column, TRUE, &view->transform, out);
+}
+
+typedef struct {
+    MatrixView *view;
+    MatrixStats *stats;
+} MatrixViewStatsBands;
+
+static void _matrix_view_stats_band(guint64 begin, guint64 end, guint band, MatrixViewStatsBands *bands)
+{
+    MatrixView *view = bands->view;
+    double *out = g_malloc(view->n_columns * sizeof(double));
+    double *scratch = g_malloc(view->n_columns * sizeof(double));
+    guint32 i;
+
+    matrix_stats_init(bands->stats + band);
+    for (i = begin; i < end; ++i)
+        matrix_stats_update(bands->stats + band, matrix_view_row(view, i, out, scratch), view->n_columns);
+
+    g_free(out);
+    g_free(scratch);
+}
+
+/* Range of a dense region, row by row in bands. */
+static void _matrix_view_scan_range(MatrixView *view, double *min, double *max)
+{
+    MatrixViewStatsBands bands = { view, NULL };
+    guint n_bands = util_parallel_get_bands(view->n_rows, view->n_columns);
+    MatrixStats stats;
+    guint k;
+
+    bands.stats = g_malloc(n_bands * sizeof(MatrixStats));
+    util_parallel_for(view->n_rows, n_bands, (UtilParallelFunc)_matrix_view_stats_band, &bands);
+
+    matrix_stats_init(&stats);
+    for (k = 0; k < n_bands; ++k)
+        matrix_stats_merge(&stats, bands.stats + k);
+    matrix_stats_get_range(&stats, min, max);
+
+    g_free(bands.stats);
+}
+
+/* The range of the whole source follows from its statistics for most
+ * transforms, see matrix_transform_derive_range(). */
+void matrix_view_get_range(MatrixView *view, double *min, double *max)
+{
+    if (!view->has_range) {
+        if (view->source->storage == MATRIX_STORAGE_DENSE && view->is_sliced)
+            _matrix_view_scan_range(view, &view->range[0], &view->range[1]);
+        else if (view->source->storage == MATRIX_STORAGE_DENSE)
+            matrix_transform_get_range(view->source, &view->transform, &view->range[0], &view->range[1]);
+        else if (view->is_sliced ||
+                 !matrix_transform_derive_range(view->source, &view->transform, &view->range[0], &view->range[1]))
+            matrix_get_range(matrix_view_get_matrix(view), &view->range[0], &view->range[1]);
+        view->has_range = TRUE;
+    }
+
+    if (min)
+        *min = view->range[0];
+    if (max)
+        *max = view->range[1];
+}
+
+typedef struct {
+    MatrixView *view;
+    guint32 block_rows;
+    UtilSketch **sketches;
+} MatrixViewSketchBands;
+
+/* One sketch for each block of block_rows rows in [begin, end). */
+static void _matrix_view_sketch_band(guint64 begin, guint64 end, guint band, MatrixViewSketchBands *bands)
+{
+    MatrixView *view = bands->view;
+    double *out = g_malloc(view->n_columns * sizeof(double));
+    double *scratch = g_malloc(view->n_columns * sizeof(double));
+    guint32 i, last;
+    guint64 k;
+
+    for (k = begin; k < end; ++k) {
+        bands->sketches[k] = util_sketch_new();
+        last = MIN((k + 1) * bands->block_rows, view->n_rows);
+        for (i = k * bands->block_rows; i < last; ++i)
+            util_sketch_add(bands->sketches[k], matrix_view_row(view, i, out, scratch), view->n_columns);
+        util_sketch_compress(bands->sketches[k]);
+    }
+
+    g_free(out);
+    g_free(scratch);
+}
+
+/* Sketch of all entries in one pass. Dense views are sketched in blocks of a
+ * fixed number of rows, which are merged in order afterwards, so the result
+ * does not depend on the number of threads. */
+static UtilSketch *_matrix_view_build_sketch(MatrixView *view)
+{
+    MatrixViewSketchBands bands = { view, 0, NULL };
+    UtilSketch *sketch = util_sketch_new();
+    Matrix *m;
+    guint64 n_blocks, k;
+
+    if (matrix_view_is_sparse(view)) {
+        m = matrix_view_get_matrix(view);
+        util_sketch_add(sketch, m->values, m->nnz);
+        util_sketch_add_weighted(sketch, 0.0, (double)((guint64)m->n_rows * m->n_columns - m->nnz));
+        return sketch;
+    }
+
+    if (view->n_columns == 0)
+        return sketch;
+
+    bands.block_rows = MAX(UTIL_PARALLEL_MIN_WORK / view->n_columns, 1);
+    n_blocks = (view->n_rows + bands.block_rows - 1) / bands.block_rows;
+    bands.sketches = g_malloc(n_blocks * sizeof(UtilSketch *));
+    util_parallel_for(n_blocks, util_parallel_get_bands(n_blocks, (guint64)bands.block_rows * view->n_columns),
+                      (UtilParallelFunc)_matrix_view_sketch_band, &bands);
+
+    for (k = 0; k < n_blocks; ++k) {
+        util_sketch_merge(sketch, bands.sketches[k]);
+        util_sketch_free(bands.sketches[k]);
+    }
+    g_free(bands.sketches);
+
+    return sketch;
+}
+
+/* Range from the given percentile of the entries up to 100 minus it, e.g. 1
+ * for all but the lowest and highest percent; 0 is the whole range. Non-finite
+ * entries are left out. The quantiles are estimated from a sketch, which is
+ * built once per view. */
+void matrix_view_get_percentile_range(MatrixView *view, double percentile, double *min, double *max)
+{
+    double lo, hi;
+
+    matrix_view_get_range(view, min, max);
+    if (percentile <= 0.0)
+        return;
+
+    if (!view->sketch)
+        view->sketch = _matrix_view_build_sketch(view);
+
+    lo = util_sketch_quantile(view->sketch, percentile / 100.0);
+    hi = util_sketch_quantile(view->sketch, 1.0 - percentile / 100.0);
+    if (isnan(lo) || isnan(hi))
+        return;
+
+    if (min)
+        *min = lo;
+    if (max)
+        *max = hi;
+}
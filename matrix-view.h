@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glib.h>
+#include "matrix.h"
+#include "matrix-transform.h"
+#include "util-sketch.h"
+
+/* A region of a source matrix as seen through a transform. Dense entries are
+ * gathered and transformed when a row or column is requested, nothing is
+ * copied. The range is computed once per view (without a scan if it follows
+ * from the statistics of the source), and views are kept in a small
+ * cache keyed by source, region and transform, so returning to an earlier frame
+ * or setting does not scan the matrix again. Sources must not change while
+ * views of them exist. */
+
+#define MATRIX_VIEW_CACHE_SIZE 8
+
+typedef struct {
+    Matrix *source;
+    MatrixTransform transform;
+    /* the transform applies to the region as if it was a matrix of its own */
+    MatrixRegion region;
+    gboolean is_sliced;
+    guint32 n_rows;
+    guint32 n_columns;
+
+    gboolean has_range;
+    double range[2];
+    /* quantiles of the entries, see matrix_view_get_percentile_range() */
+    UtilSketch *sketch;
+
+    /* sparse sources are transformed as a whole, see matrix_view_get_matrix() */
+    Matrix *matrix;
+
+    gint ref_count;
+} MatrixView;
+
+MatrixView *matrix_view_new(Matrix *source, const MatrixRegion *region, const MatrixTransform *transform);
+MatrixView *matrix_view_get(Matrix *source, const MatrixRegion *region, const MatrixTransform *transform);
+MatrixView *matrix_view_ref(MatrixView *view);
+void matrix_view_unref(MatrixView *view);
+void matrix_view_cache_clear(void);
+void matrix_view_cache_remove(Matrix *source);
+
+const double *matrix_view_row(MatrixView *view, guint32 row, double *out, double *scratch);
+const double *matrix_view_column(MatrixView *view, guint32 column, double *out, double *scratch);
+void matrix_view_get_range(MatrixView *view, double *min, double *max);
+void matrix_view_get_percentile_range(MatrixView *view, double percentile, double *min, double *max);
+Matrix *matrix_view_get_matrix(MatrixView *view);
+gboolean matrix_view_is_sparse(MatrixView *view);
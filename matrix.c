@@ -1,12 +1,37 @@
 #include "matrix.h"
+#include "matrix-transform.h"
+#include "util-alloc.h"
+#include "util-parallel.h"
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
 
 Matrix *matrix_new(void)
 {
-    Matrix *m = g_malloc0(sizeof(Matrix));
-    matrix_iter_init(m, &m->last);
+    return g_malloc0(sizeof(Matrix));
+}
+
+/* Whether a dense matrix of this size can be held: rows and columns are 32 bit
+ * indices, the number of entries only has to fit into memory, even in double
+ * precision. */
+gboolean matrix_size_is_valid(guint64 n_rows, guint64 n_columns)
+{
+    return n_rows <= G_MAXUINT32 && n_columns <= G_MAXUINT32 &&
+        (n_columns == 0 || n_rows <= G_MAXSIZE / sizeof(double) / n_columns);
+}
+
+/* Sparse matrix with room for nnz entries; row_offsets are zero. */
+Matrix *matrix_new_csr(guint32 n_rows, guint32 n_columns, guint64 nnz)
+{
+    Matrix *m = matrix_new();
+
+    m->storage = MATRIX_STORAGE_CSR;
+    m->n_rows = n_rows;
+    m->n_columns = n_columns;
+    m->nnz = nnz;
+    m->row_offsets = g_malloc0(((gsize)n_rows + 1) * sizeof(guint64));
+    m->column_indices = g_malloc(nnz * sizeof(guint32));
+    m->values = g_malloc(nnz * sizeof(double));
 
     return m;
 }
@@ -15,10 +40,13 @@ void matrix_clear(Matrix *matrix)
 {
     if (!matrix)
         return;
-    guint32 i;
-    for (i = 0; i < matrix->n_chunks; ++i)
-        g_free(matrix->chunks[i]);
-    g_free(matrix->chunks);
+    if (matrix->mapping)
+        g_mapped_file_unref(matrix->mapping);
+    else
+        util_free(matrix->data, matrix->capacity * matrix_precision_size(matrix->precision));
+    g_free(matrix->row_offsets);
+    g_free(matrix->column_indices);
+    g_free(matrix->values);
 
     memset(matrix, 0, sizeof(Matrix));
 }
@@ -38,164 +66,676 @@ gboolean matrix_get_iter(Matrix *matrix, MatrixIter *iter, guint32 row, guint32
 {
     iter->row = row;
     iter->column = column;
-    iter->chunk = (row * matrix->n_columns + column)  / MATRIX_CHUNK_SIZE;
-    iter->offset = (row * matrix->n_columns + column) % MATRIX_CHUNK_SIZE;
+    iter->index = (guint64)row * matrix->n_columns + column;
 
     return matrix_iter_is_valid(matrix, iter);
 }
 
 gboolean matrix_iter_next(Matrix *matrix, MatrixIter *iter)
 {
+    ++iter->index;
     ++iter->column;
     if (iter->column == matrix->n_columns) {
         ++iter->row;
         iter->column = 0;
     }
 
-    return matrix_get_iter(matrix, iter, iter->row, iter->column);
+    return matrix_iter_is_valid(matrix, iter);
 }
 
 gboolean matrix_iter_is_valid(Matrix *matrix, MatrixIter *iter)
 {
     if (iter->column >= matrix->n_columns || iter->row >= matrix->n_rows)
         return FALSE;
-    /* Check for offset/chunk? */
     return TRUE;
 }
 
-void matrix_append_value(Matrix *matrix, MatrixIter *iter, double value)
+void matrix_stats_init(MatrixStats *stats)
 {
-    if (matrix->last.chunk == matrix->n_chunks) {
-        ++matrix->n_chunks;
-        matrix->chunks = g_realloc(matrix->chunks, matrix->n_chunks * sizeof(double *));
-        matrix->chunks[matrix->last.chunk] = g_malloc(MATRIX_CHUNK_SIZE * sizeof(double));
-    }
+    memset(stats, 0, sizeof(MatrixStats));
+    stats->min = stats->abs_min = INFINITY;
+    stats->max = stats->abs_max = -INFINITY;
+}
 
-    matrix->chunks[matrix->last.chunk][matrix->last.offset] = value;
-    if (iter)
-        *iter = matrix->last;
+/* Add count entries to stats. The comparisons are false for NaN, which is how
+ * these entries are skipped. */
+void matrix_stats_update(MatrixStats *stats, const double *values, guint64 count)
+{
+    double lo = stats->min, hi = stats->max, abs_lo = stats->abs_min, abs_hi = stats->abs_max;
+    double sum = 0.0, x, a;
+    guint64 k, n_zeros = 0, n_nonfinite = 0;
 
-    ++matrix->last.offset;
-    if (matrix->last.offset == MATRIX_CHUNK_SIZE) {
-        matrix->last.offset = 0;
-        ++matrix->last.chunk;
+    for (k = 0; k < count; ++k) {
+        x = values[k];
+        a = fabs(x);
+        lo = x < lo ? x : lo;
+        hi = x > hi ? x : hi;
+        abs_lo = a < abs_lo ? a : abs_lo;
+        abs_hi = a > abs_hi ? a : abs_hi;
+        n_zeros += x == 0.0;
+        if (isfinite(x))
+            sum += x;
+        else
+            ++n_nonfinite;
     }
+
+    stats->n_entries += count;
+    stats->n_zeros += n_zeros;
+    stats->n_nonfinite += n_nonfinite;
+    stats->min = lo;
+    stats->max = hi;
+    stats->abs_min = abs_lo;
+    stats->abs_max = abs_hi;
+    stats->sum += sum;
 }
 
-void matrix_set_value(Matrix *matrix, MatrixIter *iter, double value)
+/* Add the entries summarized by other, which come after those of stats. */
+void matrix_stats_merge(MatrixStats *stats, const MatrixStats *other)
 {
+    stats->n_entries += other->n_entries;
+    stats->n_zeros += other->n_zeros;
+    stats->n_nonfinite += other->n_nonfinite;
+    stats->min = other->min < stats->min ? other->min : stats->min;
+    stats->max = other->max > stats->max ? other->max : stats->max;
+    stats->abs_min = other->abs_min < stats->abs_min ? other->abs_min : stats->abs_min;
+    stats->abs_max = other->abs_max > stats->abs_max ? other->abs_max : stats->abs_max;
+    stats->sum += other->sum;
 }
 
-Matrix *test_matrix(void)
+/* Smallest and largest entry, or zero for both if there are none besides NaN. */
+void matrix_stats_get_range(const MatrixStats *stats, double *min, double *max)
 {
-    Matrix *m = matrix_new();
-    guint32 i;
-    for (i = 0; i < 100; ++i) {
-        matrix_append_value(m, NULL, drand48());
-    }
-    m->n_columns = 10;
-    m->n_rows = 10;
+    gboolean empty = !(stats->min <= stats->max);
 
-    return m;
+    if (min)
+        *min = empty ? 0.0 : stats->min;
+    if (max)
+        *max = empty ? 0.0 : stats->max;
+}
+
+/* Add n zeros, e.g. the entries a sparse matrix does not store. */
+static void _matrix_stats_add_zeros(MatrixStats *stats, guint64 n)
+{
+    static const double zero = 0.0;
+
+    if (n == 0)
+        return;
+
+    matrix_stats_update(stats, &zero, 1);
+    stats->n_entries += n - 1;
+    stats->n_zeros += n - 1;
 }
 
-/*typedef enum {
-    TOKEN_NUMBER,
-    TOKEN_NEWLINE
-} MatrixTokenType;
+static int _matrix_compare_index(const guint32 *a, const guint32 *b)
+{
+    return *a < *b ? -1 : (*a > *b ? 1 : 0);
+}
+
+gsize matrix_precision_size(MatrixPrecision precision)
+{
+    switch (precision) {
+        case MATRIX_PRECISION_F32:
+            return sizeof(float);
+        case MATRIX_PRECISION_Q16:
+            return sizeof(guint16);
+        case MATRIX_PRECISION_Q8:
+            return sizeof(guint8);
+        default:
+            return sizeof(double);
+    }
+}
 
-gboolean _matrix_read_next_token(FILE *infile, MatrixTokenType *type, double *value)
+/* f64, f32, q16 or q8 */
+gboolean matrix_parse_precision(const gchar *name, MatrixPrecision *precision)
 {
-    if (feof(infile))
+    if (g_strcmp0(name, "f64") == 0)
+        *precision = MATRIX_PRECISION_F64;
+    else if (g_strcmp0(name, "f32") == 0)
+        *precision = MATRIX_PRECISION_F32;
+    else if (g_strcmp0(name, "q16") == 0)
+        *precision = MATRIX_PRECISION_Q16;
+    else if (g_strcmp0(name, "q8") == 0)
+        *precision = MATRIX_PRECISION_Q8;
+    else {
+        g_printerr("Unknown precision `%s' (use f64, f32, q16 or q8).\n", name);
         return FALSE;
+    }
 
-    int c;
-    gchar buffer[256];
-    guint i;
-    do {
-        c = fgetc(infile);
-    } while (c >= 0 && c != '\n' && g_ascii_isspace(c));
+    return TRUE;
+}
 
-    if (c < 0)
+/* "begin:end[:step]" with zero based indices and end excluded; begin and end
+ * may be left out for the first and last index. */
+gboolean matrix_parse_slice(const gchar *str, MatrixSlice *slice)
+{
+    gchar **parts = g_strsplit(str, ":", 0);
+    guint n_parts = g_strv_length(parts);
+    guint64 values[3] = { 0, G_MAXUINT32, 1 };
+    gchar *end;
+    guint k;
+    gboolean success = n_parts == 2 || n_parts == 3;
+
+    for (k = 0; k < n_parts && success; ++k) {
+        if (parts[k][0] == '\0' && k < 2)
+            continue;
+        values[k] = g_ascii_strtoull(parts[k], &end, 10);
+        if (end == parts[k] || *end != '\0' || values[k] > G_MAXUINT32)
+            success = FALSE;
+    }
+    g_strfreev(parts);
+
+    if (!success || values[2] == 0 || values[0] > values[1]) {
+        g_printerr("Invalid slice `%s', expected BEGIN:END[:STEP].\n", str);
         return FALSE;
-    if (c == '\n') {
-        if (type) *type = TOKEN_NEWLINE;
-        return TRUE;
     }
 
-    while (c == '-' || c == '.' || g_ascii_isdigit(c)) {
-        buffer[i++] = c;
-        c = fgetc(c);
+    slice->begin = values[0];
+    slice->end = values[1];
+    slice->step = values[2];
+
+    return TRUE;
+}
+
+/* All rows and columns. */
+void matrix_region_init(MatrixRegion *region)
+{
+    region->rows.begin = region->columns.begin = 0;
+    region->rows.end = region->columns.end = G_MAXUINT32;
+    region->rows.step = region->columns.step = 1;
+}
+
+/* Number of indices of slice below n. */
+guint32 matrix_slice_count(const MatrixSlice *slice, guint32 n)
+{
+    guint32 end = MIN(slice->end, n);
+
+    return slice->begin < end ? (end - slice->begin - 1) / slice->step + 1 : 0;
+}
+
+gboolean matrix_region_is_all(const MatrixRegion *region, guint32 n_rows, guint32 n_columns)
+{
+    return !region || (matrix_slice_count(&region->rows, n_rows) == n_rows &&
+                       matrix_slice_count(&region->columns, n_columns) == n_columns);
+}
+
+/* Convert count stored entries starting at index to double. */
+void matrix_get_values(Matrix *matrix, guint64 index, guint64 count, double *values)
+{
+    const float *f32;
+    const guint16 *q16;
+    const guint8 *q8;
+    guint64 k;
+
+    switch (matrix->precision) {
+        case MATRIX_PRECISION_F64:
+            memcpy(values, (double *)matrix->data + index, count * sizeof(double));
+            break;
+        case MATRIX_PRECISION_F32:
+            f32 = (const float *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                values[k] = f32[k];
+            break;
+        case MATRIX_PRECISION_Q16:
+            q16 = (const guint16 *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                values[k] = matrix->offset + matrix->scale * q16[k];
+            break;
+        case MATRIX_PRECISION_Q8:
+            q8 = (const guint8 *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                values[k] = matrix->offset + matrix->scale * q8[k];
+            break;
+    }
+}
+
+/* Add the stored entries [index, index + count) of a dense matrix to stats. */
+static void _matrix_stats_add_entries(MatrixStats *stats, Matrix *matrix, guint64 index, guint64 count)
+{
+    double buffer[MATRIX_CHUNK_SIZE];
+    guint64 n;
+
+    if (matrix->precision == MATRIX_PRECISION_F64) {
+        matrix_stats_update(stats, (double *)matrix->data + index, count);
+        return;
     }
-    buffer[i] = 0;
 
-}*/
+    for (; count > 0; index += n, count -= n) {
+        n = MIN(count, MATRIX_CHUNK_SIZE);
+        matrix_get_values(matrix, index, n, buffer);
+        matrix_stats_update(stats, buffer, n);
+    }
+}
 
-GList *matrix_read_from_file(int fd)
+/* Convert count stored entries index, index + stride, ... to double. */
+void matrix_get_strided(Matrix *matrix, guint64 index, guint64 stride, guint32 count, double *values)
 {
-    GScanner *scanner = g_scanner_new(NULL);
-    scanner->config->cset_skip_characters = " \t";
-    scanner->config->int_2_float = 1;
-    g_scanner_input_file(scanner, fd);
+    const double *f64;
+    const float *f32;
+    const guint16 *q16;
+    const guint8 *q8;
+    guint32 k;
 
-    GTokenType next_token_type;
-    gboolean negate = FALSE;
+    if (stride == 1) {
+        matrix_get_values(matrix, index, count, values);
+        return;
+    }
 
-    Matrix *m;
-    guint32 columns = 0;
+    switch (matrix->precision) {
+        case MATRIX_PRECISION_F64:
+            f64 = (const double *)matrix->data + index;
+            for (k = 0; k < count; ++k, f64 += stride)
+                values[k] = *f64;
+            break;
+        case MATRIX_PRECISION_F32:
+            f32 = (const float *)matrix->data + index;
+            for (k = 0; k < count; ++k, f32 += stride)
+                values[k] = *f32;
+            break;
+        case MATRIX_PRECISION_Q16:
+            q16 = (const guint16 *)matrix->data + index;
+            for (k = 0; k < count; ++k, q16 += stride)
+                values[k] = matrix->offset + matrix->scale * *q16;
+            break;
+        case MATRIX_PRECISION_Q8:
+            q8 = (const guint8 *)matrix->data + index;
+            for (k = 0; k < count; ++k, q8 += stride)
+                values[k] = matrix->offset + matrix->scale * *q8;
+            break;
+    }
+}
 
-    GList *list = NULL;
+static inline double _matrix_quantize(Matrix *matrix, double value, double max_code)
+{
+    double code = floor((value - matrix->offset) / matrix->scale + 0.5);
 
-    m = matrix_new(); 
-    list = g_list_prepend(list, m);
+    /* NaN ends up as the smallest code */
+    if (!(code >= 0.0))
+        return 0.0;
 
-    do {
-        next_token_type = g_scanner_get_next_token(scanner);
-        g_scanner_peek_next_token(scanner);
+    return code > max_code ? max_code : code;
+}
 
-        /* TODO do not allow 0.5-1.2 as two floats */
+/* Store count values at index; quantized values outside the range are clamped. */
+void matrix_set_values(Matrix *matrix, guint64 index, guint64 count, const double *values)
+{
+    float *f32;
+    guint16 *q16;
+    guint8 *q8;
+    guint64 k;
 
-        if (next_token_type == G_TOKEN_FLOAT) {
-            ++columns;
-            matrix_append_value(m, NULL, negate ? -scanner->value.v_float : scanner->value.v_float);
-            negate = FALSE;
+    switch (matrix->precision) {
+        case MATRIX_PRECISION_F64:
+            memcpy((double *)matrix->data + index, values, count * sizeof(double));
+            break;
+        case MATRIX_PRECISION_F32:
+            f32 = (float *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                f32[k] = values[k];
+            break;
+        case MATRIX_PRECISION_Q16:
+            q16 = (guint16 *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                q16[k] = _matrix_quantize(matrix, values[k], G_MAXUINT16);
+            break;
+        case MATRIX_PRECISION_Q8:
+            q8 = (guint8 *)matrix->data + index;
+            for (k = 0; k < count; ++k)
+                q8[k] = _matrix_quantize(matrix, values[k], G_MAXUINT8);
+            break;
+    }
+}
+
+/* Choose scale and offset of a quantized matrix for values in [min, max]. If the
+ * range contains zero, zero is represented exactly. */
+static void _matrix_set_quantization(Matrix *matrix, double min, double max)
+{
+    double levels = matrix->precision == MATRIX_PRECISION_Q16 ? G_MAXUINT16 : G_MAXUINT8;
+
+    if (max > min && isfinite(max - min)) {
+        matrix->scale = (max - min) / levels;
+        matrix->offset = min;
+        if (min < 0.0 && max > 0.0) {
+            /* one code less, so that max still fits after rounding the offset */
+            matrix->scale = (max - min) / (levels - 1.0);
+            matrix->offset = -floor(-min / matrix->scale + 0.5) * matrix->scale;
         }
-        else if (next_token_type == '-') {
-            negate = TRUE;
+    }
+    else {
+        matrix->scale = 1.0;
+        matrix->offset = isfinite(min) ? min : 0.0;
+    }
+}
+
+/* Make matrix a dense n_rows x n_columns matrix with the given precision. The
+ * entries are set afterwards with matrix_set_values(); quantized entries will
+ * cover [min, max]. */
+void matrix_init_dense(Matrix *matrix, guint32 n_rows, guint32 n_columns, MatrixPrecision precision,
+                       double min, double max)
+{
+    matrix_clear(matrix);
+
+    matrix->n_rows = n_rows;
+    matrix->n_columns = n_columns;
+    matrix->precision = precision;
+    matrix->n_entries = matrix->capacity = (guint64)n_rows * n_columns;
+    matrix->data = util_alloc(matrix->capacity * matrix_precision_size(precision));
+    if (precision == MATRIX_PRECISION_Q16 || precision == MATRIX_PRECISION_Q8)
+        _matrix_set_quantization(matrix, min, max);
+}
+
+/* Copy mapped entries into a buffer of our own before they are modified. */
+static void _matrix_unshare(Matrix *matrix)
+{
+    gsize size = matrix_precision_size(matrix->precision);
+    gpointer data;
+
+    if (!matrix->mapping)
+        return;
+
+    data = util_alloc(matrix->n_entries * size);
+    memcpy(data, matrix->data, matrix->n_entries * size);
+    g_mapped_file_unref(matrix->mapping);
+    matrix->mapping = NULL;
+    matrix->data = data;
+    matrix->capacity = matrix->n_entries;
+}
+
+/* Make room for count more entries. The buffer grows geometrically; mapped
+ * data is copied to a buffer of our own first. */
+static void _matrix_reserve(Matrix *matrix, guint64 count)
+{
+    gsize size = matrix_precision_size(matrix->precision);
+    guint64 capacity;
+    gpointer data;
+
+    if (matrix->n_entries + count <= matrix->capacity)
+        return;
+
+    capacity = matrix->capacity ? matrix->capacity : MATRIX_CHUNK_SIZE;
+    while (capacity < matrix->n_entries + count)
+        capacity *= 2;
+
+    if (matrix->mapping) {
+        data = util_alloc(capacity * size);
+        memcpy(data, matrix->data, matrix->n_entries * size);
+        g_mapped_file_unref(matrix->mapping);
+        matrix->mapping = NULL;
+    }
+    else {
+        data = util_realloc(matrix->data, matrix->capacity * size, capacity * size);
+    }
+
+    matrix->data = data;
+    matrix->capacity = capacity;
+}
+
+void matrix_append_value(Matrix *matrix, MatrixIter *iter, double value)
+{
+    matrix_append_row(matrix, &value, 1);
+
+    if (iter) {
+        matrix_iter_init(matrix, iter);
+        iter->index = matrix->n_entries - 1;
+    }
+}
+
+/* Append a whole row (or any run of values) to the end of the matrix. */
+void matrix_append_row(Matrix *matrix, const double *values, guint64 count)
+{
+    /* the statistics grow with the matrix, from the stored (rounded) values */
+    if (matrix->n_entries == 0) {
+        matrix_stats_init(&matrix->stats);
+        matrix->has_stats = TRUE;
+    }
+    if (count == 0)
+        return;
+
+    _matrix_reserve(matrix, count);
+    matrix_set_values(matrix, matrix->n_entries, count, values);
+    if (matrix->has_stats)
+        _matrix_stats_add_entries(&matrix->stats, matrix, matrix->n_entries, count);
+    matrix->n_entries += count;
+}
+
+/* Append all rows of other to matrix. */
+void matrix_append_matrix(Matrix *matrix, Matrix *other)
+{
+    gsize size = matrix_precision_size(matrix->precision);
+    guint64 count = (guint64)other->n_rows * other->n_columns;
+    double *scratch;
+    guint32 i, n;
+
+    if (matrix->n_columns == 0)
+        matrix->n_columns = other->n_columns;
+
+    if (matrix->n_columns == other->n_columns && matrix->precision == other->precision &&
+            (matrix->precision == MATRIX_PRECISION_F64 || matrix->precision == MATRIX_PRECISION_F32)) {
+        if (matrix->n_entries == 0) {
+            matrix_stats_init(&matrix->stats);
+            matrix->has_stats = TRUE;
         }
-        else if (next_token_type == '\n') {
-            if (m->n_columns != 0 && m->n_columns != columns) {
-                if (columns == 0) {
-                    g_print("start of new matrix at line %u\n", scanner->line);
-                    m = matrix_new();
-                    list = g_list_prepend(list, m);
-                    continue;
-                }
-                else {
-                    g_printerr("column mismatch at line %u\n", scanner->line);
-                }
-            }
-            else if (m->n_columns == 0) {
-                    m->n_columns = columns;
-            }
-            ++m->n_rows;
-            columns = 0;
+        matrix->has_stats = matrix->has_stats && other->has_stats;
+        if (matrix->has_stats)
+            matrix_stats_merge(&matrix->stats, &other->stats);
+        _matrix_reserve(matrix, count);
+        memcpy((gchar *)matrix->data + matrix->n_entries * size, other->data, count * size);
+        matrix->n_entries += count;
+    }
+    else {
+        /* convert row by row, cut off or pad with zeros */
+        scratch = g_malloc0(MAX(matrix->n_columns, other->n_columns) * sizeof(double));
+        n = MIN(matrix->n_columns, other->n_columns);
+        _matrix_reserve(matrix, (guint64)other->n_rows * matrix->n_columns);
+        for (i = 0; i < other->n_rows; ++i) {
+            memcpy(scratch, matrix_row(other, i, scratch), n * sizeof(double));
+            memset(scratch + n, 0, (matrix->n_columns - n) * sizeof(double));
+            matrix_append_row(matrix, scratch, matrix->n_columns);
         }
-        else {
-            g_print("type: %d\n", next_token_type);
+        g_free(scratch);
+    }
+
+    matrix->n_rows += other->n_rows;
+}
+
+/* Use count entries at data, which lies inside mapping and is stored with the
+ * precision of the (empty) matrix, without copying. The data is copied as soon
+ * as the matrix grows. */
+void matrix_map_data(Matrix *matrix, GMappedFile *mapping, gconstpointer data, guint64 count)
+{
+    matrix->data = (gpointer)data;
+    matrix->n_entries = count;
+    matrix->capacity = 0;
+    matrix->mapping = g_mapped_file_ref(mapping);
+}
+
+/* Entries of a row as one contiguous run of n_columns values. Dense rows in
+ * double precision are returned in place, all others are converted into scratch
+ * (n_columns values). */
+const double *matrix_row(Matrix *matrix, guint32 row, double *scratch)
+{
+    guint64 k;
+
+    if (matrix->storage == MATRIX_STORAGE_DENSE) {
+        if (matrix->precision == MATRIX_PRECISION_F64)
+            return (double *)matrix->data + (guint64)row * matrix->n_columns;
+        matrix_get_values(matrix, (guint64)row * matrix->n_columns, matrix->n_columns, scratch);
+        return scratch;
+    }
+
+    memset(scratch, 0, matrix->n_columns * sizeof(double));
+    for (k = matrix->row_offsets[row]; k < matrix->row_offsets[row + 1]; ++k)
+        scratch[matrix->column_indices[k]] = matrix->values[k];
+
+    return scratch;
+}
+
+/* Entries of a column, gathered into scratch (n_rows values). */
+const double *matrix_column(Matrix *matrix, guint32 column, double *scratch)
+{
+    const double *f64 = matrix->data;
+    guint32 *found;
+    guint32 i;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        for (i = 0; i < matrix->n_rows; ++i) {
+            found = bsearch(&column, matrix->column_indices + matrix->row_offsets[i],
+                            matrix->row_offsets[i + 1] - matrix->row_offsets[i], sizeof(guint32),
+                            (int (*)(const void *, const void *))_matrix_compare_index);
+            scratch[i] = found ? matrix->values[found - matrix->column_indices] : 0.0;
         }
-    } while (scanner->next_token != G_TOKEN_EOF &&
-             scanner->next_token != G_TOKEN_ERROR);
+    }
+    else if (matrix->precision == MATRIX_PRECISION_F64) {
+        for (i = 0, f64 += column; i < matrix->n_rows; ++i, f64 += matrix->n_columns)
+            scratch[i] = *f64;
+    }
+    else {
+        for (i = 0; i < matrix->n_rows; ++i)
+            matrix_get_values(matrix, (guint64)i * matrix->n_columns + column, 1, &scratch[i]);
+    }
+
+    return scratch;
+}
 
-    g_scanner_destroy(scanner);
+typedef struct {
+    Matrix *matrix;
+    Matrix *target;
+    MatrixRowFunc func;
+    gpointer userdata;
+    MatrixStats *stats;
+} MatrixRowBands;
 
-    GList *llink = list;
-    if (llink && llink->data && ((Matrix *)llink->data)->n_columns == 0) {
-        list = g_list_remove_link(list, llink);
-        g_list_free_full(llink, (GDestroyNotify)matrix_free);
+/* Rows [begin, end) of a dense matrix. Without a target only the statistics of
+ * the new values are collected, otherwise they are stored in the target. */
+static void _matrix_foreach_row_band(guint64 begin, guint64 end, guint band, MatrixRowBands *bands)
+{
+    Matrix *matrix = bands->matrix;
+    double *row;
+    guint64 index;
+    guint32 i;
+
+    if (matrix->precision == MATRIX_PRECISION_F64) {
+        for (i = begin; i < end; ++i)
+            bands->func((double *)matrix->data + (guint64)i * matrix->n_columns, matrix->n_columns,
+                        i, bands->userdata);
+        return;
     }
 
-    return g_list_reverse(list);
+    row = g_malloc(matrix->n_columns * sizeof(double));
+
+    for (i = begin; i < end; ++i) {
+        index = (guint64)i * matrix->n_columns;
+        matrix_get_values(matrix, index, matrix->n_columns, row);
+        bands->func(row, matrix->n_columns, i, bands->userdata);
+        if (bands->target) {
+            matrix_set_values(bands->target, index, matrix->n_columns, row);
+            continue;
+        }
+        matrix_stats_update(bands->stats + band, row, matrix->n_columns);
+    }
+
+    g_free(row);
+}
+
+void matrix_foreach_row(Matrix *matrix, MatrixRowFunc func, gpointer userdata)
+{
+    Matrix target;
+    MatrixRowBands bands = { matrix, NULL, func, userdata, NULL };
+    MatrixStats stats;
+    double min, max;
+    guint n_bands, k;
+    guint32 i;
+
+    matrix->has_stats = FALSE;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        for (i = 0; i < matrix->n_rows; ++i)
+            func(matrix->values + matrix->row_offsets[i],
+                 matrix->row_offsets[i + 1] - matrix->row_offsets[i], i, userdata);
+        return;
+    }
+
+    _matrix_unshare(matrix);
+    n_bands = util_parallel_get_bands(matrix->n_rows, matrix->n_columns);
+    bands.stats = g_malloc(n_bands * sizeof(MatrixStats));
+    for (k = 0; k < n_bands; ++k)
+        matrix_stats_init(bands.stats + k);
+
+    if (matrix->precision == MATRIX_PRECISION_F64) {
+        util_parallel_for(matrix->n_rows, n_bands, (UtilParallelFunc)_matrix_foreach_row_band, &bands);
+        g_free(bands.stats);
+        return;
+    }
+
+    target = *matrix;
+
+    /* quantized: the new values need a new scale, so find their range first */
+    if (matrix->precision == MATRIX_PRECISION_Q16 || matrix->precision == MATRIX_PRECISION_Q8) {
+        util_parallel_for(matrix->n_rows, n_bands, (UtilParallelFunc)_matrix_foreach_row_band, &bands);
+        matrix_stats_init(&stats);
+        for (k = 0; k < n_bands; ++k)
+            matrix_stats_merge(&stats, bands.stats + k);
+        matrix_stats_get_range(&stats, &min, &max);
+        _matrix_set_quantization(&target, min, max);
+    }
+
+    bands.target = &target;
+    util_parallel_for(matrix->n_rows, n_bands, (UtilParallelFunc)_matrix_foreach_row_band, &bands);
+
+    matrix->scale = target.scale;
+    matrix->offset = target.offset;
+    g_free(bands.stats);
+}
+
+/* Convert the entries to another precision. Sparse matrices always keep their
+ * values in double precision. */
+void matrix_set_precision(Matrix *matrix, MatrixPrecision precision)
+{
+    Matrix old;
+    double buffer[MATRIX_CHUNK_SIZE];
+    double min, max;
+    guint64 index, n;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR || matrix->precision == precision)
+        return;
+
+    matrix_get_range(matrix, &min, &max);
+    old = *matrix;
+
+    matrix->precision = precision;
+    matrix->capacity = matrix->n_entries;
+    matrix->data = util_alloc(matrix->capacity * matrix_precision_size(precision));
+    matrix->mapping = NULL;
+    if (precision == MATRIX_PRECISION_Q16 || precision == MATRIX_PRECISION_Q8)
+        _matrix_set_quantization(matrix, min, max);
+
+    /* the statistics change with the rounding, collect them on the way */
+    matrix_stats_init(&matrix->stats);
+    for (index = 0; index < matrix->n_entries; index += n) {
+        n = MIN(matrix->n_entries - index, MATRIX_CHUNK_SIZE);
+        matrix_get_values(&old, index, n, buffer);
+        matrix_set_values(matrix, index, n, buffer);
+        _matrix_stats_add_entries(&matrix->stats, matrix, index, n);
+    }
+    matrix->has_stats = TRUE;
+
+    matrix_clear(&old);
+}
+
+void matrix_set_value(Matrix *matrix, MatrixIter *iter, double value)
+{
+}
+
+Matrix *test_matrix(void)
+{
+    Matrix *m = matrix_new();
+    guint32 i;
+    for (i = 0; i < 100; ++i) {
+        matrix_append_value(m, NULL, drand48());
+    }
+    m->n_columns = 10;
+    m->n_rows = 10;
+
+    return m;
 }
 
 void matrix_copy(Matrix *dst, Matrix *src)
@@ -204,14 +744,103 @@ void matrix_copy(Matrix *dst, Matrix *src)
         return;
     matrix_clear(dst);
     *dst = *src;
+    dst->mapping = NULL;
 
-    dst->chunks = g_malloc0(dst->n_chunks * sizeof(double *));
-    guint32 i;
-    for (i = 0; i < dst->n_chunks; ++i) {
-        dst->chunks[i] = g_malloc(MATRIX_CHUNK_SIZE * sizeof(double));
-        memcpy(dst->chunks[i], src->chunks[i], MATRIX_CHUNK_SIZE * sizeof(double));
+    if (src->storage == MATRIX_STORAGE_CSR) {
+        dst->row_offsets = g_malloc(((gsize)src->n_rows + 1) * sizeof(guint64));
+        dst->column_indices = g_malloc(src->nnz * sizeof(guint32));
+        dst->values = g_malloc(src->nnz * sizeof(double));
+        memcpy(dst->row_offsets, src->row_offsets, ((gsize)src->n_rows + 1) * sizeof(guint64));
+        memcpy(dst->column_indices, src->column_indices, src->nnz * sizeof(guint32));
+        memcpy(dst->values, src->values, src->nnz * sizeof(double));
+        return;
+    }
+
+    dst->capacity = src->n_entries;
+    dst->data = util_alloc(dst->capacity * matrix_precision_size(src->precision));
+    memcpy(dst->data, src->data, src->n_entries * matrix_precision_size(src->precision));
+}
+
+/* Sparse rows of region, with the column indices renumbered. */
+static void _matrix_csr_slice(Matrix *matrix, const MatrixRegion *region, guint32 n_rows, guint32 n_columns)
+{
+    const MatrixSlice *columns = &region->columns;
+    guint64 *row_offsets = g_malloc(((gsize)n_rows + 1) * sizeof(guint64));
+    guint64 k, nnz = 0;
+    guint32 i, j;
+
+    row_offsets[0] = 0;
+    for (i = 0; i < n_rows; ++i) {
+        guint32 row = region->rows.begin + i * region->rows.step;
+        /* stored entries only move to the front, so this works in place */
+        for (k = matrix->row_offsets[row]; k < matrix->row_offsets[row + 1]; ++k) {
+            j = matrix->column_indices[k];
+            if (j < columns->begin || (j - columns->begin) % columns->step ||
+                    (j - columns->begin) / columns->step >= n_columns)
+                continue;
+            matrix->column_indices[nnz] = (j - columns->begin) / columns->step;
+            matrix->values[nnz++] = matrix->values[k];
+        }
+        row_offsets[i + 1] = nnz;
     }
 
+    g_free(matrix->row_offsets);
+    matrix->row_offsets = row_offsets;
+    matrix->column_indices = g_realloc(matrix->column_indices, nnz * sizeof(guint32));
+    matrix->values = g_realloc(matrix->values, nnz * sizeof(double));
+    matrix->nnz = nnz;
+}
+
+/* Keep only the rows and columns of region. Dense entries are moved to the front
+ * of the buffer, which then shrinks; mapped entries are copied, but only those
+ * inside the region. */
+void matrix_slice(Matrix *matrix, const MatrixRegion *region)
+{
+    gsize size = matrix_precision_size(matrix->precision);
+    guint32 n_rows, n_columns, i, j;
+    guint64 count;
+    const gchar *src;
+    gchar *dst, *row;
+
+    if (matrix_region_is_all(region, matrix->n_rows, matrix->n_columns))
+        return;
+
+    n_rows = matrix_slice_count(&region->rows, matrix->n_rows);
+    n_columns = matrix_slice_count(&region->columns, matrix->n_columns);
+    count = (guint64)n_rows * n_columns;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        _matrix_csr_slice(matrix, region, n_rows, n_columns);
+    }
+    else {
+        src = matrix->data;
+        dst = matrix->mapping ? util_alloc(count * size) : matrix->data;
+
+        for (i = 0; i < n_rows; ++i) {
+            row = dst + (guint64)i * n_columns * size;
+            src = (const gchar *)matrix->data + ((guint64)(region->rows.begin + i * region->rows.step) *
+                                                 matrix->n_columns + region->columns.begin) * size;
+            if (region->columns.step == 1)
+                memmove(row, src, n_columns * size);
+            else
+                for (j = 0; j < n_columns; ++j, row += size, src += region->columns.step * size)
+                    memmove(row, src, size);
+        }
+
+        if (matrix->mapping) {
+            g_mapped_file_unref(matrix->mapping);
+            matrix->mapping = NULL;
+        }
+        else {
+            dst = util_realloc(dst, matrix->capacity * size, count * size);
+        }
+        matrix->data = dst;
+        matrix->n_entries = matrix->capacity = count;
+    }
+
+    matrix->n_rows = n_rows;
+    matrix->n_columns = n_columns;
+    matrix->has_stats = FALSE;
 }
 
 Matrix *matrix_dup(Matrix *matrix)
@@ -225,96 +854,295 @@ Matrix *matrix_dup(Matrix *matrix)
     return dup;
 }
 
-/* Permutate the matrix so that we have the blocks
- * [ c_{2i,2j}   | c_{2i,2j+1}   ]
- * [-----------------------------]
- * [ c_{2i+1,2j} | c_{2i+1,2j+1} ]*/
-void matrix_permutate_matrix(Matrix *matrix)
+typedef struct {
+    Matrix *matrix;
+    MatrixStats *stats;
+} MatrixStatsBands;
+
+static void _matrix_stats_band(guint64 begin, guint64 end, guint band, MatrixStatsBands *bands)
 {
-    Matrix *tmp = matrix_dup(matrix);
-    guint32 i, j;
-    MatrixIter iter1;
-    MatrixIter iter2;
+    matrix_stats_init(bands->stats + band);
+    _matrix_stats_add_entries(bands->stats + band, bands->matrix, begin, end - begin);
+}
+
+/* Statistics of the entries, computed in bands unless they were collected while
+ * the matrix was read; they stay valid until the matrix is modified. */
+const MatrixStats *matrix_get_stats(Matrix *matrix)
+{
+    MatrixStatsBands bands = { matrix, NULL };
+    guint64 count = (guint64)matrix->n_rows * matrix->n_columns;
+    guint n_bands, k;
 
-    guint32 oi = (matrix->n_rows + 1)/2;
-    guint32 oj = (matrix->n_columns + 1)/2;
+    if (matrix->has_stats)
+        return &matrix->stats;
 
-    for (i = 0; i < matrix->n_rows; i += 2) {
-        for (j = 0; j < matrix->n_columns; j += 2) {
-            matrix_get_iter(tmp, &iter1, i, j);
-            matrix_get_iter(matrix, &iter2, i/2, j/2);
-            matrix->chunks[iter2.chunk][iter2.offset] = tmp->chunks[iter1.chunk][iter1.offset];
-        }
+    matrix_stats_init(&matrix->stats);
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        /* implicit zeros count unless every entry is stored */
+        _matrix_stats_add_zeros(&matrix->stats, count - MIN(matrix->nnz, count));
+        matrix_stats_update(&matrix->stats, matrix->values, matrix->nnz);
+    }
+    else {
+        n_bands = util_parallel_get_bands(count, 1);
+        bands.stats = g_malloc(n_bands * sizeof(MatrixStats));
+        util_parallel_for(count, n_bands, (UtilParallelFunc)_matrix_stats_band, &bands);
+        for (k = 0; k < n_bands; ++k)
+            matrix_stats_merge(&matrix->stats, bands.stats + k);
+        g_free(bands.stats);
+    }
+
+    matrix->has_stats = TRUE;
+
+    return &matrix->stats;
+}
+
+/* Minimum and maximum entry, see matrix_stats_get_range(). */
+void matrix_get_range(Matrix *matrix, double *min, double *max)
+{
+    matrix_stats_get_range(matrix_get_stats(matrix), min, max);
+}
+
+/* Sparse permutation in two bucket passes: distributing the entries over the new
+ * columns (taking the new rows in order) and back over the rows leaves each row
+ * sorted by column without comparisons. */
+static void _matrix_csr_permute(Matrix *matrix, const guint32 *row_perm, const guint32 *column_perm)
+{
+    guint64 *row_offsets = g_malloc0(((gsize)matrix->n_rows + 1) * sizeof(guint64));
+    guint64 *column_offsets = g_malloc0(((gsize)matrix->n_columns + 1) * sizeof(guint64));
+    guint32 *column_indices = g_malloc(matrix->nnz * sizeof(guint32));
+    double *values = g_malloc(matrix->nnz * sizeof(double));
+    guint32 *rows = g_malloc(matrix->nnz * sizeof(guint32));
+    double *column_values = g_malloc(matrix->nnz * sizeof(double));
+    guint32 *inverse = g_malloc(((gsize)matrix->n_rows + 1) * sizeof(guint32));
+    guint32 i, r, c;
+    guint64 k, pos;
+
+    for (i = 0; i < matrix->n_rows; ++i) {
+        r = row_perm ? row_perm[i] : i;
+        inverse[r] = i;
+        row_offsets[r + 1] = matrix->row_offsets[i + 1] - matrix->row_offsets[i];
     }
-    for (i = 0; i < matrix->n_rows; i += 2) {
-        for (j = 1; j < matrix->n_columns; j += 2) {
-            matrix_get_iter(tmp, &iter1, i, j);
-            matrix_get_iter(matrix, &iter2, i/2, j/2+oj);
-            matrix->chunks[iter2.chunk][iter2.offset] = tmp->chunks[iter1.chunk][iter1.offset];
+    for (r = 0; r < matrix->n_rows; ++r)
+        row_offsets[r + 1] += row_offsets[r];
+
+    for (k = 0; k < matrix->nnz; ++k)
+        ++column_offsets[(column_perm ? column_perm[matrix->column_indices[k]] : matrix->column_indices[k]) + 1];
+    for (c = 0; c < matrix->n_columns; ++c)
+        column_offsets[c + 1] += column_offsets[c];
+
+    for (r = 0; r < matrix->n_rows; ++r) {
+        i = inverse[r];
+        for (k = matrix->row_offsets[i]; k < matrix->row_offsets[i + 1]; ++k) {
+            c = column_perm ? column_perm[matrix->column_indices[k]] : matrix->column_indices[k];
+            pos = column_offsets[c]++;
+            rows[pos] = r;
+            column_values[pos] = matrix->values[k];
         }
     }
-    for (i = 1; i < matrix->n_rows; i += 2) {
-        for (j = 0; j < matrix->n_columns; j += 2) {
-            matrix_get_iter(tmp, &iter1, i, j);
-            matrix_get_iter(matrix, &iter2, i/2 + oi, j/2);
-            matrix->chunks[iter2.chunk][iter2.offset] = tmp->chunks[iter1.chunk][iter1.offset];
+
+    /* column_offsets[c] is now the end of column c */
+    for (c = 0, k = 0; c < matrix->n_columns; ++c) {
+        for (; k < column_offsets[c]; ++k) {
+            pos = row_offsets[rows[k]]++;
+            column_indices[pos] = c;
+            values[pos] = column_values[k];
         }
     }
-    for (i = 1; i < matrix->n_rows; i += 2) {
-        for (j = 1; j < matrix->n_columns; j += 2) {
-            matrix_get_iter(tmp, &iter1, i, j);
-            matrix_get_iter(matrix, &iter2, i/2 + oi, j/2 + oj);
-            matrix->chunks[iter2.chunk][iter2.offset] = tmp->chunks[iter1.chunk][iter1.offset];
+
+    /* row_offsets[r] is now the end of row r */
+    memmove(row_offsets + 1, row_offsets, (gsize)matrix->n_rows * sizeof(guint64));
+    row_offsets[0] = 0;
+
+    g_free(matrix->row_offsets);
+    g_free(matrix->column_indices);
+    g_free(matrix->values);
+    matrix->row_offsets = row_offsets;
+    matrix->column_indices = column_indices;
+    matrix->values = values;
+
+    g_free(column_offsets);
+    g_free(rows);
+    g_free(column_values);
+    g_free(inverse);
+}
+
+/* Entry j of a row of n elements of the given size to position perm[j] of dst. */
+static void _matrix_scatter_row(gchar *dst, const gchar *src, const guint32 *perm, guint32 n, gsize size)
+{
+    guint32 j;
+
+    if (!perm) {
+        memcpy(dst, src, n * size);
+        return;
+    }
+
+#define MATRIX_SCATTER(type) \
+    for (j = 0; j < n; ++j) \
+        ((type *)dst)[perm[j]] = ((const type *)src)[j];
+
+    switch (size) {
+        case 8:
+            MATRIX_SCATTER(guint64);
+            break;
+        case 4:
+            MATRIX_SCATTER(guint32);
+            break;
+        case 2:
+            MATRIX_SCATTER(guint16);
+            break;
+        default:
+            MATRIX_SCATTER(guint8);
+            break;
+    }
+
+#undef MATRIX_SCATTER
+}
+
+/* Move entry (i, j) to (row_perm[i], column_perm[j]); either permutation may be
+ * NULL for the identity. Dense matrices are permuted in place by following the
+ * cycles of the row permutation, each row being read and written once, with
+ * scratch space for two rows and O(rows) indices. Stored entries are moved as
+ * they are, whatever their precision, so the statistics stay valid. */
+void matrix_permute(Matrix *matrix, const guint32 *row_perm, const guint32 *column_perm)
+{
+    gsize size = matrix_precision_size(matrix->precision);
+    gsize row_size = (gsize)matrix->n_columns * size;
+    gchar *data, *first, *scratch;
+    guint32 *inverse;
+    guint8 *done;
+    guint32 i, cur, next;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        _matrix_csr_permute(matrix, row_perm, column_perm);
+        return;
+    }
+
+    if (!row_perm && !column_perm)
+        return;
+
+    _matrix_unshare(matrix);
+    data = matrix->data;
+    first = g_malloc(row_size);
+    scratch = g_malloc(row_size);
+    inverse = g_malloc(((gsize)matrix->n_rows + 1) * sizeof(guint32));
+    done = g_malloc0(matrix->n_rows);
+
+    for (i = 0; i < matrix->n_rows; ++i)
+        inverse[row_perm ? row_perm[i] : i] = i;
+
+    for (i = 0; i < matrix->n_rows; ++i) {
+        if (done[i])
+            continue;
+        if (inverse[i] == i && !column_perm) {
+            done[i] = 1;
+            continue;
+        }
+        if (inverse[i] == i) {
+            memcpy(scratch, data + i * row_size, row_size);
+            _matrix_scatter_row(data + i * row_size, scratch, column_perm, matrix->n_columns, size);
+            done[i] = 1;
+            continue;
+        }
+
+        /* row i is overwritten first, row inverse[cur] moves to cur */
+        _matrix_scatter_row(first, data + i * row_size, column_perm, matrix->n_columns, size);
+        for (cur = i; (next = inverse[cur]) != i; cur = next) {
+            _matrix_scatter_row(data + cur * row_size, data + next * row_size, column_perm,
+                                matrix->n_columns, size);
+            done[cur] = 1;
         }
+        memcpy(data + cur * row_size, first, row_size);
+        done[cur] = 1;
     }
 
-    matrix_free(tmp);
+    g_free(first);
+    g_free(scratch);
+    g_free(inverse);
+    g_free(done);
+}
+
+/* Even indices first: perm[i] = i/2 for even i, (n+1)/2 + i/2 for odd i. */
+static guint32 *_matrix_even_odd_permutation(guint32 n)
+{
+    guint32 *perm = g_malloc(((gsize)n + 1) * sizeof(guint32));
+    guint32 i;
+
+    for (i = 0; i < n; ++i)
+        perm[i] = i % 2 ? i/2 + (n + 1)/2 : i/2;
+
+    return perm;
+}
+
+/* Permutate the matrix so that we have the blocks
+ * [ c_{2i,2j}   | c_{2i,2j+1}   ]
+ * [-----------------------------]
+ * [ c_{2i+1,2j} | c_{2i+1,2j+1} ]*/
+void matrix_permutate_matrix(Matrix *matrix)
+{
+    guint32 *row_perm = _matrix_even_odd_permutation(matrix->n_rows);
+    guint32 *column_perm = _matrix_even_odd_permutation(matrix->n_columns);
+
+    matrix_permute(matrix, row_perm, column_perm);
+
+    g_free(row_perm);
+    g_free(column_perm);
+}
+
+static void _matrix_alternate_signs_row(double *values, guint32 count, guint32 row, gpointer userdata)
+{
+    guint32 j;
+
+    for (j = (row + GPOINTER_TO_UINT(userdata)) % 2; j < count; j += 2)
+        values[j] = -values[j];
 }
 
 /* Alternate the signs (-1)^{j-i} */
 void matrix_alternate_signs(Matrix *matrix, gboolean do_shift)
 {
-    guint32 i, j;
-    MatrixIter iter;
+    guint32 i;
     guint32 s = do_shift ? 0 : 1;
+    guint64 k;
 
-    for (i = 0; i < matrix->n_rows; ++i) {
-        for (j = (i+s)%2; j < matrix->n_columns; j += 2) {
-            matrix_get_iter(matrix, &iter, i, j);
-            matrix->chunks[iter.chunk][iter.offset] = - matrix->chunks[iter.chunk][iter.offset];
+    matrix->has_stats = FALSE;
+
+    if (matrix->storage == MATRIX_STORAGE_CSR) {
+        for (i = 0; i < matrix->n_rows; ++i) {
+            for (k = matrix->row_offsets[i]; k < matrix->row_offsets[i + 1]; ++k) {
+                if ((i + matrix->column_indices[k] + s) % 2 == 0)
+                    matrix->values[k] = -matrix->values[k];
+            }
         }
+        return;
     }
+
+    matrix_foreach_row(matrix, _matrix_alternate_signs_row, GUINT_TO_POINTER(s));
+}
+
+/* The elementwise transforms keep zeros, so for sparse matrices only the
+ * stored entries change. */
+static void _matrix_transform_row(double *values, guint32 count, guint32 row, gpointer userdata)
+{
+    matrix_transform_values(values, values, count, (const MatrixTransform *)userdata);
 }
 
 void matrix_log_scale(Matrix *matrix)
 {
-    MatrixIter iter;
+    static const MatrixTransform transform = { .log_scale = TRUE };
 
-    for (matrix_get_iter(matrix, &iter, 0, 0); matrix_iter_is_valid(matrix, &iter); matrix_iter_next(matrix, &iter)) {
-        if (matrix->chunks[iter.chunk][iter.offset] > 0)
-            matrix->chunks[iter.chunk][iter.offset] = log(matrix->chunks[iter.chunk][iter.offset] + 1.0f);
-        else if (matrix->chunks[iter.chunk][iter.offset] < 0)
-            matrix->chunks[iter.chunk][iter.offset] = - log( - matrix->chunks[iter.chunk][iter.offset] + 1.0f);
-    }
+    matrix_foreach_row(matrix, _matrix_transform_row, (gpointer)&transform);
 }
 
 void matrix_set_absolute(Matrix *matrix)
 {
-    MatrixIter iter;
+    static const MatrixTransform transform = { .absolute_values = TRUE };
 
-    for (matrix_get_iter(matrix, &iter, 0, 0); matrix_iter_is_valid(matrix, &iter); matrix_iter_next(matrix, &iter)) {
-        matrix->chunks[iter.chunk][iter.offset] = fabs(matrix->chunks[iter.chunk][iter.offset]);
-    }
+    matrix_foreach_row(matrix, _matrix_transform_row, (gpointer)&transform);
 }
 
 void matrix_set_signum(Matrix *matrix)
 {
-    MatrixIter iter;
+    static const MatrixTransform transform = { .show_signum = TRUE };
 
-    for (matrix_get_iter(matrix, &iter, 0, 0); matrix_iter_is_valid(matrix, &iter); matrix_iter_next(matrix, &iter)) {
-        matrix->chunks[iter.chunk][iter.offset] =
-            matrix->chunks[iter.chunk][iter.offset] > 0 ? 1.0 :
-             (matrix->chunks[iter.chunk][iter.offset] < 0 ? -1.0 : 0.0);
-    }
+    matrix_foreach_row(matrix, _matrix_transform_row, (gpointer)&transform);
 }
-
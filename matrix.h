@@ -3,36 +3,129 @@
 #include <glib.h>
 #include <stdio.h>
 
+/* initial capacity, also the block size for buffered conversions */
 #define MATRIX_CHUNK_SIZE 4096
 
 typedef struct {
     guint32 row;
     guint32 column;
-    guint32 chunk;
-    guint32 offset;
+    guint64 index;
 } MatrixIter;
 
+typedef enum {
+    MATRIX_STORAGE_DENSE = 0,
+    MATRIX_STORAGE_CSR
+} MatrixStorage;
+
+typedef enum {
+    MATRIX_PRECISION_F64 = 0,
+    MATRIX_PRECISION_F32,
+    MATRIX_PRECISION_Q16,   /* offset + scale * code, code 0..65535 */
+    MATRIX_PRECISION_Q8     /* offset + scale * code, code 0..255 */
+} MatrixPrecision;
+
+/* Indices begin, begin + step, ... below end, see matrix_parse_slice(). */
+typedef struct {
+    guint32 begin;
+    guint32 end;
+    guint32 step;
+} MatrixSlice;
+
+typedef struct {
+    MatrixSlice rows;
+    MatrixSlice columns;
+} MatrixRegion;
+
+/* Summary of the entries of a matrix, see matrix_get_stats(). NaN entries are
+ * skipped by min, max, abs_min and abs_max (min > max if there are no other
+ * entries), infinities by the sum. */
+typedef struct {
+    guint64 n_entries;      /* including implicit zeros */
+    guint64 n_zeros;
+    guint64 n_nonfinite;    /* infinities and NaN */
+    double min;
+    double max;
+    double abs_min;         /* smallest and largest |x| */
+    double abs_max;
+    double sum;
+} MatrixStats;
+
 typedef struct {
     guint32 n_rows;
     guint32 n_columns;
-    guint32 n_chunks;
-    MatrixIter last;
-    double **chunks;
+
+    /* dense entries, row by row without gaps, stored with the given precision;
+     * data is allocated with util_alloc() (capacity entries) unless it points
+     * into mapping, see matrix_map_data() */
+    MatrixPrecision precision;
+    double scale;
+    double offset;
+    gpointer data;
+    guint64 n_entries;
+    guint64 capacity;
+    GMappedFile *mapping;
+
+    /* collected while rows are appended, or on demand by matrix_get_stats();
+     * anything that changes the entries drops them */
+    gboolean has_stats;
+    MatrixStats stats;
+
+    /* MATRIX_STORAGE_CSR: the entries of row i are values[row_offsets[i]] up to
+     * values[row_offsets[i+1]-1], sorted by column_indices; data is not used */
+    MatrixStorage storage;
+    guint64 nnz;
+    guint64 *row_offsets;
+    guint32 *column_indices;
+    double *values;
 } Matrix;
 
+/* Called with the entries of a row, which may be modified. For sparse matrices
+ * these are only the stored entries (see column_indices). For quantized matrices
+ * each row is passed twice (once to find the new range), so func must not
+ * depend on earlier calls. Dense rows are processed by several threads. */
+typedef void (*MatrixRowFunc)(double *values, guint32 count, guint32 row, gpointer userdata);
+
 Matrix *matrix_new(void);
+gboolean matrix_size_is_valid(guint64 n_rows, guint64 n_columns);
+Matrix *matrix_new_csr(guint32 n_rows, guint32 n_columns, guint64 nnz);
 void matrix_iter_init(Matrix *matrix, MatrixIter *iter);
 void matrix_free(Matrix *matrix);
 gboolean matrix_iter_next(Matrix *matrix, MatrixIter *iter);
 gboolean matrix_iter_is_valid(Matrix *matrix, MatrixIter *iter);
 /*void matrix_set_value(Matrix *matrix, MatrixIter *iter, double value);*/
 void matrix_append_value(Matrix *matrix, MatrixIter *iter, double value);
+void matrix_append_row(Matrix *matrix, const double *values, guint64 count);
+void matrix_append_matrix(Matrix *matrix, Matrix *other);
+void matrix_map_data(Matrix *matrix, GMappedFile *mapping, gconstpointer data, guint64 count);
 gboolean matrix_get_iter(Matrix *matrix, MatrixIter *iter, guint32 row, guint32 column);
+void matrix_init_dense(Matrix *matrix, guint32 n_rows, guint32 n_columns, MatrixPrecision precision,
+                       double min, double max);
+void matrix_get_values(Matrix *matrix, guint64 index, guint64 count, double *values);
+void matrix_get_strided(Matrix *matrix, guint64 index, guint64 stride, guint32 count, double *values);
+void matrix_set_values(Matrix *matrix, guint64 index, guint64 count, const double *values);
+const double *matrix_row(Matrix *matrix, guint32 row, double *scratch);
+const double *matrix_column(Matrix *matrix, guint32 column, double *scratch);
+void matrix_foreach_row(Matrix *matrix, MatrixRowFunc func, gpointer userdata);
+
+gboolean matrix_parse_slice(const gchar *str, MatrixSlice *slice);
+void matrix_region_init(MatrixRegion *region);
+guint32 matrix_slice_count(const MatrixSlice *slice, guint32 n);
+gboolean matrix_region_is_all(const MatrixRegion *region, guint32 n_rows, guint32 n_columns);
+void matrix_slice(Matrix *matrix, const MatrixRegion *region);
 
-GList *matrix_read_from_file(int fd);
+gboolean matrix_parse_precision(const gchar *name, MatrixPrecision *precision);
+gsize matrix_precision_size(MatrixPrecision precision);
+void matrix_set_precision(Matrix *matrix, MatrixPrecision precision);
 
 void matrix_copy(Matrix *dst, Matrix *src);
 Matrix *matrix_dup(Matrix *matrix);
+const MatrixStats *matrix_get_stats(Matrix *matrix);
+void matrix_get_range(Matrix *matrix, double *min, double *max);
+void matrix_stats_init(MatrixStats *stats);
+void matrix_stats_update(MatrixStats *stats, const double *values, guint64 count);
+void matrix_stats_merge(MatrixStats *stats, const MatrixStats *other);
+void matrix_stats_get_range(const MatrixStats *stats, double *min, double *max);
+void matrix_permute(Matrix *matrix, const guint32 *row_perm, const guint32 *column_perm);
 void matrix_permutate_matrix(Matrix *matrix);
 void matrix_alternate_signs(Matrix *matrix, gboolean do_shift);
 void matrix_log_scale(Matrix *matrix);
@@ -33,6 +33,8 @@ ExportFileType mesh_export_get_type_from_filename(const gchar *filename)
         return ExportFileTypePNG;
     if (g_str_has_suffix(filename, ".tex"))
         return ExportFileTypeTikZ;
+    if (g_str_has_suffix(filename, ".ply"))
+        return ExportFileTypePLY;
 
     return ExportFileTypeUnknown;
 }
@@ -89,6 +91,7 @@ void _mesh_face_update_bounding_box(struct SVGFace *face)
 GList *mesh_export_generate_faces(MatrixMesh *mesh, double *projection, UtilRectangle *bounding_box)
 {
     MatrixMeshIter iter;
+    MatrixMeshFace mesh_face;
     GList *faces = NULL;
     struct SVGFace *face;
     guint8 j;
@@ -108,9 +111,10 @@ GList *mesh_export_generate_faces(MatrixMesh *mesh, double *projection, UtilRect
 
         /* FIXME: only pack pointers in list and use chunk saving? */
         face = g_malloc0(sizeof(struct SVGFace));
+        matrix_mesh_get_face(mesh, &iter, &mesh_face);
 
         for (j = 0; j < 4; ++j) {
-            mesh_export_world_to_screen(projection, mesh->chunk_faces[iter.chunk][iter.offset].vertices[j], face->vertices[j]);
+            mesh_export_world_to_screen(projection, mesh_face.vertices[j], face->vertices[j]);
         }
 /*        _mesh_face_update_bounding_box(face);*/
 
@@ -133,20 +137,20 @@ GList *mesh_export_generate_faces(MatrixMesh *mesh, double *projection, UtilRect
         }
     
 
-        face->color[0] = mesh->chunk_faces[iter.chunk][iter.offset].color_rgba[0];
-        face->color[1] = mesh->chunk_faces[iter.chunk][iter.offset].color_rgba[1];
-        face->color[2] = mesh->chunk_faces[iter.chunk][iter.offset].color_rgba[2];
-        face->color[3] = mesh->chunk_faces[iter.chunk][iter.offset].color_rgba[3];
+        face->color[0] = mesh_face.color_rgba[0];
+        face->color[1] = mesh_face.color_rgba[1];
+        face->color[2] = mesh_face.color_rgba[2];
+        face->color[3] = mesh_face.color_rgba[3];
 
         /* use center in z=0 plane; this provides correct results in our special setting */
-        zrefpoint[0] = 0.25f * (mesh->chunk_faces[iter.chunk][iter.offset].vertices[0][0] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[1][0] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[2][0] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[3][0]);
-        zrefpoint[1] = 0.25f * (mesh->chunk_faces[iter.chunk][iter.offset].vertices[0][1] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[1][1] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[2][1] +
-                                mesh->chunk_faces[iter.chunk][iter.offset].vertices[3][1]);
+        zrefpoint[0] = 0.25f * (mesh_face.vertices[0][0] +
+                                mesh_face.vertices[1][0] +
+                                mesh_face.vertices[2][0] +
+                                mesh_face.vertices[3][0]);
+        zrefpoint[1] = 0.25f * (mesh_face.vertices[0][1] +
+                                mesh_face.vertices[1][1] +
+                                mesh_face.vertices[2][1] +
+                                mesh_face.vertices[3][1]);
         zrefpoint[2] = 0.0f;
         mesh_export_world_to_screen(projection, zrefpoint, zrefproj);
 
@@ -668,6 +672,80 @@ gboolean _mesh_export_write_faces(const gchar *filename, ExportFileType type, Ma
     return TRUE;
 }
 
+static void _mesh_export_put_uint32(guint8 *buffer, guint32 value)
+{
+    value = GUINT32_TO_LE(value);
+    memcpy(buffer, &value, sizeof(guint32));
+}
+
+/* The mesh as a 3D model in binary PLY, in world coordinates: the shared
+ * corners (see matrix_mesh_get_indexed()), then the faces with the indices of
+ * their corners and their color. */
+gboolean _mesh_export_write_ply(const gchar *filename, MatrixMesh *mesh)
+{
+    MatrixMeshIndexed *indexed = matrix_mesh_get_indexed(mesh);
+    guint8 buffer[1024 * 21];
+    gsize length = 0;
+    double color[4];
+    guint32 bits, v;
+    guint64 k;
+    guint j;
+    FILE *file;
+    gboolean success;
+
+    if (!indexed)
+        return FALSE;
+
+    if ((file = fopen(filename, "wb")) == NULL) {
+        fprintf(stderr, "Could not open `%s'.\n", filename);
+        matrix_mesh_indexed_free(indexed);
+        return FALSE;
+    }
+
+    fprintf(file, "ply\nformat binary_little_endian 1.0\ncomment render-matrix\n"
+            "element vertex %u\nproperty float x\nproperty float y\nproperty float z\n"
+            "element face %" G_GUINT64_FORMAT "\nproperty list uchar uint vertex_indices\n"
+            "property uchar red\nproperty uchar green\nproperty uchar blue\nproperty uchar alpha\n"
+            "end_header\n", indexed->n_vertices, indexed->n_faces);
+
+    /* make room for each record before it is written: 3 floats for a vertex,
+     * a count, 4 indices and 4 color channels for a face */
+    for (v = 0; v < indexed->n_vertices; ++v) {
+        if (length + 12 > sizeof(buffer)) {
+            fwrite(buffer, 1, length, file);
+            length = 0;
+        }
+        for (j = 0; j < 3; ++j, length += 4) {
+            memcpy(&bits, &indexed->vertices[3 * (gsize)v + j], sizeof(guint32));
+            _mesh_export_put_uint32(buffer + length, bits);
+        }
+    }
+
+    for (k = 0; k < indexed->n_faces; ++k) {
+        if (length + 21 > sizeof(buffer)) {
+            fwrite(buffer, 1, length, file);
+            length = 0;
+        }
+        buffer[length++] = 4;
+        for (j = 0; j < 4; ++j, length += 4)
+            _mesh_export_put_uint32(buffer + length, indexed->indices[4 * k + j]);
+        matrix_mesh_indexed_get_color(indexed, k, color);
+        for (j = 0; j < 4; ++j)
+            buffer[length++] = (guint8)(CLAMP(color[j], 0.0, 1.0) * 255.0 + 0.5);
+    }
+    fwrite(buffer, 1, length, file);
+
+    success = !ferror(file);
+    if (fclose(file) != 0)
+        success = FALSE;
+    if (!success)
+        fprintf(stderr, "Could not write `%s'.\n", filename);
+
+    matrix_mesh_indexed_free(indexed);
+
+    return success;
+}
+
 gboolean mesh_export_to_file(const gchar *filename, ExportFileType type, MatrixMesh *mesh, double *projection,
                              ExportConfig *config)
 {
@@ -675,6 +753,9 @@ gboolean mesh_export_to_file(const gchar *filename, ExportFileType type, MatrixM
     g_return_val_if_fail(filename != NULL, FALSE);
     g_return_val_if_fail(projection != NULL, FALSE);
 
+    if (type == ExportFileTypePLY)
+        return _mesh_export_write_ply(filename, mesh);
+
     UtilRectangle bounding_box;
     GList *faces = mesh_export_generate_faces(mesh, projection, &bounding_box);
 
@@ -728,47 +809,70 @@ gchar *_mesh_export_generate_filename(const gchar *base, guint64 offset)
     return g_string_free(str, FALSE);
 }
 
-gboolean mesh_export_matrices_to_files(const gchar *filename_base, ExportFileType type, GList *matrices, double *projection,
-                                       ExportConfig *config)
+/* Mesh of frame index on mesh, which follows the previous frame in place (see
+ * matrix_mesh_change_view()); FALSE if the frame cannot be read. */
+static gboolean _mesh_export_set_frame(MatrixMesh *mesh, MatrixFrames *frames, guint index, ExportConfig *config)
 {
-    g_return_val_if_fail(matrices != NULL, FALSE);
+    Matrix *m = matrix_frames_get(frames, index);
+    MatrixView *view;
+
+    if (!m)
+        return FALSE;
+
+    view = matrix_view_get(m, &config->region, &config->transform);
+    matrix_mesh_change_view(mesh, view);
+    matrix_view_unref(view);
+
+    return TRUE;
+}
+
+/* Export each frame into a file of its own. The frames are read one at a time
+ * (see matrix_frames_get()), so only the most recent ones are in memory. */
+gboolean mesh_export_matrices_to_files(const gchar *filename_base, ExportFileType type, MatrixFrames *frames,
+                                       double *projection, ExportConfig *config)
+{
+    g_return_val_if_fail(frames != NULL, FALSE);
     g_return_val_if_fail(filename_base != NULL, FALSE);
     g_return_val_if_fail(projection != NULL, FALSE);
 
-    guint offset;
+    guint offset, count = matrix_frames_get_count(frames);
     gchar *filename;
-    GList *faces_list = NULL;
-    GList *mesh_list = NULL;
+    GList *faces;
     MatrixMesh *mesh;
     UtilRectangle bounding_box, bb;
-    GList *tmpm, *tmpf;
     gboolean bb_initialized = FALSE;
+    gboolean success = TRUE;
+
+    mesh = matrix_mesh_new();
+    matrix_mesh_set_alpha_channel(mesh, config->alpha_channel);
+    matrix_mesh_set_track_changes(mesh, count > 1);
+
+    /* 3D models do not need a common bounding box */
+    if (type == ExportFileTypePLY) {
+        for (offset = 0; offset < count; ++offset) {
+            if (!_mesh_export_set_frame(mesh, frames, offset, config))
+                continue;
+
+            filename = _mesh_export_generate_filename(filename_base, offset);
+            if (!_mesh_export_write_ply(filename, mesh)) {
+                g_printerr("Failed to write faces for mesh %u.\n", offset + 1);
+                success = FALSE;
+            }
+            g_free(filename);
+        }
+        matrix_mesh_free(mesh);
 
-    Matrix *work = matrix_new();
-
-    /* first pass: generate all faces and determine bounding box */
-    for (tmpm = matrices; tmpm != NULL; tmpm = g_list_next(tmpm)) {
-        mesh = matrix_mesh_new();
-        matrix_mesh_set_alpha_channel(mesh, config->alpha_channel);
-
-        /* modify work matrix */
-        matrix_copy(work, (Matrix *)tmpm->data);
-        if (config->log_scale)
-            matrix_log_scale(work);
-        if (config->permutate_entries)
-            matrix_permutate_matrix(work);
-        if (config->alternate_signs)
-            matrix_alternate_signs(work, config->shift_signs);
-        if (config->absolute_values)
-            matrix_set_absolute(work);
-        if (config->show_signum)
-            matrix_set_signum(work);
+        return success;
+    }
 
-        matrix_mesh_set_matrix(mesh, work);
-        mesh_list = g_list_prepend(mesh_list, mesh);
+    /* first pass: determine the common bounding box; the faces are made again
+     * in the second pass instead of keeping those of all frames */
+    for (offset = 0; offset < count; ++offset) {
+        if (!_mesh_export_set_frame(mesh, frames, offset, config))
+            continue;
 
-        faces_list = g_list_prepend(faces_list,
-                mesh_export_generate_faces(mesh, projection, &bb));
+        faces = mesh_export_generate_faces(mesh, projection, &bb);
+        g_list_free_full(faces, g_free);
 
         if (G_LIKELY(bb_initialized))
             util_rectangle_bounds(&bounding_box, &bounding_box, &bb);
@@ -778,24 +882,26 @@ gboolean mesh_export_matrices_to_files(const gchar *filename_base, ExportFileTyp
         }
     }
 
-    matrix_free(work);
-
-    faces_list = g_list_reverse(faces_list);
-    mesh_list = g_list_reverse(mesh_list);
+    if (!bb_initialized) {
+        matrix_mesh_free(mesh);
+        return FALSE;
+    }
 
     g_print("bounding box: @(%f, %f) %f x %f\n", bounding_box.x, bounding_box.y, bounding_box.width, bounding_box.height);
 
     /* second pass: write files */
-    for (tmpm = mesh_list, tmpf = faces_list, offset = 0;
-            tmpm && tmpf;
-            tmpm = g_list_next(tmpm), tmpf = g_list_next(tmpf), ++offset) {
+    for (offset = 0; offset < count; ++offset) {
+        if (!_mesh_export_set_frame(mesh, frames, offset, config))
+            continue;
+
+        faces = mesh_export_generate_faces(mesh, projection, &bb);
         filename = _mesh_export_generate_filename(filename_base, offset);
-        if (!_mesh_export_write_faces(filename, type, (MatrixMesh *)tmpm->data,
-                    (GList *)tmpf->data, projection, config, &bounding_box))
+        if (!_mesh_export_write_faces(filename, type, mesh, faces, projection, config, &bounding_box))
             g_printerr("Failed to write faces for mesh %u.\n", offset + 1);
-        g_list_free_full((GList *)tmpf->data, g_free);
-        matrix_mesh_free((MatrixMesh *)tmpm->data);
+        g_free(filename);
+        g_list_free_full(faces, g_free);
     }
-    
+    matrix_mesh_free(mesh);
+
     return TRUE;
 }
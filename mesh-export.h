@@ -2,6 +2,8 @@
 
 #include <glib.h>
 #include "matrix-mesh.h"
+#include "matrix-transform.h"
+#include "matrix-frames.h"
 
 typedef enum {
     ExportFileTypeUnknown = -1,
@@ -9,6 +11,7 @@ typedef enum {
     ExportFileTypePDF,
     ExportFileTypePNG,
     ExportFileTypeTikZ,
+    ExportFileTypePLY,
 } ExportFileType;
 
 typedef struct {
@@ -22,17 +25,13 @@ typedef struct {
     double colorbar_pos_x;
     double alpha_channel;
 
-    gboolean permutate_entries;
-    gboolean alternate_signs;
-    gboolean shift_signs;
-    gboolean log_scale;
-    gboolean absolute_values;
-    gboolean show_signum;
+    MatrixRegion region;
+    MatrixTransform transform;
 } ExportConfig;
 
 ExportFileType mesh_export_get_type_from_filename(const gchar *filename);
 
 gboolean mesh_export_to_file(const gchar *filename, ExportFileType type, MatrixMesh *mesh, double *projection,
                              ExportConfig *config);
-gboolean mesh_export_matrices_to_files(const gchar *filename_base, ExportFileType type, GList *matrices, double *projection,
-                                       ExportConfig *config);
+gboolean mesh_export_matrices_to_files(const gchar *filename_base, ExportFileType type, MatrixFrames *frames,
+                                       double *projection, ExportConfig *config);
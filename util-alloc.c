@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include "util-alloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static gboolean util_alloc_huge_pages = TRUE;
+
+void util_alloc_set_huge_pages(gboolean enable)
+{
+    util_alloc_huge_pages = enable;
+}
+
+static inline gsize _util_alloc_page_align(gsize size)
+{
+    gsize page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void _util_alloc_advise(gpointer ptr, gsize size)
+{
+#ifdef MADV_HUGEPAGE
+    if (util_alloc_huge_pages)
+        madvise(ptr, _util_alloc_page_align(size), MADV_HUGEPAGE);
+#endif
+}
+
+gpointer util_alloc(gsize size)
+{
+    gpointer ptr;
+
+    if (size == 0)
+        return NULL;
+
+    if (size >= UTIL_ALLOC_LARGE) {
+        ptr = mmap(NULL, _util_alloc_page_align(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            g_error("Could not allocate %" G_GSIZE_FORMAT " bytes: %s", size, g_strerror(errno));
+        _util_alloc_advise(ptr, size);
+    }
+    else if (posix_memalign(&ptr, UTIL_ALLOC_ALIGNMENT, size) != 0) {
+        g_error("Could not allocate %" G_GSIZE_FORMAT " bytes", size);
+    }
+
+    return ptr;
+}
+
+/* Resize a buffer from util_alloc(); the contents up to the smaller size are kept. */
+gpointer util_realloc(gpointer ptr, gsize old_size, gsize size)
+{
+    gpointer new_ptr;
+
+    if (ptr == NULL)
+        return util_alloc(size);
+
+#ifdef MREMAP_MAYMOVE
+    if (old_size >= UTIL_ALLOC_LARGE && size >= UTIL_ALLOC_LARGE) {
+        new_ptr = mremap(ptr, _util_alloc_page_align(old_size), _util_alloc_page_align(size), MREMAP_MAYMOVE);
+        if (new_ptr == MAP_FAILED)
+            g_error("Could not allocate %" G_GSIZE_FORMAT " bytes: %s", size, g_strerror(errno));
+        _util_alloc_advise(new_ptr, size);
+        return new_ptr;
+    }
+#endif
+
+    new_ptr = util_alloc(size);
+    memcpy(new_ptr, ptr, MIN(old_size, size));
+    util_free(ptr, old_size);
+
+    return new_ptr;
+}
+
+void util_free(gpointer ptr, gsize size)
+{
+    if (ptr == NULL)
+        return;
+
+    if (size >= UTIL_ALLOC_LARGE)
+        munmap(ptr, _util_alloc_page_align(size));
+    else
+        free(ptr);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+
+/* Buffers for large arrays, aligned to at least UTIL_ALLOC_ALIGNMENT bytes.
+ * Buffers of UTIL_ALLOC_LARGE bytes or more are mapped directly from the
+ * kernel, grow without copying where possible and are backed by transparent
+ * huge pages unless disabled, so passes over large matrices do not spend their
+ * time in TLB misses. */
+
+#define UTIL_ALLOC_ALIGNMENT 64
+#define UTIL_ALLOC_LARGE (2 << 20)
+
+void util_alloc_set_huge_pages(gboolean enable);
+gpointer util_alloc(gsize size);
+gpointer util_realloc(gpointer ptr, gsize old_size, gsize size);
+void util_free(gpointer ptr, gsize size);
@@ -0,0 +1,121 @@
+#include "util-parallel.h"
+
+typedef struct {
+    UtilParallelFunc func;
+    gpointer userdata;
+    guint64 n;
+    guint n_bands;
+
+    gint next_band;
+    gint ref_count;
+
+    GMutex lock;
+    GCond cond;
+    guint finished;
+} UtilParallelTask;
+
+static guint util_parallel_threads = 1;
+static GThreadPool *util_parallel_pool = NULL;
+static GMutex util_parallel_pool_lock;
+
+void util_parallel_set_threads(guint n_threads)
+{
+    util_parallel_threads = n_threads > 0 ? n_threads : 1;
+
+    g_mutex_lock(&util_parallel_pool_lock);
+    if (util_parallel_pool)
+        g_thread_pool_set_max_threads(util_parallel_pool, util_parallel_threads - 1, NULL);
+    g_mutex_unlock(&util_parallel_pool_lock);
+}
+
+guint util_parallel_get_threads(void)
+{
+    return util_parallel_threads;
+}
+
+/* Number of bands for n items, each about work_per_item units of work. */
+guint util_parallel_get_bands(guint64 n, guint64 work_per_item)
+{
+    guint64 bands = n * MAX(work_per_item, 1) / UTIL_PARALLEL_MIN_WORK;
+
+    bands = MIN(bands, n);
+    bands = MIN(bands, util_parallel_threads);
+
+    return bands > 0 ? (guint)bands : 1;
+}
+
+static void _util_parallel_task_unref(UtilParallelTask *task)
+{
+    if (!g_atomic_int_dec_and_test(&task->ref_count))
+        return;
+
+    g_mutex_clear(&task->lock);
+    g_cond_clear(&task->cond);
+    g_free(task);
+}
+
+/* Take bands until none are left. */
+static void _util_parallel_work(UtilParallelTask *task, gpointer unused)
+{
+    guint band, done = 0;
+
+    while ((band = (guint)g_atomic_int_add(&task->next_band, 1)) < task->n_bands) {
+        task->func(task->n * band / task->n_bands, task->n * (band + 1) / task->n_bands,
+                   band, task->userdata);
+        ++done;
+    }
+
+    if (done) {
+        g_mutex_lock(&task->lock);
+        task->finished += done;
+        if (task->finished == task->n_bands)
+            g_cond_signal(&task->cond);
+        g_mutex_unlock(&task->lock);
+    }
+
+    _util_parallel_task_unref(task);
+}
+
+/* Call func for each of n_bands bands of [0, n) and return when all are done.
+ * Band k is [k*n/n_bands, (k+1)*n/n_bands), so callers may keep per-band
+ * results (e.g. partial minima) in an array of n_bands entries. */
+void util_parallel_for(guint64 n, guint n_bands, UtilParallelFunc func, gpointer userdata)
+{
+    UtilParallelTask *task;
+    guint k;
+
+    if (n_bands <= 1 || util_parallel_threads <= 1) {
+        for (k = 0; k < n_bands; ++k)
+            func(n * k / n_bands, n * (k + 1) / n_bands, k, userdata);
+        return;
+    }
+
+    g_mutex_lock(&util_parallel_pool_lock);
+    if (!util_parallel_pool)
+        util_parallel_pool = g_thread_pool_new((GFunc)_util_parallel_work, NULL,
+                                               util_parallel_threads - 1, FALSE, NULL);
+    g_mutex_unlock(&util_parallel_pool_lock);
+
+    task = g_malloc0(sizeof(UtilParallelTask));
+    task->func = func;
+    task->userdata = userdata;
+    task->n = n;
+    task->n_bands = n_bands;
+    /* one reference for each helper, two for the caller */
+    task->ref_count = n_bands + 1;
+    g_mutex_init(&task->lock);
+    g_cond_init(&task->cond);
+
+    /* helpers that start after all bands are taken just drop their reference */
+    for (k = 1; k < n_bands; ++k)
+        g_thread_pool_push(util_parallel_pool, task, NULL);
+
+    _util_parallel_work(task, NULL);
+
+    g_mutex_lock(&task->lock);
+    while (task->finished < task->n_bands)
+        g_cond_wait(&task->cond, &task->lock);
+    g_mutex_unlock(&task->lock);
+
+    _util_parallel_task_unref(task);
+}
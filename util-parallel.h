@@ -0,0 +1,17 @@
+#pragma once
+
+#include <glib.h>
+
+/* Split the range [0, n) into bands of consecutive items (usually rows) and
+ * process them on a shared pool of threads. The calling thread works on the
+ * bands as well, so nested calls from worker threads do not block. */
+
+/* smallest amount of work (e.g. matrix entries) worth a thread of its own */
+#define UTIL_PARALLEL_MIN_WORK (1 << 16)
+
+typedef void (*UtilParallelFunc)(guint64 begin, guint64 end, guint band, gpointer userdata);
+
+void util_parallel_set_threads(guint n_threads);
+guint util_parallel_get_threads(void);
+guint util_parallel_get_bands(guint64 n, guint64 work_per_item);
+void util_parallel_for(guint64 n, guint n_bands, UtilParallelFunc func, gpointer userdata);
@@ -0,0 +1,241 @@
+#include "util-sketch.h"
+#include <math.h>
+#include <string.h>
+
+UtilSketch *util_sketch_new(void)
+{
+    UtilSketch *sketch = g_malloc0(sizeof(UtilSketch));
+
+    sketch->min = INFINITY;
+    sketch->max = -INFINITY;
+
+    return sketch;
+}
+
+void util_sketch_free(UtilSketch *sketch)
+{
+    if (!sketch)
+        return;
+
+    g_free(sketch->means);
+    g_free(sketch->weights);
+    g_free(sketch->buffer);
+    g_free(sketch);
+}
+
+/* Sort n finite values by radix on their bits, mapped to unsigned integers of
+ * the same order; bytes that are equal for all values are skipped. Radix passes
+ * do not depend on the order of the input, unlike comparisons, which mostly
+ * fail to be predicted on random data. */
+static void _util_sketch_sort(double *values, guint32 n)
+{
+    guint32 counts[8][256], offsets[256];
+    guint64 *keys = g_malloc(2 * (gsize)n * sizeof(guint64));
+    guint64 *src = keys, *dst = keys + n, *tmp, key;
+    guint32 i, d, sum;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; ++i) {
+        memcpy(&key, values + i, sizeof(guint64));
+        key ^= (key >> 63) ? G_MAXUINT64 : G_GUINT64_CONSTANT(0x8000000000000000);
+        src[i] = key;
+        for (d = 0; d < 8; ++d)
+            ++counts[d][(key >> (8 * d)) & 0xff];
+    }
+
+    for (d = 0; d < 8; ++d) {
+        if (counts[d][(src[0] >> (8 * d)) & 0xff] == n)
+            continue;
+        for (i = 0, sum = 0; i < 256; ++i) {
+            offsets[i] = sum;
+            sum += counts[d][i];
+        }
+        for (i = 0; i < n; ++i)
+            dst[offsets[(src[i] >> (8 * d)) & 0xff]++] = src[i];
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    for (i = 0; i < n; ++i) {
+        key = src[i];
+        key ^= (key >> 63) ? G_GUINT64_CONSTANT(0x8000000000000000) : G_MAXUINT64;
+        memcpy(values + i, &key, sizeof(guint64));
+    }
+
+    g_free(keys);
+}
+
+/* Largest fraction of the total weight a centroid starting at q may reach: one
+ * step of the scale function k(q) = compression / (2 pi) * asin(2q - 1). */
+static inline double _util_sketch_limit(double q)
+{
+    double k = asin(CLAMP(2.0 * q - 1.0, -1.0, 1.0)) + 2.0 * G_PI / UTIL_SKETCH_COMPRESSION;
+
+    return k >= G_PI / 2 ? 1.0 : (sin(k) + 1.0) / 2.0;
+}
+
+/* Replace the centroids by those of the union with the n centroids in means and
+ * weights (both sorted by mean, weights NULL for single values): runs of
+ * neighbours are merged as long as they fit below the limit. */
+static void _util_sketch_fold(UtilSketch *sketch, const double *means, const double *weights, guint32 n)
+{
+    guint32 na = sketch->n_centroids, i = 0, j = 0, count = 0;
+    double *out_means, *out_weights;
+    double total = sketch->total_weight, so_far = 0.0, limit, m, w, mean, weight;
+
+    if (n == 0)
+        return;
+
+    for (j = 0; j < n; ++j)
+        total += weights ? weights[j] : 1.0;
+
+    out_means = g_malloc((na + n) * sizeof(double));
+    out_weights = g_malloc((na + n) * sizeof(double));
+    limit = total * _util_sketch_limit(0.0);
+    mean = weight = 0.0;
+
+    for (i = 0, j = 0; i < na || j < n; ) {
+        if (j == n || (i < na && sketch->means[i] <= means[j])) {
+            m = sketch->means[i];
+            w = sketch->weights[i++];
+        }
+        else {
+            m = means[j];
+            w = weights ? weights[j] : 1.0;
+            ++j;
+        }
+
+        if (weight > 0.0 && so_far + weight + w <= limit) {
+            weight += w;
+            mean += (m - mean) * w / weight;
+            continue;
+        }
+
+        if (weight > 0.0) {
+            out_means[count] = mean;
+            out_weights[count++] = weight;
+            so_far += weight;
+            limit = total * _util_sketch_limit(so_far / total);
+        }
+        mean = m;
+        weight = w;
+    }
+
+    out_means[count] = mean;
+    out_weights[count++] = weight;
+
+    g_free(sketch->means);
+    g_free(sketch->weights);
+    sketch->means = g_renew(double, out_means, count);
+    sketch->weights = g_renew(double, out_weights, count);
+    sketch->n_centroids = count;
+    sketch->total_weight = total;
+}
+
+/* Fold the buffered values into the centroids and release the buffer. */
+void util_sketch_compress(UtilSketch *sketch)
+{
+    if (!sketch->n_buffered)
+        return;
+
+    _util_sketch_sort(sketch->buffer, sketch->n_buffered);
+    _util_sketch_fold(sketch, sketch->buffer, NULL, sketch->n_buffered);
+
+    g_free(sketch->buffer);
+    sketch->buffer = NULL;
+    sketch->n_buffered = 0;
+}
+
+void util_sketch_add(UtilSketch *sketch, const double *values, guint64 count)
+{
+    guint64 k;
+    double x;
+
+    for (k = 0; k < count; ++k) {
+        x = values[k];
+        if (!isfinite(x))
+            continue;
+
+        if (sketch->n_buffered == UTIL_SKETCH_BUFFER_SIZE)
+            util_sketch_compress(sketch);
+        if (!sketch->buffer)
+            sketch->buffer = g_malloc(UTIL_SKETCH_BUFFER_SIZE * sizeof(double));
+
+        sketch->buffer[sketch->n_buffered++] = x;
+        sketch->min = x < sketch->min ? x : sketch->min;
+        sketch->max = x > sketch->max ? x : sketch->max;
+    }
+}
+
+/* Add value weight times, e.g. the zeros a sparse matrix does not store. */
+void util_sketch_add_weighted(UtilSketch *sketch, double value, double weight)
+{
+    if (!isfinite(value) || !(weight > 0.0))
+        return;
+
+    util_sketch_compress(sketch);
+    _util_sketch_fold(sketch, &value, &weight, 1);
+    sketch->min = value < sketch->min ? value : sketch->min;
+    sketch->max = value > sketch->max ? value : sketch->max;
+}
+
+/* Add the values summarized by other, which is left as it is apart from being
+ * compressed. */
+void util_sketch_merge(UtilSketch *sketch, UtilSketch *other)
+{
+    util_sketch_compress(sketch);
+    util_sketch_compress(other);
+
+    _util_sketch_fold(sketch, other->means, other->weights, other->n_centroids);
+    sketch->min = other->min < sketch->min ? other->min : sketch->min;
+    sketch->max = other->max > sketch->max ? other->max : sketch->max;
+}
+
+/* Value below which about a fraction q of the values lies, interpolated between
+ * the centroids and the smallest and largest value; NaN for no values. */
+double util_sketch_quantile(UtilSketch *sketch, double q)
+{
+    const double *m, *w;
+    double total, index, cum, dw, half;
+    guint32 n, i;
+
+    util_sketch_compress(sketch);
+    n = sketch->n_centroids;
+    total = sketch->total_weight;
+
+    m = sketch->means;
+    w = sketch->weights;
+
+    if (n == 0)
+        return NAN;
+    if (n == 1)
+        return m[0];
+
+    index = CLAMP(q, 0.0, 1.0) * total;
+
+    if (index < 1.0)
+        return sketch->min;
+    if (index > total - 1.0)
+        return sketch->max;
+
+    /* between the smallest value and the center of the first centroid */
+    half = w[0] / 2.0;
+    if (index < half)
+        return sketch->min + (index - 1.0) / (half - 1.0) * (m[0] - sketch->min);
+
+    cum = half;
+    for (i = 0; i + 1 < n; ++i) {
+        dw = (w[i] + w[i + 1]) / 2.0;
+        if (cum + dw > index)
+            return (m[i] * (cum + dw - index) + m[i + 1] * (index - cum)) / dw;
+        cum += dw;
+    }
+
+    /* between the center of the last centroid and the largest value */
+    half = w[n - 1] / 2.0;
+    if (half <= 1.0)
+        return m[n - 1];
+
+    return m[n - 1] + (index - cum) / (half - 1.0) * (sketch->max - m[n - 1]);
+}
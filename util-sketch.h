@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glib.h>
+
+/* Quantiles of a stream of values in little memory (a merging t-digest):
+ * values are buffered, sorted and folded into weighted centroids, which are
+ * smallest near both ends, so extreme quantiles are the most accurate. Sketches
+ * of consecutive parts of a stream can be merged. Non-finite values are skipped. */
+
+/* about the largest number of centroids kept */
+#define UTIL_SKETCH_COMPRESSION 200.0
+#define UTIL_SKETCH_BUFFER_SIZE 4096
+
+typedef struct {
+    guint32 n_centroids;
+    double *means;
+    double *weights;
+    double total_weight;
+    double min;
+    double max;
+
+    /* values not folded into the centroids yet */
+    double *buffer;
+    guint32 n_buffered;
+} UtilSketch;
+
+UtilSketch *util_sketch_new(void);
+void util_sketch_free(UtilSketch *sketch);
+void util_sketch_add(UtilSketch *sketch, const double *values, guint64 count);
+void util_sketch_add_weighted(UtilSketch *sketch, double value, double weight);
+void util_sketch_merge(UtilSketch *sketch, UtilSketch *other);
+void util_sketch_compress(UtilSketch *sketch);
+double util_sketch_quantile(UtilSketch *sketch, double q);